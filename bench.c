@@ -0,0 +1,528 @@
+// bench: lexer throughput harness behind `make bench`.
+//
+// Every workload pairs a grammar with a corpus generated from a fixed seed, so
+// two runs of the same binary lex byte-identical input and results can be
+// compared across commits. Each workload/engine pair runs in its own child
+// process so that the reported peak RSS belongs to that pair alone.
+//
+//   bench [--json] [--engine=nfa|dfa|lazy] [--workload=NAME] [--size=MIB]
+//         [--passes=N] [--seed=N]
+//
+// Throughput is taken from the fastest of the timed passes over the corpus;
+// registration and compile times are measured once per run.
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clex.h"
+
+#define BENCH_KEYWORD_COUNT 1000
+
+typedef struct benchBuffer {
+  char* data;
+  size_t length;
+  size_t capacity;
+} benchBuffer;
+
+typedef struct benchGrammar {
+  const char** rules;
+  size_t count;
+} benchGrammar;
+
+typedef struct benchWorkload {
+  const char* name;
+  bool (*grammar)(benchGrammar* out, uint64_t* seed);
+  bool (*corpus)(benchBuffer* out, size_t size, uint64_t* seed);
+} benchWorkload;
+
+typedef struct benchResult {
+  int ok;
+  size_t rules;
+  size_t bytes;
+  size_t tokens;
+  size_t errors;
+  double register_ms;
+  double compile_ms;
+  double lex_seconds;
+  long peak_rss_kb;
+} benchResult;
+
+typedef struct benchOptions {
+  bool json;
+  const char* engine;
+  const char* workload;
+  size_t size;
+  int passes;
+  uint64_t seed;
+} benchOptions;
+
+// The C grammar from the TEST_CLEX suite, in the same priority order. The
+// corpora stick to tokens it lexes without errors: no rule that starts with
+// `-` matches, hexadecimal constants do not match, and integer constants are
+// only matched reliably when they have an even number of nonzero digits.
+static const char* cRules[] = {
+    "auto", "_Bool", "break", "case", "char", "_Complex", "const", "continue",
+    "default", "do", "double", "else", "enum", "extern", "float", "for",
+    "goto", "if", "_Imaginary", "inline", "int", "long", "register",
+    "restrict", "return", "short", "signed", "sizeof", "static", "struct",
+    "switch", "typedef", "union", "unsigned", "void", "volatile", "while",
+    "...", ">>=", "<<=", "\\+=", "-=", "\\*=", "/=", "%=", "&=", "^=",
+    "\\|=", ">>", "<<", "\\+\\+", "--", "->", "&&", "\\|\\|", "<=", ">=",
+    "==", "!=", ";", "{|<%", "}|%>", ",", ":", "=", "\\(", "\\)", "\\[|<:",
+    "\\]|:>", ".", "&", "!", "~", "-", "\\+", "\\*", "/", "%", "<", ">", "^",
+    "\\|", "\\?", "L?\"[ -~]*\"", "0[xX][a-fA-F0-9]+([uU])?([lL])?([lL])?",
+    "0[0-7]*([uU])?([lL])?([lL])?", "[1-9][0-9]*([uU])?([lL])?([lL])?",
+    "L?'[ -~]*'", "[0-9]+[Ee][+-]?[0-9]+[fFlL]",
+    "[0-9]*.[0-9]+[Ee][+-]?[fFlL]", "[0-9]+.[0-9]*[Ee][+-]?[fFlL]",
+    "0[xX][a-fA-F0-9]+[Pp][+-]?[0-9]+([fFlL])?",
+    "0[xX][a-fA-F0-9]*.[a-fA-F0-9]+[Pp][+-]?[0-9]+([fFlL])?",
+    "0[xX][a-fA-F0-9]+.[a-fA-F0-9]+[Pp][+-]?[0-9]+([fFlL])?",
+    "[a-zA-Z_]([a-zA-Z_]|[0-9])*"};
+
+static const char* cOperators[] = {
+    "+", "*", "/", "%", "<", ">", "<=", ">=", "==", "!=", "&&", "||",
+    "&", "|", "^", "<<", ">>", "+=", "*=", "/=", "=", "."};
+
+static const char* cStatements[] = {
+    "int %s = %s;\n",
+    "if (%s >= %s) {\n",
+    "} else {\n",
+    "for (i = %s; i < %s; i++) {\n",
+    "while (%s != %s) %s++;\n",
+    "return %s;\n",
+    "static const char* %s = \"%s\";\n",
+    "%s[%s] = %s.%s;\n",
+    "unsigned long %s = sizeof(struct %s);\n",
+    "}\n"};
+
+static uint64_t benchRandom(uint64_t* seed) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *seed >> 33;
+}
+
+static size_t benchRange(uint64_t* seed, size_t low, size_t high) {
+  return low + (size_t)(benchRandom(seed) % (high - low + 1));
+}
+
+static double benchNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static bool bufferReserve(benchBuffer* buffer, size_t extra) {
+  if (buffer->length + extra + 1 <= buffer->capacity) return true;
+  size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+  while (buffer->length + extra + 1 > capacity) capacity *= 2;
+  char* data = realloc(buffer->data, capacity);
+  if (!data) return false;
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return true;
+}
+
+static bool bufferAppend(benchBuffer* buffer, const char* text,
+                         size_t length) {
+  if (!bufferReserve(buffer, length)) return false;
+  memcpy(buffer->data + buffer->length, text, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = '\0';
+  return true;
+}
+
+static bool bufferAppendString(benchBuffer* buffer, const char* text) {
+  return bufferAppend(buffer, text, strlen(text));
+}
+
+// Appends an identifier of `length` bytes that never starts with a digit.
+static bool bufferAppendIdentifier(benchBuffer* buffer, uint64_t* seed,
+                                   size_t length) {
+  static const char alphabet[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+  if (!bufferReserve(buffer, length)) return false;
+  for (size_t i = 0; i < length; i++) {
+    size_t limit = i == 0 ? 52 : sizeof(alphabet) - 1;
+    buffer->data[buffer->length++] = alphabet[benchRandom(seed) % limit];
+  }
+  buffer->data[buffer->length] = '\0';
+  return true;
+}
+
+static bool bufferAppendNumber(benchBuffer* buffer, uint64_t* seed) {
+  char number[4];
+  for (size_t i = 0; i < sizeof(number); i++)
+    number[i] = (char)('1' + benchRandom(seed) % 9);
+  return bufferAppend(buffer, number, sizeof(number));
+}
+
+static bool bufferAppendOperand(benchBuffer* buffer, uint64_t* seed) {
+  if (benchRandom(seed) % 3 == 0) return bufferAppendNumber(buffer, seed);
+  return bufferAppendIdentifier(buffer, seed, benchRange(seed, 1, 10));
+}
+
+static bool bufferAppendIndent(benchBuffer* buffer, uint64_t* seed) {
+  size_t depth = benchRange(seed, 0, 4) * 2;
+  if (!bufferReserve(buffer, depth)) return false;
+  memset(buffer->data + buffer->length, ' ', depth);
+  buffer->length += depth;
+  buffer->data[buffer->length] = '\0';
+  return true;
+}
+
+static bool grammarC(benchGrammar* out, uint64_t* seed) {
+  (void)seed;
+  out->rules = cRules;
+  out->count = sizeof(cRules) / sizeof(cRules[0]);
+  return true;
+}
+
+// Rule i of the keyword grammar is the i-th keyword derived from the seed, so
+// the corpus generator can reproduce the keyword list without sharing state.
+static void keywordAt(uint64_t seed, size_t index, char* out) {
+  uint64_t state = seed ^ (0x9E3779B97F4A7C15ULL * (index + 1));
+  size_t length = benchRange(&state, 3, 12);
+  for (size_t i = 0; i < length; i++)
+    out[i] = (char)('a' + benchRandom(&state) % 26);
+  out[length] = '\0';
+}
+
+static bool grammarKeywords(benchGrammar* out, uint64_t* seed) {
+  size_t count = BENCH_KEYWORD_COUNT + 2;
+  const char** rules = calloc(count, sizeof(char*));
+  char* storage = malloc(BENCH_KEYWORD_COUNT * 16);
+  if (!rules || !storage) {
+    free(rules);
+    free(storage);
+    return false;
+  }
+  for (size_t i = 0; i < BENCH_KEYWORD_COUNT; i++) {
+    keywordAt(*seed, i, storage + i * 16);
+    rules[i] = storage + i * 16;
+  }
+  rules[BENCH_KEYWORD_COUNT] = "[a-zA-Z_]([a-zA-Z_]|[0-9])*";
+  rules[BENCH_KEYWORD_COUNT + 1] = "[0-9]+";
+  out->rules = rules;
+  out->count = count;
+  return true;
+}
+
+static void grammarRelease(benchGrammar* grammar) {
+  if (!grammar->rules || grammar->rules == cRules) return;
+  free((void*)grammar->rules[0]);
+  free(grammar->rules);
+}
+
+// Source-like text: indented statements built from the C grammar's tokens.
+static bool corpusC(benchBuffer* out, size_t size, uint64_t* seed) {
+  size_t count = sizeof(cStatements) / sizeof(cStatements[0]);
+  while (out->length < size) {
+    if (!bufferAppendIndent(out, seed)) return false;
+    const char* statement = cStatements[benchRandom(seed) % count];
+    for (const char* p = statement; *p; p++) {
+      bool ok;
+      if (p[0] == '%' && p[1] == 's') {
+        ok = bufferAppendOperand(out, seed);
+        p++;
+      } else {
+        ok = bufferAppend(out, p, 1);
+      }
+      if (!ok) return false;
+    }
+  }
+  return true;
+}
+
+static bool corpusIdentifiers(benchBuffer* out, size_t size, uint64_t* seed) {
+  while (out->length < size) {
+    if (!bufferAppendIdentifier(out, seed, benchRange(seed, 1, 16)) ||
+        !bufferAppendString(out, benchRandom(seed) % 8 ? " " : "\n"))
+      return false;
+  }
+  return true;
+}
+
+static bool corpusLongTokens(benchBuffer* out, size_t size, uint64_t* seed) {
+  while (out->length < size) {
+    size_t length = benchRange(seed, 256, 4096);
+    bool ok;
+    if (benchRandom(seed) % 2) {
+      ok = bufferAppendIdentifier(out, seed, length);
+    } else {
+      ok = bufferAppendString(out, "\"") &&
+           bufferAppendIdentifier(out, seed, length) &&
+           bufferAppendString(out, "\"");
+    }
+    if (!ok || !bufferAppendString(out, "\n")) return false;
+  }
+  return true;
+}
+
+static bool corpusKeywords(benchBuffer* out, size_t size, uint64_t* seed) {
+  uint64_t grammarSeed = *seed;
+  char keyword[16];
+  while (out->length < size) {
+    size_t pick = benchRandom(seed) % 10;
+    bool ok;
+    if (pick < 7) {
+      keywordAt(grammarSeed, benchRandom(seed) % BENCH_KEYWORD_COUNT,
+                keyword);
+      ok = bufferAppendString(out, keyword);
+    } else if (pick < 9) {
+      ok = bufferAppendIdentifier(out, seed, benchRange(seed, 1, 12));
+    } else {
+      ok = bufferAppendNumber(out, seed);
+    }
+    if (!ok || !bufferAppendString(out, benchRandom(seed) % 8 ? " " : "\n"))
+      return false;
+  }
+  return true;
+}
+
+// Operands glued together by operators with no whitespace at all, so every
+// token boundary is found by the automaton rather than the whitespace scan.
+static bool corpusNoWhitespace(benchBuffer* out, size_t size, uint64_t* seed) {
+  size_t count = sizeof(cOperators) / sizeof(cOperators[0]);
+  while (out->length < size) {
+    if (!bufferAppendOperand(out, seed)) return false;
+    const char* separator = cOperators[benchRandom(seed) % count];
+    if (benchRandom(seed) % 6 == 0)
+      separator = benchRandom(seed) % 2 ? ";" : "(";
+    if (!bufferAppendString(out, separator)) return false;
+  }
+  return true;
+}
+
+static const benchWorkload workloads[] = {
+    {"c-grammar", grammarC, corpusC},
+    {"identifiers", grammarC, corpusIdentifiers},
+    {"long-tokens", grammarC, corpusLongTokens},
+    {"keywords-1000", grammarKeywords, corpusKeywords},
+    {"no-whitespace", grammarC, corpusNoWhitespace},
+};
+
+static const char* engineNames[] = {"nfa", "dfa", "lazy"};
+static const clexEngine engines[] = {CLEX_ENGINE_NFA, CLEX_ENGINE_DFA,
+                                     CLEX_ENGINE_LAZY_DFA};
+
+typedef struct benchRun {
+  benchGrammar grammar;
+  benchBuffer corpus;
+  clexLexer* builder;
+  clexRuleSet* rule_set;
+  clexLexer* lexer;
+} benchRun;
+
+static bool lexCorpus(benchRun* run, benchResult* result) {
+  clexResetWithLength(run->lexer, run->corpus.data, run->corpus.length);
+  clexTokenView view;
+  clexTokenViewInit(&view);
+  size_t tokens = 0;
+  size_t errors = 0;
+  clexStatus status;
+  double start = benchNow();
+  while ((status = clexView(run->lexer, &view)) != CLEX_STATUS_EOF) {
+    if (status == CLEX_STATUS_OK) {
+      tokens++;
+    } else if (status == CLEX_STATUS_LEXICAL_ERROR) {
+      errors++;
+    } else {
+      return false;
+    }
+  }
+  double elapsed = benchNow() - start;
+  if (result->lex_seconds == 0 || elapsed < result->lex_seconds)
+    result->lex_seconds = elapsed;
+  result->tokens = tokens;
+  result->errors = errors;
+  return true;
+}
+
+static bool measureWorkload(const benchWorkload* workload, clexEngine engine,
+                            const benchOptions* options, benchRun* run,
+                            benchResult* result) {
+  uint64_t seed = options->seed;
+  if (!workload->grammar(&run->grammar, &seed) ||
+      !workload->corpus(&run->corpus, options->size, &seed))
+    return false;
+  result->rules = run->grammar.count;
+  result->bytes = run->corpus.length;
+
+  double start = benchNow();
+  run->builder = clexInit();
+  if (!run->builder || clexSetEngine(run->builder, engine) != CLEX_STATUS_OK)
+    return false;
+  for (size_t i = 0; i < run->grammar.count; i++) {
+    if (clexRegisterKind(run->builder, run->grammar.rules[i], (int)i) !=
+        CLEX_STATUS_OK)
+      return false;
+  }
+  result->register_ms = (benchNow() - start) * 1e3;
+
+  start = benchNow();
+  if (clexRuleSetCompile(run->builder, &run->rule_set) != CLEX_STATUS_OK)
+    return false;
+  result->compile_ms = (benchNow() - start) * 1e3;
+
+  run->lexer = clexInitWithRuleSet(run->rule_set);
+  if (!run->lexer || clexSetEngine(run->lexer, engine) != CLEX_STATUS_OK)
+    return false;
+  for (int pass = 0; pass < options->passes; pass++)
+    if (!lexCorpus(run, result)) return false;
+  return true;
+}
+
+static void runWorkload(const benchWorkload* workload, clexEngine engine,
+                        const benchOptions* options, benchResult* result) {
+  memset(result, 0, sizeof(*result));
+  benchRun run;
+  memset(&run, 0, sizeof(run));
+  result->ok = measureWorkload(workload, engine, options, &run, result);
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    result->peak_rss_kb = usage.ru_maxrss;
+  clexLexerDestroy(run.lexer);
+  clexRuleSetDestroy(run.rule_set);
+  clexLexerDestroy(run.builder);
+  grammarRelease(&run.grammar);
+  free(run.corpus.data);
+}
+
+// Runs one workload/engine pair in a child so its peak RSS is not inflated by
+// the pairs that ran before it.
+static bool runIsolated(const benchWorkload* workload, clexEngine engine,
+                        const benchOptions* options, benchResult* result) {
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(stdout);
+  pid_t child = fork();
+  if (child < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (child == 0) {
+    close(fds[0]);
+    runWorkload(workload, engine, options, result);
+    ssize_t written = write(fds[1], result, sizeof(*result));
+    _exit(written == (ssize_t)sizeof(*result) ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t got = read(fds[0], result, sizeof(*result));
+  close(fds[0]);
+  int status = 0;
+  waitpid(child, &status, 0);
+  return got == (ssize_t)sizeof(*result) && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0 && result->ok;
+}
+
+static void printHeader(const benchOptions* options) {
+  if (options->json) {
+    printf("{\n  \"seed\": %llu,\n  \"passes\": %d,\n  \"results\": [",
+           (unsigned long long)options->seed, options->passes);
+    return;
+  }
+  printf("seed %llu, best of %d passes\n\n", (unsigned long long)options->seed,
+         options->passes);
+  printf("%-14s %-6s %5s %9s %9s %10s %9s %8s %10s %8s %9s\n", "workload",
+         "engine", "rules", "bytes", "tokens", "register", "compile", "MB/s",
+         "tokens/s", "ns/tok", "peak RSS");
+}
+
+static void printResult(const benchOptions* options, const char* workload,
+                        const char* engine, const benchResult* result,
+                        bool first) {
+  double megabytes = (double)result->bytes / (1024.0 * 1024.0);
+  double seconds = result->lex_seconds > 0 ? result->lex_seconds : 1e-9;
+  double tokensPerSecond = (double)result->tokens / seconds;
+  double nsPerToken =
+      result->tokens ? seconds * 1e9 / (double)result->tokens : 0.0;
+  if (options->json) {
+    printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", "
+           "\"rules\": %zu, \"bytes\": %zu, \"tokens\": %zu, "
+           "\"errors\": %zu, \"register_ms\": %.3f, \"compile_ms\": %.3f, "
+           "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"tokens_per_s\": %.0f, "
+           "\"ns_per_token\": %.2f, \"peak_rss_kb\": %ld}",
+           first ? "" : ",", workload, engine, result->rules, result->bytes,
+           result->tokens, result->errors, result->register_ms,
+           result->compile_ms, result->lex_seconds, megabytes / seconds,
+           tokensPerSecond, nsPerToken, result->peak_rss_kb);
+    return;
+  }
+  printf("%-14s %-6s %5zu %9zu %9zu %8.2fms %7.2fms %8.1f %10.0f %8.1f "
+         "%7ldKB\n",
+         workload, engine, result->rules, result->bytes, result->tokens,
+         result->register_ms, result->compile_ms, megabytes / seconds,
+         tokensPerSecond, nsPerToken, result->peak_rss_kb);
+  if (result->errors)
+    printf("  warning: %zu lexical errors\n", result->errors);
+}
+
+static bool parseOption(const char* arg, const char* name,
+                        const char** value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+  *value = arg + length + 1;
+  return true;
+}
+
+static int usage(void) {
+  fprintf(stderr,
+          "usage: bench [--json] [--engine=nfa|dfa|lazy] [--workload=NAME]\n"
+          "             [--size=MIB] [--passes=N] [--seed=N]\n");
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  benchOptions options = {false, NULL, NULL, 4, 5, 20240521};
+  for (int i = 1; i < argc; i++) {
+    const char* value;
+    if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else if (parseOption(argv[i], "--engine", &value)) {
+      options.engine = value;
+    } else if (parseOption(argv[i], "--workload", &value)) {
+      options.workload = value;
+    } else if (parseOption(argv[i], "--size", &value)) {
+      options.size = strtoul(value, NULL, 10);
+    } else if (parseOption(argv[i], "--passes", &value)) {
+      options.passes = atoi(value);
+    } else if (parseOption(argv[i], "--seed", &value)) {
+      options.seed = strtoull(value, NULL, 10);
+    } else {
+      return usage();
+    }
+  }
+  if (options.size == 0 || options.passes <= 0) return usage();
+  options.size *= 1024 * 1024;
+
+  printHeader(&options);
+  bool first = true;
+  int result = 0;
+  size_t workloadCount = sizeof(workloads) / sizeof(workloads[0]);
+  for (size_t w = 0; w < workloadCount; w++) {
+    if (options.workload && strcmp(options.workload, workloads[w].name) != 0)
+      continue;
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+      if (options.engine && strcmp(options.engine, engineNames[e]) != 0)
+        continue;
+      benchResult run;
+      if (!runIsolated(&workloads[w], engines[e], &options, &run)) {
+        fprintf(stderr, "bench: %s/%s failed\n", workloads[w].name,
+                engineNames[e]);
+        result = 1;
+        continue;
+      }
+      printResult(&options, workloads[w].name, engineNames[e], &run, first);
+      first = false;
+    }
+  }
+  if (options.json) printf("\n  ]\n}\n");
+  return result;
+}
@@ -1,12 +1,41 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "clex.h"
 
-#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if !defined(CLEX_NO_THREADS)
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 #include "fa.h"
 
+// Counters only exist in the default build as zeroed fields; the code that
+// maintains them is compiled in with CLEX_ENABLE_STATS.
+#if defined(CLEX_ENABLE_STATS)
+#define CLEX_STAT_ADD(lexer, counter, amount) \
+  ((lexer)->stats.counter += (amount))
+#else
+#define CLEX_STAT_ADD(lexer, counter, amount) ((void)0)
+#endif
+
 static clexSourcePosition make_position(size_t offset, size_t line,
                                         size_t column) {
   clexSourcePosition position;
@@ -30,6 +59,204 @@ static clexSourcePosition advance_position(clexSourcePosition position,
   return position;
 }
 
+// Whitespace scanning. Whitespace is the C locale isspace() set: ' ' and
+// '\t'..'\r'. Blocks of 16 bytes (SSE2) or 32 bytes (AVX2, detected at load
+// time) are classified at once; newlines are counted with popcount so that
+// line and column stay exact. Only whole blocks inside the buffer are loaded,
+// and the tail is scanned byte by byte.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CLEX_SCAN_SSE2 1
+#include <emmintrin.h>
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CLEX_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+typedef struct clexSpaceRun {
+  size_t length;
+  size_t newlines;
+  size_t last_newline;
+} clexSpaceRun;
+
+static bool is_space_byte(unsigned char byte) {
+  return byte == ' ' || (unsigned char)(byte - '\t') <= '\r' - '\t';
+}
+
+static unsigned count_bits(uint32_t bits) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  return (unsigned)__popcnt(bits);
+#else
+  return (unsigned)__builtin_popcount(bits);
+#endif
+}
+
+static unsigned low_bit(uint32_t bits) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward(&index, bits);
+  return (unsigned)index;
+#else
+  return (unsigned)__builtin_ctz(bits);
+#endif
+}
+
+static unsigned high_bit(uint32_t bits) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanReverse(&index, bits);
+  return (unsigned)index;
+#else
+  return 31u - (unsigned)__builtin_clz(bits);
+#endif
+}
+
+// Folds one block of `width` bytes into the run. `space` and `newline` have
+// bit i set for whitespace and '\n' at block offset i. Returns true when the
+// block contains the first non-whitespace byte.
+static bool space_run_block(clexSpaceRun* run, uint32_t space,
+                            uint32_t newline, unsigned width) {
+  uint32_t full = width == 32 ? 0xFFFFFFFFu : ((uint32_t)1 << width) - 1;
+  uint32_t other = ~space & full;
+  uint32_t before = other ? (((uint32_t)1 << low_bit(other)) - 1) : full;
+  newline &= before;
+  if (newline) {
+    run->newlines += count_bits(newline);
+    run->last_newline = run->length + high_bit(newline);
+  }
+  if (other) {
+    run->length += low_bit(other);
+    return true;
+  }
+  run->length += width;
+  return false;
+}
+
+static void space_run_tail(clexSpaceRun* run, const char* text,
+                           size_t length) {
+  while (run->length < length &&
+         is_space_byte((unsigned char)text[run->length])) {
+    if (text[run->length] == '\n') {
+      run->newlines++;
+      run->last_newline = run->length;
+    }
+    run->length++;
+  }
+}
+
+static size_t token_end_tail(const char* text, size_t length, size_t from) {
+  while (from < length && !is_space_byte((unsigned char)text[from])) from++;
+  return from;
+}
+
+#if defined(CLEX_SCAN_SSE2)
+static __m128i space_mask_sse2(__m128i bytes) {
+  __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+  __m128i control = _mm_cmpeq_epi8(
+      _mm_min_epu8(shifted, _mm_set1_epi8('\r' - '\t')), shifted);
+  return _mm_or_si128(control, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+}
+
+static clexSpaceRun scan_space_sse2(const char* text, size_t length) {
+  clexSpaceRun run = {0, 0, 0};
+  while (run.length + 16 <= length) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(text + run.length));
+    uint32_t space = (uint32_t)_mm_movemask_epi8(space_mask_sse2(bytes));
+    uint32_t newline = (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+    if (space_run_block(&run, space, newline, 16)) return run;
+  }
+  space_run_tail(&run, text, length);
+  return run;
+}
+
+static size_t scan_token_end_sse2(const char* text, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)(text + i));
+    uint32_t space = (uint32_t)_mm_movemask_epi8(space_mask_sse2(bytes));
+    if (space) return i + low_bit(space);
+  }
+  return token_end_tail(text, length, i);
+}
+#endif
+
+#if defined(CLEX_SCAN_AVX2)
+__attribute__((target("avx2"))) static __m256i space_mask_avx2(
+    __m256i bytes) {
+  __m256i shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+  __m256i control = _mm256_cmpeq_epi8(
+      _mm256_min_epu8(shifted, _mm256_set1_epi8('\r' - '\t')), shifted);
+  return _mm256_or_si256(control,
+                         _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2"))) static clexSpaceRun scan_space_avx2(
+    const char* text, size_t length) {
+  clexSpaceRun run = {0, 0, 0};
+  while (run.length + 32 <= length) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(text + run.length));
+    uint32_t space = (uint32_t)_mm256_movemask_epi8(space_mask_avx2(bytes));
+    uint32_t newline = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+    if (space_run_block(&run, space, newline, 32)) return run;
+  }
+  space_run_tail(&run, text, length);
+  return run;
+}
+
+__attribute__((target("avx2"))) static size_t scan_token_end_avx2(
+    const char* text, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i*)(text + i));
+    uint32_t space = (uint32_t)_mm256_movemask_epi8(space_mask_avx2(bytes));
+    if (space) return i + low_bit(space);
+  }
+  return token_end_tail(text, length, i);
+}
+
+// Detected once when the library is loaded, before any lexer can run, so the
+// scanners only test a flag.
+static bool cpu_has_avx2;
+
+__attribute__((constructor)) static void detect_avx2(void) {
+  __builtin_cpu_init();
+  cpu_has_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Measures the whitespace at the start of `text`.
+static clexSpaceRun scan_space(const char* text, size_t length) {
+#if defined(CLEX_SCAN_AVX2)
+  if (cpu_has_avx2) return scan_space_avx2(text, length);
+#endif
+#if defined(CLEX_SCAN_SSE2)
+  return scan_space_sse2(text, length);
+#else
+  clexSpaceRun run = {0, 0, 0};
+  space_run_tail(&run, text, length);
+  return run;
+#endif
+}
+
+// Returns the offset of the first whitespace byte in `text`, or `length`.
+static size_t scan_token_end(const char* text, size_t length) {
+#if defined(CLEX_SCAN_AVX2)
+  if (cpu_has_avx2) return scan_token_end_avx2(text, length);
+#endif
+#if defined(CLEX_SCAN_SSE2)
+  return scan_token_end_sse2(text, length);
+#else
+  return token_end_tail(text, length, 0);
+#endif
+}
+
 void clexTokenInit(clexToken* token) {
   if (!token) return;
   token->kind = CLEX_TOKEN_EOF;
@@ -78,6 +305,7 @@ static clexStatus lexer_set_error(clexLexer* lexer, clexStatus status,
       lexer->last_error.status = CLEX_STATUS_OUT_OF_MEMORY;
       return CLEX_STATUS_OUT_OF_MEMORY;
     }
+    CLEX_STAT_ADD(lexer, allocations, 1);
     memcpy(lexer->last_error.offending_lexeme, offending_lexeme, length);
   }
   return status;
@@ -99,14 +327,124 @@ static bool add_expected_kind_unique(clexError* error, int kind) {
   return true;
 }
 
+// Source text is read front to back; rule-set blobs are read in full but
+// their DFA tables are then probed in no particular order.
+typedef enum clexMapAccess {
+  CLEX_MAP_SEQUENTIAL,
+  CLEX_MAP_RANDOM
+} clexMapAccess;
+
+#if defined(_WIN32)
+// Without mmap the file is read into a heap buffer that the lexer owns.
+static clexStatus map_file(const char* path, clexMapAccess access, void** out,
+                           size_t* out_length) {
+  (void)access;
+  FILE* file = fopen(path, "rb");
+  if (!file) return CLEX_STATUS_IO_ERROR;
+  char* data = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  for (;;) {
+    if (length == capacity) {
+      capacity = capacity ? capacity * 2 : CLEX_STREAM_WINDOW;
+      char* grown = realloc(data, capacity);
+      if (!grown) {
+        free(data);
+        fclose(file);
+        return CLEX_STATUS_OUT_OF_MEMORY;
+      }
+      data = grown;
+    }
+    size_t count = fread(data + length, 1, capacity - length, file);
+    length += count;
+    if (count == 0) break;
+  }
+  bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    free(data);
+    return CLEX_STATUS_IO_ERROR;
+  }
+  *out = data;
+  *out_length = length;
+  return CLEX_STATUS_OK;
+}
+#else
+static clexStatus map_file(const char* path, clexMapAccess access, void** out,
+                           size_t* out_length) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return CLEX_STATUS_IO_ERROR;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < 0 ||
+      (unsigned long long)info.st_size > SIZE_MAX) {
+    close(fd);
+    return CLEX_STATUS_IO_ERROR;
+  }
+  size_t length = (size_t)info.st_size;
+  void* data = NULL;
+  // mmap rejects empty mappings; an empty file lexes as an empty buffer.
+  if (length > 0) {
+    data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return CLEX_STATUS_IO_ERROR;
+    }
+#if defined(MADV_SEQUENTIAL) && defined(MADV_RANDOM) && defined(MADV_WILLNEED)
+    if (access == CLEX_MAP_SEQUENTIAL) {
+      madvise(data, length, MADV_SEQUENTIAL);
+    } else {
+      madvise(data, length, MADV_RANDOM);
+      madvise(data, length, MADV_WILLNEED);
+    }
+#else
+    (void)access;
+#endif
+  }
+  close(fd);
+  *out = data;
+  *out_length = length;
+  return CLEX_STATUS_OK;
+}
+#endif
+
+static void unmap_file(void* data, size_t length) {
+#if defined(_WIN32)
+  (void)length;
+  free(data);
+#else
+  if (data) munmap(data, length);
+#endif
+}
+
+// A rule set loaded with clexRuleSetLoad() has no NFAs; its kinds and DFA
+// tables point into the mapped file.
+struct clexRuleSet {
+  size_t rule_count;
+  int* kinds;
+  clexCompiledNfa** nfas;
+  size_t max_node_count;
+  clexDfa* dfa;
+  clexLiteralSet* literals;
+  bool* literal_rules;
+  size_t* schedule;
+  // Rules that can start a match with byte b, in schedule order, are
+  // dispatch_rules[dispatch_starts[b]] up to dispatch_starts[b + 1].
+  size_t* dispatch_starts;
+  size_t* dispatch_rules;
+  void* mapping;
+  size_t mapping_length;
+};
+
 static clexStatus lexer_fill_expected_kinds(clexLexer* lexer) {
-  if (!lexer || !lexer->rules) return CLEX_STATUS_OK;
-  for (int i = 0; i < CLEX_MAX_RULES; ++i) {
-    clexRule* rule = lexer->rules[i];
-    if (!rule) continue;
-    if (!add_expected_kind_unique(&lexer->last_error, rule->kind)) {
+  if (!lexer || !lexer->rule_set) return CLEX_STATUS_OK;
+  for (size_t i = 0; i < lexer->rule_set->rule_count; ++i) {
+    size_t count = lexer->last_error.expected_kind_count;
+    if (!add_expected_kind_unique(&lexer->last_error,
+                                  lexer->rule_set->kinds[i])) {
       return CLEX_STATUS_OUT_OF_MEMORY;
     }
+    if (lexer->last_error.expected_kind_count > count)
+      CLEX_STAT_ADD(lexer, allocations, 1);
   }
   return CLEX_STATUS_OK;
 }
@@ -116,135 +454,954 @@ const clexError* clexGetLastError(const clexLexer* lexer) {
   return &lexer->last_error;
 }
 
+clexStatus clexGetStats(const clexLexer* lexer, clexStats* out) {
+  if (!lexer || !out) return CLEX_STATUS_INVALID_ARGUMENT;
+#if defined(CLEX_ENABLE_STATS)
+  *out = lexer->stats;
+  out->rule_hits = lexer->rule_hits;
+  return CLEX_STATUS_OK;
+#else
+  memset(out, 0, sizeof(*out));
+  return CLEX_STATUS_UNSUPPORTED;
+#endif
+}
+
+void clexResetStats(clexLexer* lexer) {
+  if (!lexer) return;
+  size_t rule_count = lexer->stats.rule_count;
+  memset(&lexer->stats, 0, sizeof(lexer->stats));
+  lexer->stats.rule_count = rule_count;
+  if (lexer->rule_hits)
+    memset(lexer->rule_hits, 0, rule_count * sizeof(size_t));
+}
+
+void clexRuleSetDestroy(clexRuleSet* rule_set) {
+  if (!rule_set) return;
+  if (rule_set->nfas) {
+    for (size_t i = 0; i < rule_set->rule_count; i++)
+      clexCompiledNfaDestroy(rule_set->nfas[i]);
+  }
+  free(rule_set->nfas);
+  if (!rule_set->mapping) free(rule_set->kinds);
+  clexDfaDestroy(rule_set->dfa);
+  clexLiteralSetDestroy(rule_set->literals);
+  free(rule_set->literal_rules);
+  free(rule_set->schedule);
+  free(rule_set->dispatch_starts);
+  free(rule_set->dispatch_rules);
+  unmap_file(rule_set->mapping, rule_set->mapping_length);
+  free(rule_set);
+}
+
+size_t clexRuleSetRuleCount(const clexRuleSet* rule_set) {
+  return rule_set ? rule_set->rule_count : 0;
+}
+
+// A loaded rule set only has the minimized tables, so both counts match.
+clexStatus clexRuleSetDfaStateCount(const clexRuleSet* rule_set,
+                                    size_t* out_built, size_t* out_minimized) {
+  if (!rule_set || !rule_set->dfa) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (out_built) *out_built = clexDfaSourceStateCount(rule_set->dfa);
+  if (out_minimized) *out_minimized = clexDfaStateCount(rule_set->dfa);
+  return CLEX_STATUS_OK;
+}
+
+static clexStatus rule_set_build_dfa(clexRuleSet* rule_set) {
+  if (rule_set->rule_count == 0) return CLEX_STATUS_NO_RULES;
+  rule_set->dfa = clexDfaBuild(
+      (const clexCompiledNfa* const*)rule_set->nfas, rule_set->rule_count);
+  return rule_set->dfa ? CLEX_STATUS_OK : CLEX_STATUS_OUT_OF_MEMORY;
+}
+
+// Rules whose NFA accepts a single string skip NFA simulation: they are
+// matched through a perfect hash of all literals before any NFA rule runs,
+// probing every literal length recorded for the token's first byte. The NFA
+// rules then compete with that match on length and rule order. If no table
+// can be built every rule keeps using its NFA.
+static clexStatus rule_set_build_literals(clexRuleSet* rule_set) {
+  size_t count = rule_set->rule_count;
+  char* buffer = malloc(count * CLEX_LITERAL_MAX_LENGTH + 1);
+  const char** literals = calloc(count + 1, sizeof(char*));
+  size_t* lengths = calloc(count + 1, sizeof(size_t));
+  int* rules = calloc(count + 1, sizeof(int));
+  rule_set->literal_rules = calloc(count + 1, sizeof(bool));
+  if (!buffer || !literals || !lengths || !rules || !rule_set->literal_rules) {
+    free(buffer);
+    free(literals);
+    free(lengths);
+    free(rules);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+
+  size_t literal_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    char* text = buffer + i * CLEX_LITERAL_MAX_LENGTH;
+    size_t length = 0;
+    if (!clexCompiledNfaLiteral(rule_set->nfas[i], text,
+                                CLEX_LITERAL_MAX_LENGTH, &length))
+      continue;
+    literals[literal_count] = text;
+    lengths[literal_count] = length;
+    rules[literal_count] = (int)i;
+    literal_count++;
+  }
+  if (literal_count > 0) {
+    rule_set->literals =
+        clexLiteralSetBuild(literals, lengths, rules, literal_count);
+  }
+  if (rule_set->literals) {
+    for (size_t i = 0; i < literal_count; i++)
+      rule_set->literal_rules[rules[i]] = true;
+  }
+  free(buffer);
+  free(literals);
+  free(lengths);
+  free(rules);
+  return CLEX_STATUS_OK;
+}
+
+// The NFA engine only runs the rules that can start with the token's first
+// byte; any other rule could at best match the empty string. Literal rules
+// are left out since the literal table already covers them. The table
+// follows `schedule` (index order when NULL) and is rebuilt with it.
+static clexStatus rule_set_build_dispatch(clexRuleSet* rule_set,
+                                          const size_t* schedule) {
+  size_t count = rule_set->rule_count;
+  bool* first = malloc((count ? count : 1) * CLEX_BYTE_COUNT * sizeof(bool));
+  size_t* starts = calloc(CLEX_BYTE_COUNT + 1, sizeof(size_t));
+  if (!first || !starts) {
+    free(first);
+    free(starts);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < count; i++) {
+    bool* row = first + i * CLEX_BYTE_COUNT;
+    if (rule_set->literal_rules && rule_set->literal_rules[i]) {
+      memset(row, 0, CLEX_BYTE_COUNT * sizeof(bool));
+      continue;
+    }
+    if (!clexCompiledNfaFirstBytes(rule_set->nfas[i], row)) {
+      free(first);
+      free(starts);
+      return CLEX_STATUS_OUT_OF_MEMORY;
+    }
+    for (size_t byte = 0; byte < CLEX_BYTE_COUNT; byte++)
+      if (row[byte]) starts[byte + 1]++;
+  }
+  for (size_t byte = 0; byte < CLEX_BYTE_COUNT; byte++)
+    starts[byte + 1] += starts[byte];
+
+  size_t total = starts[CLEX_BYTE_COUNT];
+  size_t* rules = malloc((total ? total : 1) * sizeof(size_t));
+  if (!rules) {
+    free(first);
+    free(starts);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+  size_t next[CLEX_BYTE_COUNT];
+  memcpy(next, starts, sizeof(next));
+  for (size_t k = 0; k < count; k++) {
+    size_t i = schedule ? schedule[k] : k;
+    const bool* row = first + i * CLEX_BYTE_COUNT;
+    for (size_t byte = 0; byte < CLEX_BYTE_COUNT; byte++)
+      if (row[byte]) rules[next[byte]++] = i;
+  }
+  free(first);
+  free(rule_set->dispatch_starts);
+  free(rule_set->dispatch_rules);
+  rule_set->dispatch_starts = starts;
+  rule_set->dispatch_rules = rules;
+  return CLEX_STATUS_OK;
+}
+
+static clexStatus rule_set_build(const clexLexer* lexer, bool with_dfa,
+                                 clexRuleSet** out) {
+  size_t count = lexer->rule_count;
+
+  clexRuleSet* rule_set = calloc(1, sizeof(clexRuleSet));
+  if (!rule_set) return CLEX_STATUS_OUT_OF_MEMORY;
+  rule_set->kinds = calloc(count + 1, sizeof(int));
+  rule_set->nfas = calloc(count + 1, sizeof(clexCompiledNfa*));
+  if (!rule_set->kinds || !rule_set->nfas) {
+    clexRuleSetDestroy(rule_set);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const clexRule* rule = &lexer->rules[i];
+    clexCompiledNfa* nfa = clexNfaCompile(rule->nfa);
+    if (!nfa) {
+      clexRuleSetDestroy(rule_set);
+      return CLEX_STATUS_OUT_OF_MEMORY;
+    }
+    size_t node_count = clexCompiledNfaNodeCount(nfa);
+    if (node_count > rule_set->max_node_count)
+      rule_set->max_node_count = node_count;
+    rule_set->nfas[rule_set->rule_count] = nfa;
+    rule_set->kinds[rule_set->rule_count] = rule->kind;
+    rule_set->rule_count++;
+  }
+
+  clexStatus literal_status = rule_set_build_literals(rule_set);
+  if (literal_status != CLEX_STATUS_OK) {
+    clexRuleSetDestroy(rule_set);
+    return literal_status;
+  }
+  if (lexer->schedule) {
+    rule_set->schedule = malloc(count * sizeof(size_t));
+    if (!rule_set->schedule) {
+      clexRuleSetDestroy(rule_set);
+      return CLEX_STATUS_OUT_OF_MEMORY;
+    }
+    memcpy(rule_set->schedule, lexer->schedule, count * sizeof(size_t));
+  }
+  clexStatus dispatch_status =
+      rule_set_build_dispatch(rule_set, rule_set->schedule);
+  if (dispatch_status != CLEX_STATUS_OK) {
+    clexRuleSetDestroy(rule_set);
+    return dispatch_status;
+  }
+  if (with_dfa) {
+    clexStatus status = rule_set_build_dfa(rule_set);
+    if (status != CLEX_STATUS_OK) {
+      clexRuleSetDestroy(rule_set);
+      return status;
+    }
+  }
+  *out = rule_set;
+  return CLEX_STATUS_OK;
+}
+
+clexStatus clexRuleSetCompile(const clexLexer* lexer, clexRuleSet** out) {
+  if (out) *out = NULL;
+  if (!lexer || !out) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (lexer->rule_count == 0) return CLEX_STATUS_NO_RULES;
+  return rule_set_build(lexer, lexer->engine == CLEX_ENGINE_DFA, out);
+}
+
+// Serialized rule set: magic, format version, a byte-order marker and the
+// rule count, then the kinds as int32 padded to 8 bytes, then the DFA tables
+// written by clexDfaSerialize(). Blobs are only readable on hosts with the same
+// byte order.
+#define CLEX_RULE_SET_MAGIC "CLEXRSET"
+#define CLEX_RULE_SET_VERSION 1
+#define CLEX_RULE_SET_BYTE_ORDER 0x01020304u
+
+typedef struct clexRuleSetHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t rule_count;
+} clexRuleSetHeader;
+
+static size_t rule_set_kinds_size(size_t rule_count) {
+  return (rule_count * sizeof(int32_t) + 7) & ~(size_t)7;
+}
+
+clexStatus clexRuleSetSave(const clexRuleSet* rule_set, const char* path) {
+  if (!rule_set || !path || !rule_set->dfa)
+    return CLEX_STATUS_INVALID_ARGUMENT;
+
+  size_t kinds_size = rule_set_kinds_size(rule_set->rule_count);
+  size_t dfa_size = clexDfaSerialize(rule_set->dfa, NULL, 0);
+  size_t size = sizeof(clexRuleSetHeader) + kinds_size + dfa_size;
+  unsigned char* blob = calloc(1, size);
+  if (!blob) return CLEX_STATUS_OUT_OF_MEMORY;
+
+  clexRuleSetHeader header;
+  memcpy(header.magic, CLEX_RULE_SET_MAGIC, sizeof(header.magic));
+  header.version = CLEX_RULE_SET_VERSION;
+  header.byte_order = CLEX_RULE_SET_BYTE_ORDER;
+  header.rule_count = rule_set->rule_count;
+  memcpy(blob, &header, sizeof(header));
+  int32_t* kinds = (int32_t*)(blob + sizeof(header));
+  for (size_t i = 0; i < rule_set->rule_count; i++)
+    kinds[i] = rule_set->kinds[i];
+  clexDfaSerialize(rule_set->dfa, blob + sizeof(header) + kinds_size,
+                   dfa_size);
+
+  clexStatus status = CLEX_STATUS_OK;
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    status = CLEX_STATUS_IO_ERROR;
+  } else {
+    if (fwrite(blob, 1, size, file) != size) status = CLEX_STATUS_IO_ERROR;
+    if (fclose(file) != 0) status = CLEX_STATUS_IO_ERROR;
+  }
+  free(blob);
+  return status;
+}
+
+clexStatus clexRuleSetLoad(const char* path, clexRuleSet** out) {
+  if (out) *out = NULL;
+  if (!path || !out) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (sizeof(int) != sizeof(int32_t)) return CLEX_STATUS_INVALID_FORMAT;
+
+  void* data = NULL;
+  size_t length = 0;
+  clexStatus status = map_file(path, CLEX_MAP_RANDOM, &data, &length);
+  if (status != CLEX_STATUS_OK) return status;
+
+  clexRuleSetHeader header;
+  if (length < sizeof(header)) {
+    unmap_file(data, length);
+    return CLEX_STATUS_INVALID_FORMAT;
+  }
+  memcpy(&header, data, sizeof(header));
+  size_t kinds_size = rule_set_kinds_size((size_t)header.rule_count);
+  if (memcmp(header.magic, CLEX_RULE_SET_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CLEX_RULE_SET_VERSION ||
+      header.byte_order != CLEX_RULE_SET_BYTE_ORDER ||
+      header.rule_count == 0 ||
+      header.rule_count > (length - sizeof(header)) / sizeof(int32_t) ||
+      kinds_size > length - sizeof(header)) {
+    unmap_file(data, length);
+    return CLEX_STATUS_INVALID_FORMAT;
+  }
+
+  clexRuleSet* rule_set = calloc(1, sizeof(clexRuleSet));
+  if (!rule_set) {
+    unmap_file(data, length);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+  size_t offset = sizeof(header) + kinds_size;
+  rule_set->rule_count = (size_t)header.rule_count;
+  rule_set->kinds = (int*)((unsigned char*)data + sizeof(header));
+  rule_set->mapping = data;
+  rule_set->mapping_length = length;
+  rule_set->dfa = clexDfaFromTables((unsigned char*)data + offset,
+                                    length - offset, rule_set->rule_count,
+                                    NULL);
+  if (!rule_set->dfa) {
+    clexRuleSetDestroy(rule_set);
+    return CLEX_STATUS_INVALID_FORMAT;
+  }
+  *out = rule_set;
+  return CLEX_STATUS_OK;
+}
+
 clexLexer* clexInit(void) {
   clexLexer* lexer = malloc(sizeof(clexLexer));
   if (!lexer) return NULL;
   lexer->rules = NULL;
+  lexer->rule_count = 0;
+  lexer->rule_capacity = 0;
   lexer->content = NULL;
+  lexer->content_length = 0;
+  lexer->content_base = 0;
+  lexer->reader = NULL;
+  lexer->reader_data = NULL;
+  lexer->reader_eof = false;
+  lexer->window = NULL;
+  lexer->window_capacity = 0;
+  lexer->mapping = NULL;
+  lexer->mapping_length = 0;
   lexer->position = 0;
   lexer->line = 1;
   lexer->column = 1;
+  lexer->chunk_end = 0;
   clexErrorInit(&lexer->last_error);
+  lexer->engine = CLEX_ENGINE_NFA;
+  lexer->rule_set = NULL;
+  lexer->owned_rule_set = NULL;
+  lexer->scratch = NULL;
+  lexer->lazy_dfa = NULL;
+  lexer->dfa_cache_budget = CLEX_DEFAULT_DFA_CACHE_BUDGET;
+  memset(&lexer->stats, 0, sizeof(lexer->stats));
+  lexer->rule_hits = NULL;
+  lexer->profiling = false;
+  lexer->profile = NULL;
+  lexer->schedule = NULL;
   return lexer;
 }
 
-void clexLexerDestroy(clexLexer* lexer) {
-  if (!lexer) return;
-  if (lexer->rules) {
-    for (int i = 0; i < CLEX_MAX_RULES; i++) {
-      if (lexer->rules[i]) {
-        clexNfaDestroy(lexer->rules[i]->nfa, NULL);
-        free(lexer->rules[i]);
-      }
+clexLexer* clexInitWithRuleSet(const clexRuleSet* rule_set) {
+  if (!rule_set) return NULL;
+  clexLexer* lexer = clexInit();
+  if (!lexer) return NULL;
+  lexer->rule_set = rule_set;
+  if (rule_set->dfa) lexer->engine = CLEX_ENGINE_DFA;
+  return lexer;
+}
+
+static bool lexer_is_cursor(const clexLexer* lexer) {
+  return lexer->rule_set && !lexer->owned_rule_set;
+}
+
+static void lexer_discard_rule_set(clexLexer* lexer) {
+  clexLazyDfaDestroy(lexer->lazy_dfa);
+  lexer->lazy_dfa = NULL;
+  clexNfaScratchDestroy(lexer->scratch);
+  lexer->scratch = NULL;
+  clexRuleSetDestroy(lexer->owned_rule_set);
+  lexer->owned_rule_set = NULL;
+  lexer->rule_set = NULL;
+  free(lexer->rule_hits);
+  lexer->rule_hits = NULL;
+  lexer->stats.rule_count = 0;
+  free(lexer->profile);
+  lexer->profile = NULL;
+}
+
+// Scan state is created on first use so that a cursor costs nothing until it
+// lexes, and an owning lexer recompiles only after its rules change.
+// Engine state built on first use is counted as one allocation per object:
+// the rule set, each compiled rule, the literal table, the DFA, the NFA
+// scratch, the lazy DFA and the profile.
+static clexStatus lexer_ensure_engine(clexLexer* lexer) {
+  if (!lexer->rule_set) {
+    // An empty rule set would hide the missing rules from lexer_next.
+    if (lexer->rule_count == 0) return CLEX_STATUS_NO_RULES;
+    clexStatus status = rule_set_build(
+        lexer, lexer->engine == CLEX_ENGINE_DFA, &lexer->owned_rule_set);
+    if (status != CLEX_STATUS_OK) return status;
+    lexer->rule_set = lexer->owned_rule_set;
+    CLEX_STAT_ADD(lexer, allocations,
+                  1 + lexer->rule_set->rule_count +
+                      (lexer->rule_set->literals ? 1 : 0) +
+                      (lexer->rule_set->dfa ? 1 : 0));
+  }
+  const clexRuleSet* rule_set = lexer->rule_set;
+#if defined(CLEX_ENABLE_STATS)
+  if (!lexer->rule_hits && rule_set->rule_count > 0) {
+    lexer->rule_hits = calloc(rule_set->rule_count, sizeof(size_t));
+    if (!lexer->rule_hits) return CLEX_STATUS_OUT_OF_MEMORY;
+    lexer->stats.rule_count = rule_set->rule_count;
+  }
+#endif
+
+  if (lexer->engine == CLEX_ENGINE_NFA) {
+    if (!lexer->scratch) {
+      lexer->scratch = clexNfaScratchCreate(rule_set->max_node_count);
+      if (!lexer->scratch) return CLEX_STATUS_OUT_OF_MEMORY;
+      CLEX_STAT_ADD(lexer, allocations, 1);
+    }
+    if (lexer->profiling && !lexer->profile && rule_set->rule_count > 0) {
+      lexer->profile = calloc(rule_set->rule_count, sizeof(clexRuleProfile));
+      if (!lexer->profile) return CLEX_STATUS_OUT_OF_MEMORY;
+      CLEX_STAT_ADD(lexer, allocations, 1);
     }
-    free(lexer->rules);
+    return CLEX_STATUS_OK;
+  }
+
+  if (rule_set->rule_count == 0) return CLEX_STATUS_NO_RULES;
+  if (lexer->engine == CLEX_ENGINE_DFA) {
+    if (rule_set->dfa) return CLEX_STATUS_OK;
+    if (!lexer->owned_rule_set) return CLEX_STATUS_INVALID_ARGUMENT;
+    clexStatus status = rule_set_build_dfa(lexer->owned_rule_set);
+    if (status == CLEX_STATUS_OK) CLEX_STAT_ADD(lexer, allocations, 1);
+    return status;
+  }
+  if (!lexer->lazy_dfa) {
+    lexer->lazy_dfa =
+        clexLazyDfaCreate((const clexCompiledNfa* const*)rule_set->nfas,
+                          rule_set->rule_count, lexer->dfa_cache_budget);
+    if (!lexer->lazy_dfa) return CLEX_STATUS_OUT_OF_MEMORY;
+    CLEX_STAT_ADD(lexer, allocations, 1);
   }
+  return CLEX_STATUS_OK;
+}
+
+static void lexer_release_file(clexLexer* lexer) {
+  unmap_file(lexer->mapping, lexer->mapping_length);
+  lexer->mapping = NULL;
+  lexer->mapping_length = 0;
+}
+
+void clexLexerDestroy(clexLexer* lexer) {
+  if (!lexer) return;
+  for (size_t i = 0; i < lexer->rule_count; i++)
+    clexNfaDestroy(lexer->rules[i].nfa, NULL);
+  free(lexer->rules);
+  lexer_discard_rule_set(lexer);
+  free(lexer->schedule);
   clexErrorClear(&lexer->last_error);
+  free(lexer->window);
+  lexer_release_file(lexer);
   free(lexer);
 }
 
 void clexReset(clexLexer* lexer, const char* content) {
+  clexResetWithLength(lexer, content, content ? strlen(content) : 0);
+}
+
+void clexResetWithLength(clexLexer* lexer, const char* content,
+                         size_t length) {
   if (!lexer) return;
+  lexer_release_file(lexer);
   lexer->content = content;
+  lexer->content_length = content ? length : 0;
+  lexer->content_base = 0;
+  lexer->reader = NULL;
+  lexer->reader_data = NULL;
+  lexer->reader_eof = false;
   lexer->position = 0;
   lexer->line = 1;
   lexer->column = 1;
+  lexer->chunk_end = 0;
   clexErrorClear(&lexer->last_error);
 }
 
+clexStatus clexResetWithReader(clexLexer* lexer, clexReadCallback reader,
+                               void* user_data) {
+  if (!lexer || !reader) return CLEX_STATUS_INVALID_ARGUMENT;
+  clexResetWithLength(lexer, NULL, 0);
+  lexer->content = lexer->window;
+  lexer->reader = reader;
+  lexer->reader_data = user_data;
+  return CLEX_STATUS_OK;
+}
+
+static long long read_fd(void* user_data, char* buffer, size_t capacity) {
+  int fd = (int)(intptr_t)user_data;
+  for (;;) {
+#if defined(_WIN32)
+    long long count =
+        _read(fd, buffer, (unsigned)(capacity > INT_MAX ? INT_MAX : capacity));
+#else
+    long long count = read(fd, buffer, capacity);
+#endif
+    if (count >= 0 || errno != EINTR) return count;
+  }
+}
+
+clexStatus clexResetWithFd(clexLexer* lexer, int fd) {
+  if (fd < 0) return CLEX_STATUS_INVALID_ARGUMENT;
+  return clexResetWithReader(lexer, read_fd, (void*)(intptr_t)fd);
+}
+
+clexStatus clexResetFromFile(clexLexer* lexer, const char* path) {
+  if (!lexer || !path) return CLEX_STATUS_INVALID_ARGUMENT;
+  void* data = NULL;
+  size_t length = 0;
+  clexStatus status =
+      map_file(path, CLEX_MAP_SEQUENTIAL, &data, &length);
+  if (status != CLEX_STATUS_OK) return status;
+  clexResetWithLength(lexer, data ? data : "", length);
+  lexer->mapping = data;
+  lexer->mapping_length = length;
+  return CLEX_STATUS_OK;
+}
+
+// Drops the window bytes before `keep_from` and reads more input after the
+// rest. The window only grows when every byte in it is still needed, so its
+// size is bounded by the longest run of non-whitespace bytes.
+static clexStatus lexer_refill(clexLexer* lexer, size_t keep_from) {
+  size_t keep = lexer->content_base + lexer->content_length - keep_from;
+  if (keep_from > lexer->content_base) {
+    memmove(lexer->window, lexer->window + (keep_from - lexer->content_base),
+            keep);
+  }
+  lexer->content_base = keep_from;
+  lexer->content_length = keep;
+  if (keep == lexer->window_capacity) {
+    size_t capacity = lexer->window_capacity ? lexer->window_capacity * 2
+                                             : CLEX_STREAM_WINDOW;
+    char* window = realloc(lexer->window, capacity);
+    if (!window) return CLEX_STATUS_OUT_OF_MEMORY;
+    CLEX_STAT_ADD(lexer, allocations, 1);
+    lexer->window = window;
+    lexer->window_capacity = capacity;
+  }
+  lexer->content = lexer->window;
+
+  size_t space = lexer->window_capacity - keep;
+  long long count =
+      lexer->reader(lexer->reader_data, lexer->window + keep, space);
+  if (count < 0 || (unsigned long long)count > space) {
+    return CLEX_STATUS_IO_ERROR;
+  }
+  if (count == 0) lexer->reader_eof = true;
+  lexer->content_length += (size_t)count;
+  return CLEX_STATUS_OK;
+}
+
+clexStatus clexSetEngine(clexLexer* lexer, clexEngine engine) {
+  if (!lexer) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (engine != CLEX_ENGINE_NFA && engine != CLEX_ENGINE_DFA &&
+      engine != CLEX_ENGINE_LAZY_DFA)
+    return CLEX_STATUS_INVALID_ARGUMENT;
+  // A shared rule set is immutable, so a cursor can only use a DFA that was
+  // built when the rule set was compiled.
+  if (engine == CLEX_ENGINE_DFA && lexer_is_cursor(lexer) &&
+      !lexer->rule_set->dfa)
+    return CLEX_STATUS_INVALID_ARGUMENT;
+  // A loaded rule set carries only its DFA tables.
+  if (engine != CLEX_ENGINE_DFA && lexer_is_cursor(lexer) &&
+      !lexer->rule_set->nfas)
+    return CLEX_STATUS_INVALID_ARGUMENT;
+  lexer->engine = engine;
+  return CLEX_STATUS_OK;
+}
+
+clexStatus clexSetDfaCacheBudget(clexLexer* lexer, size_t bytes) {
+  if (!lexer) return CLEX_STATUS_INVALID_ARGUMENT;
+  lexer->dfa_cache_budget = bytes;
+  clexLazyDfaDestroy(lexer->lazy_dfa);
+  lexer->lazy_dfa = NULL;
+  return CLEX_STATUS_OK;
+}
+
 clexStatus clexRegisterKind(clexLexer* lexer, const char* re, int kind) {
-  if (!lexer || !re) {
+  if (!lexer || !re || lexer_is_cursor(lexer)) {
     return CLEX_STATUS_INVALID_ARGUMENT;
   }
 
   clexErrorClear(&lexer->last_error);
+  lexer_discard_rule_set(lexer);
+  free(lexer->schedule);
+  lexer->schedule = NULL;
 
-  if (!lexer->rules) {
-    lexer->rules = calloc(CLEX_MAX_RULES, sizeof(clexRule*));
-    if (!lexer->rules) {
+  // Rules are stored inline and the array doubles as it fills; the limit is
+  // only hit when the next capacity would overflow.
+  if (lexer->rule_count == lexer->rule_capacity) {
+    if (lexer->rule_capacity > SIZE_MAX / 2 / sizeof(clexRule)) {
+      return lexer_set_error(
+          lexer, CLEX_STATUS_RULE_LIMIT_REACHED,
+          make_position(lexer->position, lexer->line, lexer->column), re);
+    }
+    size_t capacity = lexer->rule_capacity ? lexer->rule_capacity * 2
+                                           : CLEX_INITIAL_RULE_CAPACITY;
+    clexRule* grown = realloc(lexer->rules, capacity * sizeof(clexRule));
+    if (!grown) {
       return lexer_set_error(
           lexer, CLEX_STATUS_OUT_OF_MEMORY,
           make_position(lexer->position, lexer->line, lexer->column), NULL);
     }
+    lexer->rules = grown;
+    lexer->rule_capacity = capacity;
   }
 
-  for (int i = 0; i < CLEX_MAX_RULES; i++) {
-    if (!lexer->rules[i]) {
-      clexRule* rule = malloc(sizeof(clexRule));
-      if (!rule) {
-        return lexer_set_error(
-            lexer, CLEX_STATUS_OUT_OF_MEMORY,
-            make_position(lexer->position, lexer->line, lexer->column), NULL);
+  clexNode* nfa = clexNfaFromRe(re, NULL);
+  if (!nfa) {
+    return lexer_set_error(
+        lexer, CLEX_STATUS_REGEX_ERROR,
+        make_position(lexer->position, lexer->line, lexer->column), re);
+  }
+  clexRule* rule = &lexer->rules[lexer->rule_count++];
+  rule->re = re;
+  rule->nfa = nfa;
+  rule->kind = kind;
+  return CLEX_STATUS_OK;
+}
+
+void clexDeleteKinds(clexLexer* lexer) {
+  if (!lexer) return;
+  lexer_discard_rule_set(lexer);
+  free(lexer->schedule);
+  lexer->schedule = NULL;
+  for (size_t i = 0; i < lexer->rule_count; i++)
+    clexNfaDestroy(lexer->rules[i].nfa, NULL);
+  lexer->rule_count = 0;
+}
+
+// Profiles are filled in by the NFA scan only, which needs the compiled rules
+// that a loaded rule set does not carry.
+static bool lexer_can_profile(const clexLexer* lexer) {
+  return lexer->engine == CLEX_ENGINE_NFA &&
+         (!lexer->rule_set || lexer->rule_set->nfas);
+}
+
+clexStatus clexSetProfiling(clexLexer* lexer, bool enabled) {
+  if (!lexer) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (enabled && !lexer_can_profile(lexer)) return CLEX_STATUS_UNSUPPORTED;
+  lexer->profiling = enabled;
+  return CLEX_STATUS_OK;
+}
+
+// The profile is allocated with the scan state, so input that never reaches
+// a rule leaves it missing; it then reads as all zeros.
+static size_t lexer_profile_rule_count(const clexLexer* lexer) {
+  if (!lexer->profile && !lexer->profiling) return 0;
+  return lexer->rule_set ? lexer->rule_set->rule_count : lexer->rule_count;
+}
+
+clexStatus clexGetRuleProfile(const clexLexer* lexer, size_t rule,
+                              clexRuleProfile* out) {
+  if (!lexer || !out) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (!lexer_can_profile(lexer)) return CLEX_STATUS_UNSUPPORTED;
+  if (rule >= lexer_profile_rule_count(lexer))
+    return CLEX_STATUS_INVALID_ARGUMENT;
+  if (lexer->profile)
+    *out = lexer->profile[rule];
+  else
+    memset(out, 0, sizeof(*out));
+  return CLEX_STATUS_OK;
+}
+
+static bool rule_set_is_literal(const clexRuleSet* rule_set, size_t rule) {
+  return rule_set->literal_rules && rule_set->literal_rules[rule];
+}
+
+// Literal rules are looked up before the scan, so only two simulated rules
+// that share a token have to keep their registration order.
+static bool rule_set_rules_overlap(const clexRuleSet* rule_set, size_t left,
+                                   size_t right) {
+  if (rule_set_is_literal(rule_set, left) ||
+      rule_set_is_literal(rule_set, right))
+    return false;
+  return clexCompiledNfaOverlaps(rule_set->nfas[left], rule_set->nfas[right]);
+}
+
+// Orders the simulated rules by how often they end the scan per unit of work,
+// full_matches / (tests + bytes_scanned), greedily among the rules whose
+// overlapping predecessors are already placed. Literal rules go last. An
+// empty profile keeps registration order.
+clexStatus clexProfileSchedule(const clexLexer* lexer, size_t* out_order,
+                               size_t count) {
+  if (!lexer || !out_order) return CLEX_STATUS_INVALID_ARGUMENT;
+  if (!lexer_can_profile(lexer)) return CLEX_STATUS_UNSUPPORTED;
+  if (count == 0 || count != lexer_profile_rule_count(lexer))
+    return CLEX_STATUS_INVALID_ARGUMENT;
+  if (!lexer->profile) {
+    for (size_t i = 0; i < count; i++) out_order[i] = i;
+    return CLEX_STATUS_OK;
+  }
+  const clexRuleSet* rule_set = lexer->rule_set;
+  bool* overlaps = calloc(count * count, sizeof(bool));
+  size_t* blockers = calloc(count, sizeof(size_t));
+  bool* placed = calloc(count, sizeof(bool));
+  if (!overlaps || !blockers || !placed) {
+    free(overlaps);
+    free(blockers);
+    free(placed);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+  for (size_t later = 0; later < count; later++) {
+    for (size_t earlier = 0; earlier < later; earlier++) {
+      if (rule_set_rules_overlap(rule_set, earlier, later)) {
+        overlaps[earlier * count + later] = true;
+        blockers[later]++;
       }
-      rule->re = re;
-      rule->nfa = clexNfaFromRe(re, NULL);
-      if (!rule->nfa) {
-        free(rule);
-        return lexer_set_error(
-            lexer, CLEX_STATUS_REGEX_ERROR,
-            make_position(lexer->position, lexer->line, lexer->column), re);
+    }
+  }
+
+  size_t written = 0;
+  for (;;) {
+    size_t best = count;
+    double best_score = -1.0;
+    for (size_t i = 0; i < count; i++) {
+      if (placed[i] || blockers[i] > 0 || rule_set_is_literal(rule_set, i))
+        continue;
+      const clexRuleProfile* profile = &lexer->profile[i];
+      double work = (double)profile->tests + (double)profile->bytes_scanned;
+      double score = work > 0 ? (double)profile->full_matches / work : 0.0;
+      if (score > best_score) {
+        best = i;
+        best_score = score;
       }
-      rule->kind = kind;
-      lexer->rules[i] = rule;
-      return CLEX_STATUS_OK;
     }
+    if (best == count) break;
+    placed[best] = true;
+    out_order[written++] = best;
+    for (size_t later = best + 1; later < count; later++)
+      if (overlaps[best * count + later]) blockers[later]--;
   }
+  for (size_t i = 0; i < count; i++)
+    if (!placed[i]) out_order[written++] = i;
 
-  return lexer_set_error(
-      lexer, CLEX_STATUS_RULE_LIMIT_REACHED,
-      make_position(lexer->position, lexer->line, lexer->column), re);
+  free(overlaps);
+  free(blockers);
+  free(placed);
+  return CLEX_STATUS_OK;
 }
 
-void clexDeleteKinds(clexLexer* lexer) {
-  if (!lexer) return;
-  if (lexer->rules) {
-    for (int i = 0; i < CLEX_MAX_RULES; i++) {
-      if (lexer->rules[i]) {
-        clexNfaDestroy(lexer->rules[i]->nfa, NULL);
-        free(lexer->rules[i]);
-        lexer->rules[i] = NULL;
+// The schedule is kept by the lexer and copied into every rule set it
+// compiles until its rules change.
+clexStatus clexSetRuleSchedule(clexLexer* lexer, const size_t* order,
+                               size_t count) {
+  if (!lexer || !order || lexer_is_cursor(lexer))
+    return CLEX_STATUS_INVALID_ARGUMENT;
+  clexStatus status = lexer_ensure_engine(lexer);
+  if (status != CLEX_STATUS_OK) return status;
+  clexRuleSet* rule_set = lexer->owned_rule_set;
+  if (count != rule_set->rule_count) return CLEX_STATUS_INVALID_ARGUMENT;
+
+  size_t* position = malloc((count ? count : 1) * sizeof(size_t));
+  size_t* schedule = malloc((count ? count : 1) * sizeof(size_t));
+  size_t* copy = malloc((count ? count : 1) * sizeof(size_t));
+  if (!position || !schedule || !copy) {
+    free(position);
+    free(schedule);
+    free(copy);
+    return CLEX_STATUS_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < count; i++) position[i] = SIZE_MAX;
+  status = CLEX_STATUS_OK;
+  for (size_t k = 0; k < count && status == CLEX_STATUS_OK; k++) {
+    if (order[k] >= count || position[order[k]] != SIZE_MAX)
+      status = CLEX_STATUS_INVALID_ARGUMENT;
+    else
+      position[order[k]] = k;
+  }
+  for (size_t later = 0; later < count && status == CLEX_STATUS_OK;
+       later++) {
+    for (size_t earlier = 0; earlier < later; earlier++) {
+      if (position[later] < position[earlier] &&
+          rule_set_rules_overlap(rule_set, earlier, later)) {
+        status = CLEX_STATUS_INVALID_ARGUMENT;
+        break;
       }
     }
   }
+  free(position);
+  if (status == CLEX_STATUS_OK) {
+    memcpy(schedule, order, count * sizeof(size_t));
+    memcpy(copy, order, count * sizeof(size_t));
+    status = rule_set_build_dispatch(rule_set, copy);
+  }
+  if (status != CLEX_STATUS_OK) {
+    free(schedule);
+    free(copy);
+    return status;
+  }
+  free(lexer->schedule);
+  lexer->schedule = schedule;
+  free(rule_set->schedule);
+  rule_set->schedule = copy;
+  return CLEX_STATUS_OK;
 }
 
-clexStatus clex(clexLexer* lexer, clexToken* out_token) {
-  if (!lexer || !out_token) return CLEX_STATUS_INVALID_ARGUMENT;
+static void lexer_emit_view(clexLexer* lexer, clexTokenView* out_view,
+                            int kind, clexSourcePosition start_position,
+                            size_t length) {
+  const char* text =
+      lexer->content + (start_position.offset - lexer->content_base);
+  out_view->kind = kind;
+  out_view->lexeme = text;
+  out_view->length = length;
+  out_view->span.start = start_position;
+  out_view->span.end = advance_position(start_position, text, length);
+  lexer->position = start_position.offset + length;
+  lexer->line = out_view->span.end.line;
+  lexer->column = out_view->span.end.column;
+}
 
-  clexTokenClear(out_token);
+#if defined(CLEX_ENABLE_STATS)
+// Every automaton run is one rule test; reading past the match means the
+// lexer has to fall back to a shorter accepting prefix.
+static void lexer_count_scan(clexLexer* lexer, size_t scanned,
+                             size_t matched) {
+  lexer->stats.rule_tests++;
+  lexer->stats.automaton_steps += scanned;
+  if (scanned > matched) lexer->stats.prefix_retries++;
+}
+#endif
+
+static int lexer_match_dfa(clexLexer* lexer, const char* text, size_t length,
+                           size_t* out_length) {
+#if defined(CLEX_ENABLE_STATS)
+  size_t scanned = 0;
+  int rule = clexDfaMatchCounted(lexer->rule_set->dfa, text, length,
+                                 out_length, &scanned);
+  lexer_count_scan(lexer, scanned, *out_length);
+  return rule;
+#else
+  return clexDfaMatch(lexer->rule_set->dfa, text, length, out_length);
+#endif
+}
+
+static bool lexer_match_lazy_dfa(clexLexer* lexer, const char* text,
+                                 size_t length, int* out_rule,
+                                 size_t* out_length) {
+#if defined(CLEX_ENABLE_STATS)
+  size_t scanned = 0;
+  size_t allocations = clexLazyDfaAllocationCount(lexer->lazy_dfa);
+  bool ok = clexLazyDfaMatchCounted(lexer->lazy_dfa, text, length, out_rule,
+                                    out_length, &scanned);
+  lexer_count_scan(lexer, scanned, *out_length);
+  CLEX_STAT_ADD(lexer, allocations,
+                clexLazyDfaAllocationCount(lexer->lazy_dfa) - allocations);
+  return ok;
+#else
+  return clexLazyDfaMatch(lexer->lazy_dfa, text, length, out_rule,
+                          out_length);
+#endif
+}
+
+static void lexer_record_profile(clexLexer* lexer, size_t rule,
+                                 size_t scanned, size_t matched,
+                                 size_t length) {
+  clexRuleProfile* profile = &lexer->profile[rule];
+  profile->tests++;
+  profile->bytes_scanned += scanned;
+  if (matched == 0) {
+    profile->failure_depth += scanned;
+  } else {
+    profile->matches++;
+    if (matched == length) profile->full_matches++;
+  }
+}
+
+static size_t lexer_match_nfa(clexLexer* lexer, size_t rule,
+                              const char* text, size_t length) {
+  const clexCompiledNfa* nfa = lexer->rule_set->nfas[rule];
+#if !defined(CLEX_ENABLE_STATS)
+  if (!lexer->profiling)
+    return clexCompiledNfaLongestMatch(nfa, lexer->scratch, text, length);
+#endif
+  size_t scanned = 0;
+  size_t matched = clexCompiledNfaLongestMatchCounted(nfa, lexer->scratch,
+                                                      text, length, &scanned);
+#if defined(CLEX_ENABLE_STATS)
+  lexer_count_scan(lexer, scanned, matched);
+#endif
+  if (lexer->profiling)
+    lexer_record_profile(lexer, rule, scanned, matched, length);
+  return matched;
+}
+
+static clexStatus lexer_next(clexLexer* lexer, clexTokenView* out_view) {
   clexErrorClear(&lexer->last_error);
 
-  out_token->kind = CLEX_TOKEN_EOF;
-  out_token->span.start =
+  out_view->kind = CLEX_TOKEN_EOF;
+  out_view->lexeme = NULL;
+  out_view->length = 0;
+  out_view->span.start =
       make_position(lexer->position, lexer->line, lexer->column);
-  out_token->span.end = out_token->span.start;
+  out_view->span.end = out_view->span.start;
 
-  if (!lexer->content) {
+  if (!lexer->content && !lexer->reader) {
     return CLEX_STATUS_EOF;
   }
 
-  const char* content = lexer->content;
-  size_t length = strlen(content);
-
-  while (lexer->position < length &&
-         isspace((unsigned char)content[lexer->position])) {
-    if (content[lexer->position] == '\n') {
-      lexer->line++;
-      lexer->column = 1;
-    } else {
-      lexer->column++;
+  const char* content;
+  size_t base;
+  size_t length;
+  for (;;) {
+    content = lexer->content;
+    base = lexer->content_base;
+    length = base + lexer->content_length;
+    if (lexer->position < length) {
+      clexSpaceRun run = scan_space(content + (lexer->position - base),
+                                    length - lexer->position);
+      if (run.newlines > 0) {
+        lexer->line += run.newlines;
+        lexer->column = run.length - run.last_newline;
+      } else {
+        lexer->column += run.length;
+      }
+      lexer->position += run.length;
+      CLEX_STAT_ADD(lexer, whitespace_bytes, run.length);
+      CLEX_STAT_ADD(lexer, bytes, run.length);
+    }
+    if (lexer->position < length || !lexer->reader || lexer->reader_eof) break;
+    clexStatus status = lexer_refill(lexer, lexer->position);
+    if (status != CLEX_STATUS_OK) {
+      return lexer_set_error(
+          lexer, status,
+          make_position(lexer->position, lexer->line, lexer->column), NULL);
     }
-    lexer->position++;
   }
 
   if (lexer->position >= length) {
-    out_token->span.start =
+    out_view->span.start =
         make_position(lexer->position, lexer->line, lexer->column);
-    out_token->span.end = out_token->span.start;
+    out_view->span.end = out_view->span.start;
     return CLEX_STATUS_EOF;
   }
 
-  if (!lexer->rules) {
+  if (lexer->rule_count == 0 && !lexer->rule_set) {
     return lexer_set_error(
         lexer, CLEX_STATUS_NO_RULES,
         make_position(lexer->position, lexer->line, lexer->column), NULL);
@@ -253,46 +1410,84 @@ clexStatus clex(clexLexer* lexer, clexToken* out_token) {
   size_t start = lexer->position;
   clexSourcePosition start_position =
       make_position(lexer->position, lexer->line, lexer->column);
-  size_t end = start;
-  while (content[end] != '\0' && !isspace((unsigned char)content[end])) end++;
+  if (lexer->chunk_end <= start) {
+    size_t end = start;
+    for (;;) {
+      end += scan_token_end(content + (end - base), length - end);
+      if (end < length || !lexer->reader || lexer->reader_eof) break;
+      clexStatus status = lexer_refill(lexer, start);
+      if (status != CLEX_STATUS_OK) {
+        return lexer_set_error(lexer, status, start_position, NULL);
+      }
+      content = lexer->content;
+      base = lexer->content_base;
+      length = base + lexer->content_length;
+    }
+    lexer->chunk_end = end;
+  }
+  size_t end = lexer->chunk_end;
 
   size_t partLength = end - start;
   if (partLength == 0) {
     lexer->position = end;
-    out_token->span.start = make_position(end, lexer->line, lexer->column);
-    out_token->span.end = out_token->span.start;
+    out_view->span.start = make_position(end, lexer->line, lexer->column);
+    out_view->span.end = out_view->span.start;
     return CLEX_STATUS_EOF;
   }
 
-  char* part = calloc(partLength + 1, sizeof(char));
-  if (!part) {
-    return lexer_set_error(lexer, CLEX_STATUS_OUT_OF_MEMORY, start_position,
-                           NULL);
+  clexStatus engine_status = lexer_ensure_engine(lexer);
+  if (engine_status != CLEX_STATUS_OK) {
+    return lexer_set_error(lexer, engine_status, start_position, NULL);
   }
-  memcpy(part, content + start, partLength);
-
-  size_t activeLength = partLength;
-  while (activeLength > 0) {
-    for (int i = 0; i < CLEX_MAX_RULES; i++) {
-      clexRule* rule = lexer->rules[i];
-      if (rule && clexNfaTest(rule->nfa, part)) {
-        out_token->lexeme = part;
-        out_token->kind = rule->kind;
-        out_token->span.start = start_position;
-        out_token->span.end =
-            advance_position(start_position, content + start, activeLength);
-        lexer->position = start + activeLength;
-        lexer->line = out_token->span.end.line;
-        lexer->column = out_token->span.end.column;
-        return CLEX_STATUS_OK;
+  const clexRuleSet* rule_set = lexer->rule_set;
+
+  const char* text = content + (start - base);
+  size_t matchLength = 0;
+  int matchRule = -1;
+  if (lexer->engine == CLEX_ENGINE_DFA) {
+    matchRule = lexer_match_dfa(lexer, text, partLength, &matchLength);
+  } else if (lexer->engine == CLEX_ENGINE_LAZY_DFA) {
+    if (!lexer_match_lazy_dfa(lexer, text, partLength, &matchRule,
+                              &matchLength)) {
+      return lexer_set_error(lexer, CLEX_STATUS_OUT_OF_MEMORY, start_position,
+                             NULL);
+    }
+  } else {
+    if (rule_set->literals) CLEX_STAT_ADD(lexer, rule_tests, 1);
+    matchRule = clexLiteralSetLongestMatch(rule_set->literals, text,
+                                           partLength, &matchLength);
+    // A rule that matches the whole chunk cannot be beaten on length, and any
+    // rule that could tie with it and outrank it overlaps it, so the schedule
+    // has already run that rule.
+    unsigned char first = (unsigned char)text[0];
+    for (size_t k = rule_set->dispatch_starts[first];
+         k < rule_set->dispatch_starts[first + 1]; k++) {
+      size_t i = rule_set->dispatch_rules[k];
+      size_t ruleLength = lexer_match_nfa(lexer, i, text, partLength);
+      if (ruleLength > matchLength ||
+          (ruleLength == matchLength && ruleLength > 0 &&
+           (int)i < matchRule)) {
+        matchLength = ruleLength;
+        matchRule = (int)i;
       }
+      if (ruleLength == partLength) break;
     }
-    activeLength--;
-    part[activeLength] = '\0';
   }
 
-  free(part);
-  char unmatched[2] = {content[start], '\0'};
+  if (matchLength > 0) {
+    CLEX_STAT_ADD(lexer, tokens, 1);
+    CLEX_STAT_ADD(lexer, bytes, matchLength);
+#if defined(CLEX_ENABLE_STATS)
+    if (lexer->rule_hits) lexer->rule_hits[matchRule]++;
+#endif
+    lexer_emit_view(lexer, out_view, rule_set->kinds[matchRule],
+                    start_position, matchLength);
+    return CLEX_STATUS_OK;
+  }
+
+  CLEX_STAT_ADD(lexer, lexical_errors, 1);
+  CLEX_STAT_ADD(lexer, bytes, 1);
+  char unmatched[2] = {content[start - base], '\0'};
   clexStatus status = lexer_set_error(lexer, CLEX_STATUS_LEXICAL_ERROR,
                                       start_position, unmatched);
   if (status == CLEX_STATUS_LEXICAL_ERROR) {
@@ -301,11 +1496,357 @@ clexStatus clex(clexLexer* lexer, clexToken* out_token) {
                              NULL);
     }
   }
-  out_token->kind = CLEX_TOKEN_ERROR;
-  out_token->span.start = start_position;
-  out_token->span.end = advance_position(start_position, content + start, 1);
-  lexer->position = start + 1;
-  lexer->line = out_token->span.end.line;
-  lexer->column = out_token->span.end.column;
+  lexer_emit_view(lexer, out_view, CLEX_TOKEN_ERROR, start_position, 1);
+  return status;
+}
+
+void clexTokenViewInit(clexTokenView* view) {
+  if (!view) return;
+  view->kind = CLEX_TOKEN_EOF;
+  view->lexeme = NULL;
+  view->length = 0;
+  view->span.start = make_position(0, 1, 1);
+  view->span.end = make_position(0, 1, 1);
+}
+
+clexStatus clexView(clexLexer* lexer, clexTokenView* out_view) {
+  if (!lexer || !out_view) return CLEX_STATUS_INVALID_ARGUMENT;
+  return lexer_next(lexer, out_view);
+}
+
+clexStatus clexTokenizeBatch(clexLexer* lexer, clexTokenView* out,
+                             size_t capacity, size_t* produced) {
+  if (produced) *produced = 0;
+  if (!lexer || !produced || (!out && capacity > 0) || lexer->reader)
+    return CLEX_STATUS_INVALID_ARGUMENT;
+
+  size_t count = 0;
+  clexStatus status = CLEX_STATUS_OK;
+  while (count < capacity) {
+    status = lexer_next(lexer, &out[count]);
+    if (status != CLEX_STATUS_OK) break;
+    count++;
+  }
+  *produced = count;
   return status;
 }
+
+typedef struct clexViewBuffer {
+  clexTokenView* views;
+  size_t count;
+  size_t capacity;
+} clexViewBuffer;
+
+static bool view_buffer_push(clexViewBuffer* buffer,
+                             const clexTokenView* view) {
+  if (buffer->count == buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+    clexTokenView* views =
+        realloc(buffer->views, capacity * sizeof(clexTokenView));
+    if (!views) return false;
+    buffer->views = views;
+    buffer->capacity = capacity;
+  }
+  buffer->views[buffer->count++] = *view;
+  return true;
+}
+
+// Lexes until the first non-OK status, appending every token to the buffer.
+static clexStatus lexer_collect(clexLexer* lexer, clexViewBuffer* buffer) {
+  clexTokenView view;
+  for (;;) {
+    clexStatus status = lexer_next(lexer, &view);
+    if (status != CLEX_STATUS_OK) return status;
+    if (buffer->count == buffer->capacity)
+      CLEX_STAT_ADD(lexer, allocations, 1);
+    if (!view_buffer_push(buffer, &view)) {
+      lexer->position = view.span.start.offset;
+      lexer->line = view.span.start.line;
+      lexer->column = view.span.start.column;
+      return lexer_set_error(lexer, CLEX_STATUS_OUT_OF_MEMORY, view.span.start,
+                             NULL);
+    }
+  }
+}
+
+typedef struct clexChunk {
+  clexLexer* lexer;
+  size_t start;
+  clexViewBuffer buffer;
+  clexStatus status;
+} clexChunk;
+
+// Folds a worker's counters and rule profile into the lexer that spawned it.
+// Both lexers use the same rule set, so the per-rule entries line up.
+static void lexer_merge_stats(clexLexer* lexer, const clexLexer* worker) {
+  if (lexer->profile && worker->profile) {
+    for (size_t i = 0; i < lexer->rule_set->rule_count; i++) {
+      clexRuleProfile* profile = &lexer->profile[i];
+      const clexRuleProfile* other = &worker->profile[i];
+      profile->tests += other->tests;
+      profile->matches += other->matches;
+      profile->full_matches += other->full_matches;
+      profile->bytes_scanned += other->bytes_scanned;
+      profile->failure_depth += other->failure_depth;
+    }
+  }
+#if defined(CLEX_ENABLE_STATS)
+  lexer->stats.tokens += worker->stats.tokens;
+  lexer->stats.bytes += worker->stats.bytes;
+  lexer->stats.whitespace_bytes += worker->stats.whitespace_bytes;
+  lexer->stats.automaton_steps += worker->stats.automaton_steps;
+  lexer->stats.rule_tests += worker->stats.rule_tests;
+  lexer->stats.prefix_retries += worker->stats.prefix_retries;
+  lexer->stats.lexical_errors += worker->stats.lexical_errors;
+  lexer->stats.allocations += worker->stats.allocations;
+  if (lexer->rule_hits && worker->rule_hits) {
+    for (size_t i = 0; i < lexer->stats.rule_count; i++)
+      lexer->rule_hits[i] += worker->rule_hits[i];
+  }
+#else
+  (void)lexer;
+  (void)worker;
+#endif
+}
+
+static void chunk_run(clexChunk* chunk) {
+  chunk->status = lexer_collect(chunk->lexer, &chunk->buffer);
+}
+
+#if !defined(CLEX_NO_THREADS) && defined(_WIN32)
+typedef HANDLE clexThread;
+
+static DWORD WINAPI chunk_thread_main(LPVOID arg) {
+  chunk_run(arg);
+  return 0;
+}
+
+static bool thread_start(clexThread* thread, clexChunk* chunk) {
+  *thread = CreateThread(NULL, 0, chunk_thread_main, chunk, 0, NULL);
+  return *thread != NULL;
+}
+
+static void thread_join(clexThread thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+#elif !defined(CLEX_NO_THREADS)
+typedef pthread_t clexThread;
+
+static void* chunk_thread_main(void* arg) {
+  chunk_run(arg);
+  return NULL;
+}
+
+static bool thread_start(clexThread* thread, clexChunk* chunk) {
+  return pthread_create(thread, NULL, chunk_thread_main, chunk) == 0;
+}
+
+static void thread_join(clexThread thread) { pthread_join(thread, NULL); }
+#endif
+
+// Chunks are lexed as if they started at line 1, column 1; shift a position
+// by where the chunk really starts.
+static clexSourcePosition chunk_position(clexSourcePosition position,
+                                         size_t offset,
+                                         clexSourcePosition base) {
+  position.offset += offset;
+  if (position.line == 1) position.column += base.column - 1;
+  position.line += base.line - 1;
+  return position;
+}
+
+static void chunks_destroy(clexChunk* chunks, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    clexLexerDestroy(chunks[i].lexer);
+    free(chunks[i].buffer.views);
+  }
+  free(chunks);
+}
+
+// Splits the rest of the input at whitespace bytes. No token spans whitespace,
+// so every chunk starts in exactly the state the serial lexer would be in and
+// no boundary ever needs to be lexed again.
+static size_t chunks_plan(const clexLexer* lexer, size_t thread_count,
+                          clexChunk* chunks) {
+  const char* content = lexer->content;
+  size_t length = lexer->content_length;
+  size_t remaining = length - lexer->position;
+  size_t chunk_size = remaining / thread_count;
+  if (chunk_size < CLEX_PARALLEL_MIN_CHUNK) {
+    chunk_size = CLEX_PARALLEL_MIN_CHUNK;
+  }
+
+  size_t count = 0;
+  size_t start = lexer->position;
+  while (start < length && count < thread_count) {
+    size_t end = length;
+    if (count + 1 < thread_count && length - start > chunk_size) {
+      end = start + chunk_size;
+      end += scan_token_end(content + end, length - end);
+    }
+    chunks[count].start = start;
+    chunks[count].lexer = NULL;
+    chunks[count].buffer.views = NULL;
+    chunks[count].buffer.count = 0;
+    chunks[count].buffer.capacity = 0;
+    chunks[count].status = CLEX_STATUS_OK;
+    count++;
+    start = end;
+  }
+  return count;
+}
+
+static clexStatus lexer_tokenize_serial(clexLexer* lexer, clexTokenView** out,
+                                        size_t* count) {
+  clexViewBuffer buffer = {NULL, 0, 0};
+  clexStatus status = lexer_collect(lexer, &buffer);
+  *out = buffer.views;
+  *count = buffer.count;
+  return status == CLEX_STATUS_EOF ? CLEX_STATUS_OK : status;
+}
+
+clexStatus clexTokenizeParallel(clexLexer* lexer, size_t thread_count,
+                                clexTokenView** out, size_t* count) {
+  if (out) *out = NULL;
+  if (count) *count = 0;
+  if (!lexer || !out || !count || thread_count == 0 || lexer->reader)
+    return CLEX_STATUS_INVALID_ARGUMENT;
+
+  if (!lexer->content || thread_count == 1 ||
+      lexer->content_length - lexer->position < 2 * CLEX_PARALLEL_MIN_CHUNK ||
+      lexer_ensure_engine(lexer) != CLEX_STATUS_OK) {
+    return lexer_tokenize_serial(lexer, out, count);
+  }
+
+  clexChunk* chunks = calloc(thread_count, sizeof(clexChunk));
+  if (!chunks) return lexer_tokenize_serial(lexer, out, count);
+  CLEX_STAT_ADD(lexer, allocations, 1);
+  size_t chunk_count = chunks_plan(lexer, thread_count, chunks);
+  for (size_t i = 0; i < chunk_count; i++) {
+    size_t end = i + 1 < chunk_count ? chunks[i + 1].start
+                                     : lexer->content_length;
+    clexLexer* worker = clexInitWithRuleSet(lexer->rule_set);
+    if (!worker) {
+      chunks_destroy(chunks, chunk_count);
+      return lexer_tokenize_serial(lexer, out, count);
+    }
+    CLEX_STAT_ADD(lexer, allocations, 1);
+    worker->engine = lexer->engine;
+    worker->dfa_cache_budget = lexer->dfa_cache_budget;
+    worker->profiling = lexer->profiling;
+    clexResetWithLength(worker, lexer->content + chunks[i].start,
+                        end - chunks[i].start);
+    chunks[i].lexer = worker;
+  }
+
+#if defined(CLEX_NO_THREADS)
+  for (size_t i = 0; i < chunk_count; i++) chunk_run(&chunks[i]);
+#else
+  clexThread* threads = calloc(chunk_count, sizeof(clexThread));
+  bool* started = calloc(chunk_count, sizeof(bool));
+  if (threads) CLEX_STAT_ADD(lexer, allocations, 1);
+  if (started) CLEX_STAT_ADD(lexer, allocations, 1);
+  // The calling thread takes the first chunk, and any chunk whose thread
+  // could not be started.
+  for (size_t i = 1; threads && started && i < chunk_count; i++)
+    started[i] = thread_start(&threads[i], &chunks[i]);
+  for (size_t i = 0; i < chunk_count; i++)
+    if (!started || !started[i]) chunk_run(&chunks[i]);
+  for (size_t i = 1; threads && started && i < chunk_count; i++)
+    if (started[i]) thread_join(threads[i]);
+  free(threads);
+  free(started);
+#endif
+
+  size_t total = 0;
+  size_t last = 0;
+  for (; last < chunk_count; last++) {
+    total += chunks[last].buffer.count;
+    if (chunks[last].status != CLEX_STATUS_EOF) break;
+  }
+  if (last == chunk_count) last--;
+
+  clexTokenView* views = malloc((total ? total : 1) * sizeof(clexTokenView));
+  if (!views) {
+    chunks_destroy(chunks, chunk_count);
+    return lexer_set_error(
+        lexer, CLEX_STATUS_OUT_OF_MEMORY,
+        make_position(lexer->position, lexer->line, lexer->column), NULL);
+  }
+  CLEX_STAT_ADD(lexer, allocations, 1);
+
+  clexSourcePosition base =
+      make_position(lexer->position, lexer->line, lexer->column);
+  clexSourcePosition chunk_base = base;
+  size_t written = 0;
+  for (size_t i = 0; i <= last; i++) {
+    clexChunk* chunk = &chunks[i];
+    lexer_merge_stats(lexer, chunk->lexer);
+    chunk_base = base;
+    for (size_t j = 0; j < chunk->buffer.count; j++) {
+      clexTokenView view = chunk->buffer.views[j];
+      view.span.start = chunk_position(view.span.start, chunk->start, base);
+      view.span.end = chunk_position(view.span.end, chunk->start, base);
+      views[written++] = view;
+    }
+    base = chunk_position(make_position(chunk->lexer->position,
+                                        chunk->lexer->line,
+                                        chunk->lexer->column),
+                          chunk->start, base);
+  }
+
+  const clexChunk* stopped = &chunks[last];
+  clexStatus status = stopped->status;
+  lexer->position = base.offset;
+  lexer->line = base.line;
+  lexer->column = base.column;
+  lexer->chunk_end = 0;
+  clexErrorClear(&lexer->last_error);
+  if (status != CLEX_STATUS_EOF) {
+    const clexError* error = &stopped->lexer->last_error;
+    status = lexer_set_error(
+        lexer, error->status,
+        chunk_position(error->position, stopped->start, chunk_base),
+        error->offending_lexeme);
+    for (size_t i = 0; i < error->expected_kind_count; i++) {
+      if (status != error->status) break;
+      if (!add_expected_kind_unique(&lexer->last_error,
+                                    error->expected_kinds[i])) {
+        status = lexer_set_error(lexer, CLEX_STATUS_OUT_OF_MEMORY,
+                                 lexer->last_error.position, NULL);
+      }
+    }
+  }
+  chunks_destroy(chunks, chunk_count);
+  *out = views;
+  *count = written;
+  return status == CLEX_STATUS_EOF ? CLEX_STATUS_OK : status;
+}
+
+clexStatus clex(clexLexer* lexer, clexToken* out_token) {
+  if (!lexer || !out_token) return CLEX_STATUS_INVALID_ARGUMENT;
+
+  clexTokenClear(out_token);
+
+  clexTokenView view;
+  clexStatus status = lexer_next(lexer, &view);
+  out_token->kind = view.kind;
+  out_token->span = view.span;
+  if (status != CLEX_STATUS_OK) return status;
+
+  out_token->lexeme = calloc(view.length + 1, sizeof(char));
+  if (out_token->lexeme) CLEX_STAT_ADD(lexer, allocations, 1);
+  if (!out_token->lexeme) {
+    // Rewind to the token, not past the whitespace before it: a streaming
+    // source may already have dropped that whitespace from its window.
+    lexer->position = view.span.start.offset;
+    lexer->line = view.span.start.line;
+    lexer->column = view.span.start.column;
+    out_token->kind = CLEX_TOKEN_EOF;
+    return lexer_set_error(lexer, CLEX_STATUS_OUT_OF_MEMORY, view.span.start,
+                           NULL);
+  }
+  memcpy(out_token->lexeme, view.lexeme, view.length);
+  return CLEX_STATUS_OK;
+}
@@ -6,9 +6,21 @@
 
 #include "fa.h"
 
+// Deprecated: the number of rules is no longer limited. Kept so that code
+// referring to the old limit still compiles; clex does not use it.
 #define CLEX_MAX_RULES 1024
+#ifndef CLEX_INITIAL_RULE_CAPACITY
+#define CLEX_INITIAL_RULE_CAPACITY 16
+#endif
 #define CLEX_TOKEN_EOF (-1)
 #define CLEX_TOKEN_ERROR (-2)
+#define CLEX_DEFAULT_DFA_CACHE_BUDGET (1024 * 1024)
+#ifndef CLEX_STREAM_WINDOW
+#define CLEX_STREAM_WINDOW (64 * 1024)
+#endif
+#ifndef CLEX_PARALLEL_MIN_CHUNK
+#define CLEX_PARALLEL_MIN_CHUNK (64 * 1024)
+#endif
 
 typedef enum clexStatus {
   CLEX_STATUS_OK = 0,
@@ -18,9 +30,18 @@ typedef enum clexStatus {
   CLEX_STATUS_REGEX_ERROR,
   CLEX_STATUS_RULE_LIMIT_REACHED,
   CLEX_STATUS_NO_RULES,
-  CLEX_STATUS_LEXICAL_ERROR
+  CLEX_STATUS_LEXICAL_ERROR,
+  CLEX_STATUS_IO_ERROR,
+  CLEX_STATUS_INVALID_FORMAT,
+  CLEX_STATUS_UNSUPPORTED
 } clexStatus;
 
+typedef enum clexEngine {
+  CLEX_ENGINE_NFA = 0,
+  CLEX_ENGINE_DFA,
+  CLEX_ENGINE_LAZY_DFA
+} clexEngine;
+
 typedef struct clexSourcePosition {
   size_t offset;
   size_t line;
@@ -32,6 +53,13 @@ typedef struct clexSourceSpan {
   clexSourcePosition end;
 } clexSourceSpan;
 
+typedef struct clexRuleSet clexRuleSet;
+
+// Reads up to `capacity` bytes into `buffer`. Returns the number of bytes
+// read, 0 at end of input, or a negative value on failure.
+typedef long long (*clexReadCallback)(void* user_data, char* buffer,
+                                      size_t capacity);
+
 typedef struct clexRule {
   const char* re;
   clexNode* nfa;
@@ -44,6 +72,13 @@ typedef struct clexToken {
   clexSourceSpan span;
 } clexToken;
 
+typedef struct clexTokenView {
+  int kind;
+  const char* lexeme;
+  size_t length;
+  clexSourceSpan span;
+} clexTokenView;
+
 typedef struct clexError {
   clexStatus status;
   clexSourcePosition position;
@@ -52,25 +87,102 @@ typedef struct clexError {
   size_t expected_kind_count;
 } clexError;
 
+// Counters collected when clex is built with CLEX_ENABLE_STATS. `rule_hits`
+// has one entry per rule, in registration order, and is owned by the lexer.
+typedef struct clexStats {
+  size_t tokens;
+  size_t bytes;
+  size_t whitespace_bytes;
+  size_t automaton_steps;
+  size_t rule_tests;
+  size_t prefix_retries;
+  size_t lexical_errors;
+  size_t allocations;
+  const size_t* rule_hits;
+  size_t rule_count;
+} clexStats;
+
+// Per-rule counts collected by clexSetProfiling() on the NFA engine.
+typedef struct clexRuleProfile {
+  size_t tests;
+  size_t matches;
+  size_t full_matches;
+  size_t bytes_scanned;
+  size_t failure_depth;
+} clexRuleProfile;
+
 typedef struct clexLexer {
-  clexRule** rules;
+  clexRule* rules;
+  size_t rule_count;
+  size_t rule_capacity;
   const char* content;
+  size_t content_length;
+  size_t content_base;
+  clexReadCallback reader;
+  void* reader_data;
+  bool reader_eof;
+  char* window;
+  size_t window_capacity;
+  void* mapping;
+  size_t mapping_length;
   size_t position;
   size_t line;
   size_t column;
+  size_t chunk_end;
   clexError last_error;
+  clexEngine engine;
+  const clexRuleSet* rule_set;
+  clexRuleSet* owned_rule_set;
+  clexNfaScratch* scratch;
+  clexLazyDfa* lazy_dfa;
+  size_t dfa_cache_budget;
+  clexStats stats;
+  size_t* rule_hits;
+  bool profiling;
+  clexRuleProfile* profile;
+  size_t* schedule;
 } clexLexer;
 
 clexLexer* clexInit(void);
+clexLexer* clexInitWithRuleSet(const clexRuleSet* rule_set);
 void clexLexerDestroy(clexLexer* lexer);
 void clexReset(clexLexer* lexer, const char* content);
+void clexResetWithLength(clexLexer* lexer, const char* content, size_t length);
+clexStatus clexResetWithReader(clexLexer* lexer, clexReadCallback reader,
+                               void* user_data);
+clexStatus clexResetWithFd(clexLexer* lexer, int fd);
+clexStatus clexResetFromFile(clexLexer* lexer, const char* path);
 void clexTokenInit(clexToken* token);
 void clexTokenClear(clexToken* token);
+void clexTokenViewInit(clexTokenView* view);
 void clexErrorInit(clexError* error);
 void clexErrorClear(clexError* error);
 const clexError* clexGetLastError(const clexLexer* lexer);
+clexStatus clexGetStats(const clexLexer* lexer, clexStats* out);
+void clexResetStats(clexLexer* lexer);
+clexStatus clexSetProfiling(clexLexer* lexer, bool enabled);
+clexStatus clexGetRuleProfile(const clexLexer* lexer, size_t rule,
+                              clexRuleProfile* out);
+clexStatus clexProfileSchedule(const clexLexer* lexer, size_t* out_order,
+                               size_t count);
+clexStatus clexSetRuleSchedule(clexLexer* lexer, const size_t* order,
+                               size_t count);
+clexStatus clexSetEngine(clexLexer* lexer, clexEngine engine);
+clexStatus clexSetDfaCacheBudget(clexLexer* lexer, size_t bytes);
 clexStatus clexRegisterKind(clexLexer* lexer, const char* re, int kind);
 void clexDeleteKinds(clexLexer* lexer);
+clexStatus clexRuleSetCompile(const clexLexer* lexer, clexRuleSet** out);
+size_t clexRuleSetRuleCount(const clexRuleSet* rule_set);
+clexStatus clexRuleSetDfaStateCount(const clexRuleSet* rule_set,
+                                    size_t* out_built, size_t* out_minimized);
+clexStatus clexRuleSetSave(const clexRuleSet* rule_set, const char* path);
+clexStatus clexRuleSetLoad(const char* path, clexRuleSet** out);
+void clexRuleSetDestroy(clexRuleSet* rule_set);
 clexStatus clex(clexLexer* lexer, clexToken* out_token);
+clexStatus clexView(clexLexer* lexer, clexTokenView* out_view);
+clexStatus clexTokenizeBatch(clexLexer* lexer, clexTokenView* out,
+                             size_t capacity, size_t* produced);
+clexStatus clexTokenizeParallel(clexLexer* lexer, size_t thread_count,
+                                clexTokenView** out, size_t* count);
 
 #endif
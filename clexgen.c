@@ -0,0 +1,320 @@
+// clexgen: compiles a rule file into a standalone, direct-coded C scanner.
+//
+// Each line of the rule file is `<kind> <regex>`; blank lines and lines
+// starting with `#` are ignored. The generated file defines
+//
+//   clexStatus <prefix>Next(const char* content, size_t length,
+//                           clexSourcePosition* position, clexTokenView* out);
+//
+// which behaves like clexView() on a lexer with the same rules registered in
+// the same order: `position` is the cursor (start it at {0, 1, 1}) and is
+// advanced past each token. The scanner only uses types from clex.h.
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fa.h"
+
+typedef struct clexgenRule {
+  int kind;
+  const char* re;
+  size_t line;
+} clexgenRule;
+
+static char* readFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return NULL;
+  char* data = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  for (;;) {
+    if (length + 1 >= capacity) {
+      capacity = capacity ? capacity * 2 : 4096;
+      char* grown = realloc(data, capacity);
+      if (!grown) {
+        free(data);
+        fclose(file);
+        return NULL;
+      }
+      data = grown;
+    }
+    size_t count = fread(data + length, 1, capacity - length - 1, file);
+    length += count;
+    if (count == 0) break;
+  }
+  bool failed = ferror(file);
+  fclose(file);
+  if (failed) {
+    free(data);
+    return NULL;
+  }
+  data[length] = '\0';
+  return data;
+}
+
+// Splits `text` into rules in place. Returns the number of rules, or -1 and
+// the offending line number in `errorLine` for a malformed line.
+static long parseRules(char* text, clexgenRule** outRules, size_t* errorLine) {
+  size_t count = 0;
+  size_t capacity = 0;
+  clexgenRule* rules = NULL;
+  size_t lineNumber = 0;
+  char* line = text;
+  while (*line) {
+    char* next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    } else {
+      next = line + strlen(line);
+    }
+    lineNumber++;
+
+    size_t lineLength = strlen(line);
+    if (lineLength > 0 && line[lineLength - 1] == '\r') {
+      line[lineLength - 1] = '\0';
+    }
+    char* cursor = line;
+    while (*cursor == ' ' || *cursor == '\t') cursor++;
+    if (*cursor == '\0' || *cursor == '#') {
+      line = next;
+      continue;
+    }
+
+    char* end = NULL;
+    long kind = strtol(cursor, &end, 10);
+    if (end == cursor || (*end != ' ' && *end != '\t') || end[1] == '\0') {
+      free(rules);
+      *errorLine = lineNumber;
+      return -1;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 32;
+      clexgenRule* grown = realloc(rules, capacity * sizeof(clexgenRule));
+      if (!grown) {
+        free(rules);
+        *errorLine = lineNumber;
+        return -1;
+      }
+      rules = grown;
+    }
+    rules[count].kind = (int)kind;
+    rules[count].re = end + 1;
+    rules[count].line = lineNumber;
+    count++;
+    line = next;
+  }
+  *outRules = rules;
+  return (long)count;
+}
+
+static bool isIdentifier(const char* name) {
+  if (!isalpha((unsigned char)*name) && *name != '_') return false;
+  for (; *name; name++)
+    if (!isalnum((unsigned char)*name) && *name != '_') return false;
+  return true;
+}
+
+// Whitespace always ends a token, so those bytes never get a case label and
+// fall through to the accepting exit. The generated Next() skips the same
+// fixed set, which is also the one clex itself uses, rather than isspace().
+static bool isSpaceByte(int byte) {
+  return byte == ' ' || (byte >= '\t' && byte <= '\r');
+}
+
+static void emitState(FILE* out, const clexDfa* dfa, size_t state) {
+  fprintf(out, "s%zu:\n", state);
+  int rule = clexDfaAcceptRule(dfa, state);
+  if (rule >= 0) {
+    fprintf(out, "  best = i;\n");
+    fprintf(out, "  rule = %d;\n", rule);
+  }
+
+  size_t targets[256];
+  bool emitted[256] = {false};
+  for (int byte = 0; byte < 256; byte++) {
+    targets[byte] = isSpaceByte(byte)
+                        ? 0
+                        : clexDfaNextState(
+                              dfa, state,
+                              clexDfaByteClass(dfa, (unsigned char)byte));
+  }
+
+  fprintf(out, "  if (i == length) goto done;\n");
+  fprintf(out, "  switch ((unsigned char)text[i++]) {\n");
+  for (int byte = 0; byte < 256; byte++) {
+    if (emitted[byte] || targets[byte] == 0) continue;
+    for (int other = byte; other < 256; other++) {
+      if (emitted[other] || targets[other] != targets[byte]) continue;
+      fprintf(out, "    case %d:\n", other);
+      emitted[other] = true;
+    }
+    fprintf(out, "      goto s%zu;\n", targets[byte]);
+  }
+  fprintf(out, "    default:\n");
+  fprintf(out, "      goto done;\n");
+  fprintf(out, "  }\n");
+}
+
+static void emitScanner(FILE* out, const char* source, const char* prefix,
+                        const clexgenRule* rules, size_t ruleCount,
+                        const clexDfa* dfa) {
+  fprintf(out, "// Generated by clexgen from %s. Do not edit.\n", source);
+  fprintf(out, "#include <stddef.h>\n\n");
+  fprintf(out, "#include \"clex.h\"\n\n");
+
+  fprintf(out, "static const int %sKinds[%zu] = {", prefix, ruleCount);
+  for (size_t i = 0; i < ruleCount; i++)
+    fprintf(out, "%s%s%d", i ? "," : "", i % 12 ? " " : "\n    ",
+            rules[i].kind);
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out,
+          "static int %sMatch(const char* text, size_t length, "
+          "size_t* outLength) {\n"
+          "  size_t i = 0;\n"
+          "  size_t best = 0;\n"
+          "  int rule = -1;\n"
+          "  goto s1;\n",
+          prefix);
+  for (size_t state = 1; state < clexDfaStateCount(dfa); state++)
+    emitState(out, dfa, state);
+  fprintf(out,
+          "done:\n"
+          "  *outLength = best;\n"
+          "  return rule;\n"
+          "}\n\n");
+
+  fprintf(out,
+          "static void %sAdvance(clexSourcePosition* position, char byte) {\n"
+          "  if (byte == '\\n') {\n"
+          "    position->line++;\n"
+          "    position->column = 1;\n"
+          "  } else {\n"
+          "    position->column++;\n"
+          "  }\n"
+          "  position->offset++;\n"
+          "}\n\n",
+          prefix);
+
+  fprintf(out,
+          "clexStatus %sNext(const char* content, size_t length, "
+          "clexSourcePosition* position, clexTokenView* out) {\n"
+          "  while (position->offset < length) {\n"
+          "    char byte = content[position->offset];\n"
+          "    if (byte != ' ' && (byte < '\\t' || byte > '\\r')) break;\n"
+          "    %sAdvance(position, byte);\n"
+          "  }\n"
+          "  out->kind = CLEX_TOKEN_EOF;\n"
+          "  out->lexeme = NULL;\n"
+          "  out->length = 0;\n"
+          "  out->span.start = *position;\n"
+          "  out->span.end = *position;\n"
+          "  if (position->offset >= length) return CLEX_STATUS_EOF;\n"
+          "\n"
+          "  const char* text = content + position->offset;\n"
+          "  size_t matchLength = 0;\n"
+          "  int rule = %sMatch(text, length - position->offset, "
+          "&matchLength);\n"
+          "  clexStatus status = CLEX_STATUS_OK;\n"
+          "  if (rule >= 0 && matchLength > 0) {\n"
+          "    out->kind = %sKinds[rule];\n"
+          "  } else {\n"
+          "    out->kind = CLEX_TOKEN_ERROR;\n"
+          "    matchLength = 1;\n"
+          "    status = CLEX_STATUS_LEXICAL_ERROR;\n"
+          "  }\n"
+          "  out->lexeme = text;\n"
+          "  out->length = matchLength;\n"
+          "  for (size_t i = 0; i < matchLength; i++)\n"
+          "    %sAdvance(position, text[i]);\n"
+          "  out->span.end = *position;\n"
+          "  return status;\n"
+          "}\n",
+          prefix, prefix, prefix, prefix, prefix);
+}
+
+static clexDfa* buildDfa(const clexgenRule* rules, size_t ruleCount,
+                         const char* rulesPath) {
+  clexCompiledNfa** compiled = calloc(ruleCount, sizeof(clexCompiledNfa*));
+  if (!compiled) {
+    fprintf(stderr, "clexgen: out of memory\n");
+    return NULL;
+  }
+  bool ok = true;
+  for (size_t i = 0; ok && i < ruleCount; i++) {
+    clexNode* nfa = clexNfaFromRe(rules[i].re, NULL);
+    if (!nfa) {
+      fprintf(stderr, "clexgen: %s:%zu: invalid regex `%s`\n", rulesPath,
+              rules[i].line, rules[i].re);
+      ok = false;
+      break;
+    }
+    compiled[i] = clexNfaCompile(nfa);
+    clexNfaDestroy(nfa, NULL);
+    ok = compiled[i] != NULL;
+    if (!ok) fprintf(stderr, "clexgen: out of memory\n");
+  }
+
+  clexDfa* dfa = NULL;
+  if (ok) {
+    dfa = clexDfaBuild((const clexCompiledNfa* const*)compiled, ruleCount);
+    if (!dfa) fprintf(stderr, "clexgen: out of memory\n");
+  }
+  for (size_t i = 0; i < ruleCount; i++) clexCompiledNfaDestroy(compiled[i]);
+  free(compiled);
+  return dfa;
+}
+
+static int usage(void) {
+  fprintf(stderr, "usage: clexgen [-p prefix] <rules> <output.c>\n");
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  const char* prefix = "clexgen";
+  int arg = 1;
+  if (arg + 1 < argc && strcmp(argv[arg], "-p") == 0) {
+    prefix = argv[arg + 1];
+    arg += 2;
+  }
+  if (argc - arg != 2 || !isIdentifier(prefix)) return usage();
+  const char* rulesPath = argv[arg];
+  const char* outputPath = argv[arg + 1];
+
+  char* text = readFile(rulesPath);
+  if (!text) {
+    fprintf(stderr, "clexgen: cannot read %s\n", rulesPath);
+    return 1;
+  }
+  clexgenRule* rules = NULL;
+  size_t errorLine = 0;
+  long ruleCount = parseRules(text, &rules, &errorLine);
+  if (ruleCount < 0) {
+    fprintf(stderr, "clexgen: %s:%zu: expected `<kind> <regex>`\n",
+            rulesPath, errorLine);
+    free(text);
+    return 1;
+  }
+  if (ruleCount == 0) {
+    fprintf(stderr, "clexgen: %s: no rules\n", rulesPath);
+    free(text);
+    return 1;
+  }
+
+  int result = 1;
+  clexDfa* dfa = buildDfa(rules, (size_t)ruleCount, rulesPath);
+  if (dfa) {
+    FILE* out = fopen(outputPath, "w");
+    if (out) {
+      emitScanner(out, rulesPath, prefix, rules, (size_t)ruleCount, dfa);
+      if (fclose(out) == 0) result = 0;
+    }
+    if (result != 0) fprintf(stderr, "clexgen: cannot write %s\n", outputPath);
+    clexDfaDestroy(dfa);
+  }
+  free(rules);
+  free(text);
+  return result;
+}
@@ -1,14 +1,127 @@
 #include "fa.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// State-set helpers use AVX2 when the build targets it. Otherwise x86 GCC and
+// clang builds compile an AVX2 variant anyway and pick it at run time, like
+// the whitespace scanners in clex.c; SSE2 covers the rest.
+#if defined(__AVX2__)
+#define CLEX_FA_AVX2 1
+#define CLEX_FA_AVX2_TARGET
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CLEX_FA_AVX2 1
+#define CLEX_FA_AVX2_DISPATCH 1
+#define CLEX_FA_AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #undef EOF
 
-static clexNode* makeNode(bool isStart, bool isFinish) {
-  clexNode* result = malloc(sizeof(clexNode));
+// All nodes and transitions of one NFA are carved out of a single arena, so
+// clexNfaDestroy() releases the whole graph at once without walking it. The
+// first block is sized from the regex length, so a keyword rule takes a few
+// hundred bytes, and every further block doubles the previous one.
+#define CLEX_ARENA_MIN_BLOCK_SIZE 256
+#define CLEX_ARENA_BYTES_PER_CHAR 128
+
+typedef struct clexArenaBlock {
+  struct clexArenaBlock* next;
+  size_t used;
+  size_t capacity;
+  uint64_t data[];
+} clexArenaBlock;
+
+// Nodes that cache a compiled NFA; those caches live outside the arena.
+typedef struct clexArenaCleanup {
+  clexNode* node;
+  struct clexArenaCleanup* next;
+} clexArenaCleanup;
+
+// Nodes are numbered densely as they are created, so graph walks can keep
+// their visited sets in arrays indexed by clexNode::id.
+struct clexArena {
+  clexArenaBlock* blocks;
+  clexArenaCleanup* cleanups;
+  size_t nodeCount;
+  size_t nextBlockSize;
+  size_t reservedBytes;
+  bool failed;
+};
+
+static clexArena* arenaCreate(size_t patternLength) {
+  clexArena* arena = calloc(1, sizeof(clexArena));
+  if (!arena) return NULL;
+  arena->nextBlockSize = CLEX_ARENA_MIN_BLOCK_SIZE;
+  if (patternLength < SIZE_MAX / CLEX_ARENA_BYTES_PER_CHAR &&
+      patternLength * CLEX_ARENA_BYTES_PER_CHAR > arena->nextBlockSize)
+    arena->nextBlockSize = patternLength * CLEX_ARENA_BYTES_PER_CHAR;
+  return arena;
+}
+
+// A failed allocation is also recorded on the arena, so that construction can
+// check once at the end instead of after every node and transition.
+static void* arenaAlloc(clexArena* arena, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  clexArenaBlock* block = arena->blocks;
+  if (!block || block->capacity - block->used < size) {
+    size_t capacity =
+        size > arena->nextBlockSize ? size : arena->nextBlockSize;
+    block = malloc(sizeof(clexArenaBlock) + capacity);
+    if (!block) {
+      arena->failed = true;
+      return NULL;
+    }
+    if (arena->nextBlockSize <= SIZE_MAX / 2) arena->nextBlockSize *= 2;
+    arena->reservedBytes += sizeof(clexArenaBlock) + capacity;
+    block->used = 0;
+    block->capacity = capacity;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  void* result = (unsigned char*)block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+static bool arenaAddCleanup(clexArena* arena, clexNode* node) {
+  clexArenaCleanup* cleanup = arenaAlloc(arena, sizeof(clexArenaCleanup));
+  if (!cleanup) return false;
+  cleanup->node = node;
+  cleanup->next = arena->cleanups;
+  arena->cleanups = cleanup;
+  return true;
+}
+
+static void arenaDestroy(clexArena* arena) {
+  if (!arena) return;
+  for (clexArenaCleanup* cleanup = arena->cleanups; cleanup;
+       cleanup = cleanup->next) {
+    clexCompiledNfaDestroy(cleanup->node->compiled);
+    clexNfaScratchDestroy(cleanup->node->scratch);
+  }
+  clexArenaBlock* block = arena->blocks;
+  while (block) {
+    clexArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  free(arena);
+}
+
+static clexNode* makeNode(clexArena* arena, bool isStart, bool isFinish) {
+  clexNode* result = arenaAlloc(arena, sizeof(clexNode));
   if (!result) return NULL;
   result->isStart = isStart;
   result->isFinish = isFinish;
@@ -16,12 +129,15 @@ static clexNode* makeNode(bool isStart, bool isFinish) {
   result->transitionCount = 0;
   result->transitionCapacity = 0;
   result->compiled = NULL;
+  result->scratch = NULL;
+  result->arena = arena;
+  result->id = arena->nodeCount++;
   return result;
 }
 
-static clexTransition* makeTransition(char fromValue, char toValue,
-                                      clexNode* to) {
-  clexTransition* result = malloc(sizeof(clexTransition));
+static clexTransition* makeTransition(clexArena* arena, char fromValue,
+                                      char toValue, clexNode* to) {
+  clexTransition* result = arenaAlloc(arena, sizeof(clexTransition));
   if (!result) return NULL;
   result->fromValue = fromValue;
   result->toValue = toValue;
@@ -29,6 +145,8 @@ static clexTransition* makeTransition(char fromValue, char toValue,
   return result;
 }
 
+// Grown arrays are copied into fresh arena memory; the old array is
+// reclaimed together with the rest of the arena.
 static bool ensureNodeTransitionCapacity(clexNode* node, size_t required) {
   if (!node) return false;
   if (node->transitionCapacity >= required) return true;
@@ -43,8 +161,12 @@ static bool ensureNodeTransitionCapacity(clexNode* node, size_t required) {
   }
 
   clexTransition** resized =
-      realloc(node->transitions, newCapacity * sizeof(clexTransition*));
+      arenaAlloc(node->arena, newCapacity * sizeof(clexTransition*));
   if (!resized) return false;
+  if (node->transitionCapacity) {
+    memcpy(resized, node->transitions,
+           node->transitionCapacity * sizeof(clexTransition*));
+  }
   memset(resized + node->transitionCapacity, 0,
          (newCapacity - node->transitionCapacity) * sizeof(clexTransition*));
   node->transitions = resized;
@@ -57,8 +179,6 @@ static bool nodeSetTransition(clexNode* node, size_t index,
   if (!node || !transition) return false;
   if (!ensureNodeTransitionCapacity(node, index + 1)) return false;
 
-  if (node->transitions[index] && node->transitions[index] != transition)
-    free(node->transitions[index]);
   node->transitions[index] = transition;
   if (node->transitionCount < index + 1) node->transitionCount = index + 1;
   return true;
@@ -67,21 +187,17 @@ static bool nodeSetTransition(clexNode* node, size_t index,
 static bool nodeSetTransitionValues(clexNode* node, size_t index,
                                     char fromValue, char toValue,
                                     clexNode* to) {
-  clexTransition* transition = makeTransition(fromValue, toValue, to);
-  if (!transition) return false;
-  if (!nodeSetTransition(node, index, transition)) {
-    free(transition);
-    return false;
-  }
-  return true;
+  if (!node) return false;
+  clexTransition* transition =
+      makeTransition(node->arena, fromValue, toValue, to);
+  return nodeSetTransition(node, index, transition);
 }
 
 static bool nodeRepointTransition(clexNode* node, size_t index, clexNode* to) {
   if (!node || index >= node->transitionCount || !node->transitions[index])
     return false;
-  clexTransition* current = node->transitions[index];
-  return nodeSetTransitionValues(node, index, current->fromValue,
-                                 current->toValue, to);
+  node->transitions[index]->to = to;
+  return true;
 }
 
 typedef enum TokenKind {
@@ -104,66 +220,56 @@ typedef struct Token {
   char lexeme;
 } Token;
 
-static Token* makeToken(TokenKind kind) {
-  Token* result = malloc(sizeof(Token));
-  if (!result) return NULL;
-  result->kind = kind;
-  return result;
-}
-
-static Token* makeLexemeToken(TokenKind kind, char lexeme) {
-  Token* result = malloc(sizeof(Token));
-  if (!result) return NULL;
-  result->kind = kind;
-  result->lexeme = lexeme;
+static Token makeToken(TokenKind kind, char lexeme) {
+  Token result;
+  result.kind = kind;
+  result.lexeme = lexeme;
   return result;
 }
 
-static Token* lex(clexReLexerState* state) {
+static Token lex(clexReLexerState* state) {
   switch (state->lexerContent[state->lexerPosition]) {
     case '\0':
-      return makeToken(EOF);
+      return makeToken(EOF, '\0');
     case '(':;
       state->lexerPosition++;
-      return makeLexemeToken(OPARAN, '(');
+      return makeToken(OPARAN, '(');
     case ')':
       state->lexerPosition++;
-      return makeLexemeToken(CPARAN, ')');
+      return makeToken(CPARAN, ')');
     case '[':
       state->lexerPosition++;
-      return makeLexemeToken(OSBRACKET, '[');
+      return makeToken(OSBRACKET, '[');
     case ']':
       state->lexerPosition++;
-      return makeLexemeToken(CSBRACKET, ']');
+      return makeToken(CSBRACKET, ']');
     case '-':
       state->lexerPosition++;
-      return makeLexemeToken(DASH, '-');
+      return makeToken(DASH, '-');
     case '|':
       state->lexerPosition++;
-      return makeLexemeToken(PIPE, '|');
+      return makeToken(PIPE, '|');
     case '*':
       state->lexerPosition++;
-      return makeLexemeToken(STAR, '*');
+      return makeToken(STAR, '*');
     case '+':
       state->lexerPosition++;
-      return makeLexemeToken(PLUS, '+');
+      return makeToken(PLUS, '+');
     case '?':
       state->lexerPosition++;
-      return makeLexemeToken(QUESTION, '?');
+      return makeToken(QUESTION, '?');
     case '\\':
       state->lexerPosition++;
-      return makeLexemeToken(BSLASH, '\\');
+      return makeToken(BSLASH, '\\');
   }
-  Token* result =
-      makeLexemeToken(LITERAL, state->lexerContent[state->lexerPosition]);
+  Token result = makeToken(LITERAL, state->lexerContent[state->lexerPosition]);
   state->lexerPosition++;
   return result;
 }
 
-static Token* peek(clexReLexerState* state) {
-  Token* lexed = lex(state);
-  if (!lexed) return NULL;
-  if (lexed->kind != EOF) state->lexerPosition--;
+static Token peek(clexReLexerState* state) {
+  Token lexed = lex(state);
+  if (lexed.kind != EOF) state->lexerPosition--;
   return lexed;
 }
 
@@ -194,24 +300,6 @@ static void nodeVecFree(NodeVec* vec) {
   vec->capacity = 0;
 }
 
-static bool nodeVecContains(const NodeVec* vec, const clexNode* node) {
-  if (!vec) return false;
-  for (size_t i = 0; i < vec->size; i++)
-    if (vec->items[i] == node) return true;
-  return false;
-}
-
-static bool nodeVecIndexOf(const NodeVec* vec, const clexNode* node,
-                           size_t* outIndex) {
-  if (!vec || !outIndex) return false;
-  for (size_t i = 0; i < vec->size; i++)
-    if (vec->items[i] == node) {
-      *outIndex = i;
-      return true;
-    }
-  return false;
-}
-
 static bool nodeVecPush(NodeVec* vec, clexNode* node) {
   if (!vec) return false;
   if (vec->size == vec->capacity) {
@@ -237,12 +325,31 @@ typedef struct clexCompiledNode {
   size_t transitionCount;
 } clexCompiledNode;
 
+// NFA state sets are packed 64 states to a word. Epsilon closures are
+// precomputed per state: as dense masks while they stay small, otherwise as
+// index lists. Chains of `|` and `?` make the lists grow quadratically, so
+// once they would hold more than CLEX_CLOSURE_GROWTH_LIMIT items per node and
+// transition no tables are kept and epsilon edges are walked while matching.
+#define CLEX_DENSE_CLOSURE_LIMIT (128 * 1024)
+#define CLEX_CLOSURE_GROWTH_LIMIT 16
+
 struct clexCompiledNfa {
   clexCompiledNode* nodes;
   size_t nodeCount;
-  unsigned char* activeStates;
-  unsigned char* seedStates;
-  unsigned char* nextSeedStates;
+  size_t sourceNodeCount;
+  size_t wordCount;
+  uint64_t* closureMasks;
+  size_t* closureStarts;
+  size_t* closureItems;
+  bool walkEpsilons;
+  uint64_t* finishMask;
+};
+
+// Per-thread simulation state, sized for the largest NFA it will run.
+struct clexNfaScratch {
+  size_t wordCount;
+  uint64_t* activeStates;
+  uint64_t* nextStates;
   size_t* stack;
 };
 
@@ -253,28 +360,41 @@ static void compiledNfaFree(clexCompiledNfa* compiled) {
       free(compiled->nodes[i].transitions);
   }
   free(compiled->nodes);
-  free(compiled->activeStates);
-  free(compiled->seedStates);
-  free(compiled->nextSeedStates);
-  free(compiled->stack);
+  free(compiled->closureMasks);
+  free(compiled->closureStarts);
+  free(compiled->closureItems);
+  free(compiled->finishMask);
   compiled->nodes = NULL;
-  compiled->activeStates = NULL;
-  compiled->seedStates = NULL;
-  compiled->nextSeedStates = NULL;
-  compiled->stack = NULL;
+  compiled->closureMasks = NULL;
+  compiled->closureStarts = NULL;
+  compiled->closureItems = NULL;
+  compiled->finishMask = NULL;
+  compiled->walkEpsilons = false;
   compiled->nodeCount = 0;
+  compiled->wordCount = 0;
 }
 
-static bool collectReachableNodes(clexNode* start, NodeVec* nodes) {
-  if (!start || !nodes) return false;
-  if (!nodeVecPush(nodes, start)) return false;
+// Collects the nodes reachable from `start` in breadth-first order and maps
+// each node id to its position in `nodes`; unreachable ids stay SIZE_MAX.
+static bool collectReachableNodes(clexNode* start, NodeVec* nodes,
+                                  size_t** outIndexOf) {
+  if (!start || !nodes || !outIndexOf) return false;
+  size_t idCount = start->arena->nodeCount;
+  size_t* indexOf = malloc(idCount * sizeof(size_t));
+  if (!indexOf) return false;
+  for (size_t i = 0; i < idCount; i++) indexOf[i] = SIZE_MAX;
+  *outIndexOf = indexOf;
 
+  if (!nodeVecPush(nodes, start)) return false;
+  indexOf[start->id] = 0;
   for (size_t i = 0; i < nodes->size; i++) {
     clexNode* node = nodes->items[i];
     for (size_t j = 0; j < node->transitionCount; j++) {
       if (!node->transitions[j] || !node->transitions[j]->to) continue;
-      if (nodeVecContains(nodes, node->transitions[j]->to)) continue;
-      if (!nodeVecPush(nodes, node->transitions[j]->to)) return false;
+      clexNode* to = node->transitions[j]->to;
+      if (indexOf[to->id] != SIZE_MAX) continue;
+      indexOf[to->id] = nodes->size;
+      if (!nodeVecPush(nodes, to)) return false;
     }
   }
   return true;
@@ -294,11 +414,618 @@ static void freeCompiledNodesArray(clexCompiledNode* nodes, size_t nodeCount) {
   free(nodes);
 }
 
+static size_t lowestSetBit(uint64_t bits) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return index;
+#else
+  return (size_t)__builtin_ctzll(bits);
+#endif
+}
+
+static size_t highestSetBit(uint64_t bits) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse64(&index, bits);
+  return index;
+#else
+  return 63 - (size_t)__builtin_clzll(bits);
+#endif
+}
+
+static void stateSetAdd(uint64_t* set, size_t index) {
+  set[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static bool stateSetContains(const uint64_t* set, size_t index) {
+  return (set[index / 64] >> (index % 64)) & 1;
+}
+
+#if defined(CLEX_FA_AVX2_DISPATCH)
+// Detected once when the library is loaded, before any automaton runs.
+static bool cpuHasAvx2;
+
+__attribute__((constructor)) static void detectAvx2(void) {
+  __builtin_cpu_init();
+  cpuHasAvx2 = __builtin_cpu_supports("avx2");
+}
+#define CLEX_FA_USE_AVX2 cpuHasAvx2
+#elif defined(CLEX_FA_AVX2)
+#define CLEX_FA_USE_AVX2 true
+#endif
+
+#if defined(CLEX_FA_AVX2)
+// The AVX2 loops cover whole groups of four words and return how many words
+// they handled; the callers finish the rest.
+CLEX_FA_AVX2_TARGET static size_t stateSetOrAvx2(uint64_t* dst,
+                                                 const uint64_t* src,
+                                                 size_t wordCount) {
+  size_t i = 0;
+  for (; i + 4 <= wordCount; i += 4) {
+    __m256i left = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i right = _mm256_loadu_si256((const __m256i*)(src + i));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(left, right));
+  }
+  return i;
+}
+
+// Returns false as soon as a non-zero word is found.
+CLEX_FA_AVX2_TARGET static bool stateSetIsEmptyAvx2(const uint64_t* set,
+                                                    size_t wordCount,
+                                                    size_t* outDone) {
+  size_t i = 0;
+  for (; i + 4 <= wordCount; i += 4) {
+    __m256i words = _mm256_loadu_si256((const __m256i*)(set + i));
+    if (!_mm256_testz_si256(words, words)) return false;
+  }
+  *outDone = i;
+  return true;
+}
+
+// Returns true as soon as a shared bit is found.
+CLEX_FA_AVX2_TARGET static bool stateSetIntersectsAvx2(const uint64_t* left,
+                                                       const uint64_t* right,
+                                                       size_t wordCount,
+                                                       size_t* outDone) {
+  size_t i = 0;
+  for (; i + 4 <= wordCount; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(left + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(right + i));
+    if (!_mm256_testz_si256(a, b)) return true;
+  }
+  *outDone = i;
+  return false;
+}
+#endif
+
+static void stateSetOr(uint64_t* dst, const uint64_t* src, size_t wordCount) {
+  size_t i = 0;
+#if defined(CLEX_FA_AVX2)
+  if (CLEX_FA_USE_AVX2) i = stateSetOrAvx2(dst, src, wordCount);
+#endif
+#if defined(__SSE2__)
+  for (; i + 2 <= wordCount; i += 2) {
+    __m128i left = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i right = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(left, right));
+  }
+#endif
+  for (; i < wordCount; i++) dst[i] |= src[i];
+}
+
+static bool stateSetIsEmpty(const uint64_t* set, size_t wordCount) {
+  size_t i = 0;
+#if defined(CLEX_FA_AVX2)
+  if (CLEX_FA_USE_AVX2 && !stateSetIsEmptyAvx2(set, wordCount, &i))
+    return false;
+#endif
+#if defined(__SSE2__)
+  for (; i + 2 <= wordCount; i += 2) {
+    __m128i words = _mm_loadu_si128((const __m128i*)(set + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(words, _mm_setzero_si128())) !=
+        0xFFFF)
+      return false;
+  }
+#endif
+  for (; i < wordCount; i++)
+    if (set[i]) return false;
+  return true;
+}
+
+static bool stateSetIntersects(const uint64_t* left, const uint64_t* right,
+                               size_t wordCount) {
+  size_t i = 0;
+#if defined(CLEX_FA_AVX2)
+  if (CLEX_FA_USE_AVX2 && stateSetIntersectsAvx2(left, right, wordCount, &i))
+    return true;
+#endif
+#if defined(__SSE2__)
+  for (; i + 2 <= wordCount; i += 2) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(left + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(right + i));
+    __m128i both = _mm_and_si128(a, b);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(both, _mm_setzero_si128())) != 0xFFFF)
+      return true;
+  }
+#endif
+  for (; i < wordCount; i++)
+    if (left[i] & right[i]) return true;
+  return false;
+}
+
+// Leaves *outItems NULL when the lists would hold more than `budget` items.
+static bool collectClosureLists(const clexCompiledNfa* compiled,
+                                size_t* starts, size_t* stack, size_t* mark,
+                                size_t budget, size_t** outItems) {
+  *outItems = NULL;
+  size_t* items = NULL;
+  size_t itemCount = 0;
+  size_t itemCapacity = 0;
+
+  for (size_t i = 0; i < compiled->nodeCount; i++) {
+    size_t stackSize = 0;
+    starts[i] = itemCount;
+    mark[i] = i + 1;
+    stack[stackSize++] = i;
+    while (stackSize > 0) {
+      size_t index = stack[--stackSize];
+      if (itemCount == budget) {
+        free(items);
+        return true;
+      }
+      if (itemCount == itemCapacity) {
+        size_t newCapacity =
+            itemCapacity ? itemCapacity * 2 : compiled->nodeCount;
+        size_t* newItems = realloc(items, newCapacity * sizeof(size_t));
+        if (!newItems) {
+          free(items);
+          return false;
+        }
+        items = newItems;
+        itemCapacity = newCapacity;
+      }
+      items[itemCount++] = index;
+
+      clexCompiledNode* node = &compiled->nodes[index];
+      for (size_t j = 0; j < node->transitionCount; j++) {
+        clexCompiledTransition* transition = &node->transitions[j];
+        if (transition->fromValue != '\0') continue;
+        if (mark[transition->toIndex] == i + 1) continue;
+        mark[transition->toIndex] = i + 1;
+        stack[stackSize++] = transition->toIndex;
+      }
+    }
+  }
+  starts[compiled->nodeCount] = itemCount;
+  *outItems = items;
+  return true;
+}
+
+// Leaves both closure representations NULL for an epsilon-free NFA, where
+// every closure is just the state itself.
+static bool buildClosures(clexCompiledNfa* compiled) {
+  size_t nodeCount = compiled->nodeCount;
+  size_t transitionCount = 0;
+  bool hasEpsilon = false;
+  for (size_t i = 0; i < nodeCount; i++) {
+    transitionCount += compiled->nodes[i].transitionCount;
+    for (size_t j = 0; j < compiled->nodes[i].transitionCount; j++)
+      if (compiled->nodes[i].transitions[j].fromValue == '\0')
+        hasEpsilon = true;
+  }
+  if (!hasEpsilon) return true;
+
+  bool dense = nodeCount * compiled->wordCount * sizeof(uint64_t) <=
+               CLEX_DENSE_CLOSURE_LIMIT;
+  size_t budget = dense ? SIZE_MAX
+                        : CLEX_CLOSURE_GROWTH_LIMIT *
+                              (nodeCount + transitionCount);
+  size_t* starts = calloc(nodeCount + 1, sizeof(size_t));
+  size_t* stack = calloc(nodeCount, sizeof(size_t));
+  size_t* mark = calloc(nodeCount, sizeof(size_t));
+  size_t* items = NULL;
+  bool ok = starts && stack && mark &&
+            collectClosureLists(compiled, starts, stack, mark, budget, &items);
+  free(stack);
+  free(mark);
+  if (!ok) {
+    free(starts);
+    return false;
+  }
+  if (!items) {
+    free(starts);
+    compiled->walkEpsilons = true;
+    return true;
+  }
+
+  if (dense) {
+    compiled->closureMasks =
+        calloc(nodeCount * compiled->wordCount, sizeof(uint64_t));
+    if (compiled->closureMasks) {
+      for (size_t i = 0; i < nodeCount; i++)
+        for (size_t j = starts[i]; j < starts[i + 1]; j++)
+          stateSetAdd(compiled->closureMasks + i * compiled->wordCount,
+                      items[j]);
+      free(starts);
+      free(items);
+      return true;
+    }
+  }
+
+  compiled->closureStarts = starts;
+  compiled->closureItems = items;
+  return true;
+}
+
+// Every compiled NFA goes through a small optimization pipeline: epsilon
+// elimination, pruning of unreachable and dead states, and merging of states
+// that have the same finish flag and the same transitions into equivalent
+// states. State 0 stays the start state throughout. Without epsilon
+// transitions the simulation no longer needs closure tables.
+
+// Elimination copies the byte transitions of a whole closure onto each state;
+// when that would grow the graph more than this factor the epsilon graph is
+// kept, since the closure tables are then the cheaper representation.
+#define CLEX_EPSILON_GROWTH_LIMIT 16
+
+static int compareCompiledTransitions(const void* left, const void* right) {
+  const clexCompiledTransition* a = left;
+  const clexCompiledTransition* b = right;
+  if (a->fromValue != b->fromValue) return a->fromValue < b->fromValue ? -1 : 1;
+  if (a->toValue != b->toValue) return a->toValue < b->toValue ? -1 : 1;
+  if (a->toIndex != b->toIndex) return a->toIndex < b->toIndex ? -1 : 1;
+  return 0;
+}
+
+static size_t sortUniqueTransitions(clexCompiledTransition* transitions,
+                                    size_t count) {
+  if (count < 2) return count;
+  qsort(transitions, count, sizeof(clexCompiledTransition),
+        compareCompiledTransitions);
+  size_t unique = 1;
+  for (size_t i = 1; i < count; i++)
+    if (compareCompiledTransitions(&transitions[i],
+                                   &transitions[unique - 1]) != 0)
+      transitions[unique++] = transitions[i];
+  return unique;
+}
+
+static size_t collectEpsilonClosure(const clexCompiledNode* nodes, size_t start,
+                                    size_t* closure, size_t* mark) {
+  size_t closureSize = 0;
+  mark[start] = start + 1;
+  closure[closureSize++] = start;
+  for (size_t i = 0; i < closureSize; i++) {
+    const clexCompiledNode* node = &nodes[closure[i]];
+    for (size_t j = 0; j < node->transitionCount; j++) {
+      const clexCompiledTransition* transition = &node->transitions[j];
+      if (transition->fromValue != '\0') continue;
+      if (mark[transition->toIndex] == start + 1) continue;
+      mark[transition->toIndex] = start + 1;
+      closure[closureSize++] = transition->toIndex;
+    }
+  }
+  return closureSize;
+}
+
+// Leaves *outNodes NULL when the graph has no epsilon transitions or when
+// eliminating them would exceed CLEX_EPSILON_GROWTH_LIMIT.
+static bool eliminateEpsilons(const clexCompiledNode* nodes, size_t nodeCount,
+                              clexCompiledNode** outNodes) {
+  *outNodes = NULL;
+  size_t transitionCount = 0;
+  bool hasEpsilon = false;
+  for (size_t i = 0; i < nodeCount; i++) {
+    transitionCount += nodes[i].transitionCount;
+    for (size_t j = 0; j < nodes[i].transitionCount; j++)
+      if (nodes[i].transitions[j].fromValue == '\0') hasEpsilon = true;
+  }
+  if (!hasEpsilon) return true;
+
+  size_t budget = CLEX_EPSILON_GROWTH_LIMIT * (transitionCount + nodeCount);
+  size_t* closure = malloc(nodeCount * sizeof(size_t));
+  size_t* mark = calloc(nodeCount, sizeof(size_t));
+  clexCompiledNode* result = calloc(nodeCount, sizeof(clexCompiledNode));
+  bool ok = closure && mark && result;
+  size_t total = 0;
+  for (size_t i = 0; ok && i < nodeCount; i++) {
+    size_t closureSize = collectEpsilonClosure(nodes, i, closure, mark);
+    size_t count = 0;
+    for (size_t j = 0; j < closureSize; j++) {
+      const clexCompiledNode* member = &nodes[closure[j]];
+      if (member->isFinish) result[i].isFinish = true;
+      count += member->transitionCount;
+    }
+    total += count;
+    if (total > budget) {
+      freeCompiledNodesArray(result, nodeCount);
+      result = NULL;
+      break;
+    }
+    if (count == 0) continue;
+
+    result[i].transitions = malloc(count * sizeof(clexCompiledTransition));
+    if (!result[i].transitions) {
+      ok = false;
+      break;
+    }
+    size_t kept = 0;
+    for (size_t j = 0; j < closureSize; j++) {
+      const clexCompiledNode* member = &nodes[closure[j]];
+      for (size_t k = 0; k < member->transitionCount; k++)
+        if (member->transitions[k].fromValue != '\0')
+          result[i].transitions[kept++] = member->transitions[k];
+    }
+    result[i].transitionCount =
+        sortUniqueTransitions(result[i].transitions, kept);
+  }
+  free(closure);
+  free(mark);
+  if (!ok) {
+    freeCompiledNodesArray(result, nodeCount);
+    return false;
+  }
+  *outNodes = result;
+  return true;
+}
+
+// Drops states that cannot be reached from the start state or that cannot
+// reach a finish state, along with transitions into them, and renumbers the
+// rest in place.
+static bool pruneCompiledNodes(clexCompiledNode* nodes, size_t* nodeCount) {
+  size_t count = *nodeCount;
+  size_t* order = malloc(count * sizeof(size_t));
+  size_t* incomingStart = calloc(count + 1, sizeof(size_t));
+  bool* reachable = calloc(count, sizeof(bool));
+  bool* live = calloc(count, sizeof(bool));
+  size_t* incoming = NULL;
+  size_t edgeCount = 0;
+  for (size_t i = 0; i < count; i++) edgeCount += nodes[i].transitionCount;
+  if (order && incomingStart && reachable && live)
+    incoming = malloc((edgeCount ? edgeCount : 1) * sizeof(size_t));
+  if (!incoming) {
+    free(order);
+    free(incomingStart);
+    free(reachable);
+    free(live);
+    return false;
+  }
+
+  size_t orderSize = 0;
+  reachable[0] = true;
+  order[orderSize++] = 0;
+  for (size_t i = 0; i < orderSize; i++) {
+    const clexCompiledNode* node = &nodes[order[i]];
+    for (size_t j = 0; j < node->transitionCount; j++) {
+      size_t to = node->transitions[j].toIndex;
+      if (reachable[to]) continue;
+      reachable[to] = true;
+      order[orderSize++] = to;
+    }
+  }
+
+  // Reverse edges in CSR form: the edges into state i are
+  // incoming[incomingStart[i] .. incomingStart[i + 1]).
+  for (size_t i = 0; i < count; i++)
+    for (size_t j = 0; j < nodes[i].transitionCount; j++)
+      incomingStart[nodes[i].transitions[j].toIndex]++;
+  for (size_t i = 1; i <= count; i++) incomingStart[i] += incomingStart[i - 1];
+  for (size_t i = 0; i < count; i++)
+    for (size_t j = 0; j < nodes[i].transitionCount; j++)
+      incoming[--incomingStart[nodes[i].transitions[j].toIndex]] = i;
+
+  orderSize = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!nodes[i].isFinish) continue;
+    live[i] = true;
+    order[orderSize++] = i;
+  }
+  for (size_t i = 0; i < orderSize; i++) {
+    size_t node = order[i];
+    for (size_t j = incomingStart[node]; j < incomingStart[node + 1]; j++) {
+      if (live[incoming[j]]) continue;
+      live[incoming[j]] = true;
+      order[orderSize++] = incoming[j];
+    }
+  }
+
+  // `order` is reused as the old-to-new index map.
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++)
+    order[i] = reachable[i] && (live[i] || i == 0) ? kept++ : SIZE_MAX;
+  for (size_t i = 0; i < count; i++) {
+    clexCompiledNode node = nodes[i];
+    if (order[i] == SIZE_MAX) {
+      free(node.transitions);
+      continue;
+    }
+    size_t transitionCount = 0;
+    for (size_t j = 0; j < node.transitionCount; j++) {
+      size_t to = order[node.transitions[j].toIndex];
+      if (to == SIZE_MAX) continue;
+      node.transitions[transitionCount] = node.transitions[j];
+      node.transitions[transitionCount++].toIndex = to;
+    }
+    node.transitionCount = transitionCount;
+    nodes[order[i]] = node;
+  }
+  *nodeCount = kept;
+  free(order);
+  free(incomingStart);
+  free(incoming);
+  free(reachable);
+  free(live);
+  return true;
+}
+
+// Signatures of a state during partition refinement: its current class and
+// its transitions with targets replaced by their classes.
+typedef struct MergeSignatures {
+  size_t* classOf;
+  size_t* start;
+  size_t* length;
+  clexCompiledTransition* items;
+} MergeSignatures;
+
+static uint64_t hashSignature(const MergeSignatures* signatures, size_t state) {
+  uint64_t hash = 1469598103934665603ULL;
+  hash = (hash ^ signatures->classOf[state]) * 1099511628211ULL;
+  const clexCompiledTransition* items =
+      signatures->items + signatures->start[state];
+  for (size_t i = 0; i < signatures->length[state]; i++) {
+    hash = (hash ^ (unsigned char)items[i].fromValue) * 1099511628211ULL;
+    hash = (hash ^ (unsigned char)items[i].toValue) * 1099511628211ULL;
+    hash = (hash ^ items[i].toIndex) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static bool sameSignature(const MergeSignatures* signatures, size_t left,
+                          size_t right) {
+  if (signatures->classOf[left] != signatures->classOf[right]) return false;
+  if (signatures->length[left] != signatures->length[right]) return false;
+  const clexCompiledTransition* a = signatures->items + signatures->start[left];
+  const clexCompiledTransition* b =
+      signatures->items + signatures->start[right];
+  for (size_t i = 0; i < signatures->length[left]; i++)
+    if (compareCompiledTransitions(&a[i], &b[i]) != 0) return false;
+  return true;
+}
+
+// Splits classes by signature until the partition is stable. Classes are
+// numbered in order of their first state, so state 0 stays in class 0.
+static size_t refineClasses(const clexCompiledNode* nodes, size_t nodeCount,
+                            MergeSignatures* signatures, size_t* newClassOf,
+                            size_t* table, size_t tableCapacity) {
+  size_t classCount = 0;
+  for (size_t i = 0; i < nodeCount; i++) {
+    signatures->classOf[i] = nodes[i].isFinish != nodes[0].isFinish;
+    if (signatures->classOf[i] + 1 > classCount)
+      classCount = signatures->classOf[i] + 1;
+  }
+
+  for (;;) {
+    for (size_t i = 0; i < nodeCount; i++) {
+      clexCompiledTransition* items =
+          signatures->items + signatures->start[i];
+      for (size_t j = 0; j < nodes[i].transitionCount; j++) {
+        items[j] = nodes[i].transitions[j];
+        items[j].toIndex = signatures->classOf[items[j].toIndex];
+      }
+      signatures->length[i] =
+          sortUniqueTransitions(items, nodes[i].transitionCount);
+    }
+
+    memset(table, 0, tableCapacity * sizeof(size_t));
+    size_t newClassCount = 0;
+    for (size_t i = 0; i < nodeCount; i++) {
+      size_t slot = (size_t)hashSignature(signatures, i) & (tableCapacity - 1);
+      while (table[slot] && !sameSignature(signatures, table[slot] - 1, i))
+        slot = (slot + 1) & (tableCapacity - 1);
+      if (!table[slot]) {
+        table[slot] = i + 1;
+        newClassOf[i] = newClassCount++;
+      } else {
+        newClassOf[i] = newClassOf[table[slot] - 1];
+      }
+    }
+
+    memcpy(signatures->classOf, newClassOf, nodeCount * sizeof(size_t));
+    // Refinement only ever splits classes, so an unchanged count means an
+    // unchanged partition.
+    if (newClassCount == classCount) return classCount;
+    classCount = newClassCount;
+  }
+}
+
+// Merges states with the same finish flag whose transitions lead to
+// equivalent states on the same byte ranges.
+static bool mergeEquivalentStates(clexCompiledNode** nodes,
+                                  size_t* nodeCount) {
+  size_t count = *nodeCount;
+  size_t transitionCount = 0;
+  for (size_t i = 0; i < count; i++)
+    transitionCount += (*nodes)[i].transitionCount;
+  size_t tableCapacity = 16;
+  while (tableCapacity < count * 2) tableCapacity *= 2;
+
+  MergeSignatures signatures;
+  signatures.classOf = malloc(count * sizeof(size_t));
+  signatures.start = malloc(count * sizeof(size_t));
+  signatures.length = malloc(count * sizeof(size_t));
+  signatures.items = malloc((transitionCount ? transitionCount : 1) *
+                            sizeof(clexCompiledTransition));
+  size_t* newClassOf = malloc(count * sizeof(size_t));
+  size_t* table = malloc(tableCapacity * sizeof(size_t));
+  clexCompiledNode* merged = NULL;
+  size_t classCount = 0;
+  bool ok = signatures.classOf && signatures.start && signatures.length &&
+            signatures.items && newClassOf && table;
+  if (ok) {
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+      signatures.start[i] = offset;
+      offset += (*nodes)[i].transitionCount;
+    }
+    classCount = refineClasses(*nodes, count, &signatures, newClassOf, table,
+                               tableCapacity);
+    if (classCount < count)
+      merged = calloc(classCount, sizeof(clexCompiledNode));
+    ok = classCount == count || merged;
+  }
+
+  // The first state of each class stands in for it; its signature already
+  // names target classes, which are the merged state indices.
+  for (size_t i = 0, next = 0; ok && merged && i < count; i++) {
+    if (signatures.classOf[i] != next) continue;
+    next++;
+    clexCompiledNode* node = &merged[signatures.classOf[i]];
+    node->isFinish = (*nodes)[i].isFinish;
+    node->transitionCount = signatures.length[i];
+    if (node->transitionCount == 0) continue;
+    node->transitions =
+        malloc(node->transitionCount * sizeof(clexCompiledTransition));
+    if (!node->transitions) {
+      ok = false;
+      break;
+    }
+    memcpy(node->transitions, signatures.items + signatures.start[i],
+           node->transitionCount * sizeof(clexCompiledTransition));
+  }
+  if (ok && merged) {
+    freeCompiledNodesArray(*nodes, count);
+    *nodes = merged;
+    *nodeCount = classCount;
+  } else if (merged) {
+    freeCompiledNodesArray(merged, classCount);
+  }
+  free(signatures.classOf);
+  free(signatures.start);
+  free(signatures.length);
+  free(signatures.items);
+  free(newClassOf);
+  free(table);
+  return ok;
+}
+
+static bool optimizeCompiledNodes(clexCompiledNode** nodes, size_t* nodeCount) {
+  clexCompiledNode* epsilonFree = NULL;
+  if (!eliminateEpsilons(*nodes, *nodeCount, &epsilonFree)) return false;
+  if (!epsilonFree) return true;
+  freeCompiledNodesArray(*nodes, *nodeCount);
+  *nodes = epsilonFree;
+  return pruneCompiledNodes(*nodes, nodeCount) &&
+         mergeEquivalentStates(nodes, nodeCount);
+}
+
 static bool buildCompiledNfa(clexNode* start, clexCompiledNfa* outCompiled) {
   if (!start || !outCompiled) return false;
 
   NodeVec nodes = {0};
-  if (!collectReachableNodes(start, &nodes)) {
+  size_t* indexOf = NULL;
+  if (!collectReachableNodes(start, &nodes, &indexOf)) {
+    free(indexOf);
     nodeVecFree(&nodes);
     return false;
   }
@@ -306,6 +1033,7 @@ static bool buildCompiledNfa(clexNode* start, clexCompiledNfa* outCompiled) {
   clexCompiledNode* compiledNodes =
       calloc(nodes.size, sizeof(clexCompiledNode));
   if (!compiledNodes) {
+    free(indexOf);
     nodeVecFree(&nodes);
     return false;
   }
@@ -321,6 +1049,7 @@ static bool buildCompiledNfa(clexNode* start, clexCompiledNfa* outCompiled) {
                                           sizeof(clexCompiledTransition));
     if (!compiledNodes[i].transitions) {
       freeCompiledNodesArray(compiledNodes, nodes.size);
+      free(indexOf);
       nodeVecFree(&nodes);
       return false;
     }
@@ -328,9 +1057,12 @@ static bool buildCompiledNfa(clexNode* start, clexCompiledNfa* outCompiled) {
     size_t transitionIndex = 0;
     for (size_t j = 0; j < node->transitionCount; j++) {
       if (!node->transitions[j]) continue;
-      size_t toIndex = 0;
-      if (!nodeVecIndexOf(&nodes, node->transitions[j]->to, &toIndex)) {
+      size_t toIndex = SIZE_MAX;
+      if (node->transitions[j]->to)
+        toIndex = indexOf[node->transitions[j]->to->id];
+      if (toIndex == SIZE_MAX) {
         freeCompiledNodesArray(compiledNodes, nodes.size);
+        free(indexOf);
         nodeVecFree(&nodes);
         return false;
       }
@@ -344,119 +1076,167 @@ static bool buildCompiledNfa(clexNode* start, clexCompiledNfa* outCompiled) {
     }
   }
 
+  free(indexOf);
+  size_t nodeCount = nodes.size;
+  nodeVecFree(&nodes);
+  outCompiled->sourceNodeCount = nodeCount;
+  if (!optimizeCompiledNodes(&compiledNodes, &nodeCount)) {
+    freeCompiledNodesArray(compiledNodes, nodeCount);
+    return false;
+  }
+
   outCompiled->nodes = compiledNodes;
-  outCompiled->nodeCount = nodes.size;
-  outCompiled->activeStates = calloc(nodes.size, sizeof(unsigned char));
-  outCompiled->seedStates = calloc(nodes.size, sizeof(unsigned char));
-  outCompiled->nextSeedStates = calloc(nodes.size, sizeof(unsigned char));
-  outCompiled->stack = calloc(nodes.size, sizeof(size_t));
-  if (!outCompiled->activeStates || !outCompiled->seedStates ||
-      !outCompiled->nextSeedStates || !outCompiled->stack) {
+  outCompiled->nodeCount = nodeCount;
+  outCompiled->wordCount = (nodeCount + 63) / 64;
+  outCompiled->finishMask = calloc(outCompiled->wordCount, sizeof(uint64_t));
+  if (!outCompiled->finishMask || !buildClosures(outCompiled)) {
     compiledNfaFree(outCompiled);
-    nodeVecFree(&nodes);
     return false;
   }
-  nodeVecFree(&nodes);
+  for (size_t i = 0; i < nodeCount; i++)
+    if (compiledNodes[i].isFinish) stateSetAdd(outCompiled->finishMask, i);
   return true;
 }
 
-static bool stateSetHasAny(const unsigned char* states, size_t stateCount) {
-  for (size_t i = 0; i < stateCount; i++)
-    if (states[i]) return true;
-  return false;
-}
-
-static void epsilonClosure(const clexCompiledNfa* compiled,
-                           const unsigned char* seedStates,
-                           unsigned char* outStates, size_t* stack) {
-  size_t stackSize = 0;
-  memset(outStates, 0, compiled->nodeCount * sizeof(unsigned char));
-
-  for (size_t i = 0; i < compiled->nodeCount; i++) {
-    if (!seedStates[i]) continue;
-    outStates[i] = 1;
-    stack[stackSize++] = i;
-  }
-
-  while (stackSize > 0) {
-    size_t index = stack[--stackSize];
-    clexCompiledNode* node = &compiled->nodes[index];
-    for (size_t i = 0; i < node->transitionCount; i++) {
-      clexCompiledTransition* transition = &node->transitions[i];
-      if (transition->fromValue != '\0') continue;
-      if (outStates[transition->toIndex]) continue;
-      outStates[transition->toIndex] = 1;
-      stack[stackSize++] = transition->toIndex;
+// `stack` holds at least nodeCount entries and is only used when the NFA has
+// no closure tables. A state already in `set` brings its whole closure with
+// it, so the walk stops there.
+static void compiledNfaAddClosure(const clexCompiledNfa* compiled,
+                                  uint64_t* set, size_t index, size_t* stack) {
+  if (compiled->walkEpsilons) {
+    if (stateSetContains(set, index)) return;
+    size_t stackSize = 0;
+    stateSetAdd(set, index);
+    stack[stackSize++] = index;
+    while (stackSize > 0) {
+      const clexCompiledNode* node = &compiled->nodes[stack[--stackSize]];
+      for (size_t i = 0; i < node->transitionCount; i++) {
+        const clexCompiledTransition* transition = &node->transitions[i];
+        if (transition->fromValue != '\0') continue;
+        if (stateSetContains(set, transition->toIndex)) continue;
+        stateSetAdd(set, transition->toIndex);
+        stack[stackSize++] = transition->toIndex;
+      }
     }
+    return;
+  }
+  if (!compiled->closureMasks && !compiled->closureStarts) {
+    stateSetAdd(set, index);
+    return;
   }
+  if (compiled->closureMasks) {
+    stateSetOr(set, compiled->closureMasks + index * compiled->wordCount,
+               compiled->wordCount);
+    return;
+  }
+  for (size_t i = compiled->closureStarts[index];
+       i < compiled->closureStarts[index + 1]; i++)
+    stateSetAdd(set, compiled->closureItems[i]);
 }
 
-static bool runCompiledNfa(const clexCompiledNfa* compiled,
-                           const char* target) {
-  if (!compiled || !target || compiled->nodeCount == 0) return false;
-  if (!compiled->activeStates || !compiled->seedStates ||
-      !compiled->nextSeedStates || !compiled->stack)
-    return false;
-
-  bool matched = false;
+static bool compiledNfaReady(const clexCompiledNfa* compiled,
+                             const clexNfaScratch* scratch) {
+  return compiled && scratch && compiled->nodeCount > 0 &&
+         scratch->wordCount >= compiled->wordCount;
+}
 
-  memset(compiled->seedStates, 0, compiled->nodeCount * sizeof(unsigned char));
-  compiled->seedStates[0] = 1;
-  epsilonClosure(compiled, compiled->seedStates, compiled->activeStates,
-                 compiled->stack);
+static void compiledNfaStart(const clexCompiledNfa* compiled,
+                             clexNfaScratch* scratch) {
+  memset(scratch->activeStates, 0, compiled->wordCount * sizeof(uint64_t));
+  compiledNfaAddClosure(compiled, scratch->activeStates, 0, scratch->stack);
+}
 
-  for (size_t i = 0; target[i] != '\0'; i++) {
-    char symbol = target[i];
-    memset(compiled->nextSeedStates, 0,
-           compiled->nodeCount * sizeof(unsigned char));
+static bool compiledNfaStep(const clexCompiledNfa* compiled,
+                            clexNfaScratch* scratch, char symbol) {
+  uint64_t* next = scratch->nextStates;
+  memset(next, 0, compiled->wordCount * sizeof(uint64_t));
 
-    for (size_t j = 0; j < compiled->nodeCount; j++) {
-      if (!compiled->activeStates[j]) continue;
-      clexCompiledNode* node = &compiled->nodes[j];
+  for (size_t word = 0; word < compiled->wordCount; word++) {
+    uint64_t bits = scratch->activeStates[word];
+    while (bits) {
+      size_t j = word * 64 + lowestSetBit(bits);
+      bits &= bits - 1;
+      const clexCompiledNode* node = &compiled->nodes[j];
 
       for (size_t k = 0; k < node->transitionCount; k++) {
-        clexCompiledTransition* transition = &node->transitions[k];
+        const clexCompiledTransition* transition = &node->transitions[k];
         if (transition->fromValue == '\0') continue;
         if (transition->fromValue <= symbol && transition->toValue >= symbol)
-          compiled->nextSeedStates[transition->toIndex] = 1;
+          compiledNfaAddClosure(compiled, next, transition->toIndex,
+                                scratch->stack);
       }
     }
-
-    if (!stateSetHasAny(compiled->nextSeedStates, compiled->nodeCount))
-      return false;
-    epsilonClosure(compiled, compiled->nextSeedStates, compiled->activeStates,
-                   compiled->stack);
-    if (!stateSetHasAny(compiled->activeStates, compiled->nodeCount))
-      return false;
   }
 
-  for (size_t i = 0; i < compiled->nodeCount; i++)
-    if (compiled->activeStates[i] && compiled->nodes[i].isFinish) {
-      matched = true;
-      break;
-    }
+  scratch->nextStates = scratch->activeStates;
+  scratch->activeStates = next;
+  return !stateSetIsEmpty(next, compiled->wordCount);
+}
 
-  return matched;
+static bool compiledNfaAccepting(const clexCompiledNfa* compiled,
+                                 const clexNfaScratch* scratch) {
+  return stateSetIntersects(scratch->activeStates, compiled->finishMask,
+                            compiled->wordCount);
 }
 
-static clexNode* getFinishNodeInternal(clexNode* node, NodeVec* seen) {
-  if (!node) return NULL;
-  if (node->isFinish) return node;
-  if (nodeVecContains(seen, node)) return NULL;
-  if (!nodeVecPush(seen, node)) return NULL;
+static bool runCompiledNfa(const clexCompiledNfa* compiled,
+                           clexNfaScratch* scratch, const char* target) {
+  if (!target || !compiledNfaReady(compiled, scratch)) return false;
 
-  for (size_t i = 0; i < node->transitionCount; i++) {
-    if (!node->transitions[i]) continue;
-    clexNode* result = getFinishNodeInternal(node->transitions[i]->to, seen);
-    if (result) return result;
+  compiledNfaStart(compiled, scratch);
+  for (size_t i = 0; target[i] != '\0'; i++)
+    if (!compiledNfaStep(compiled, scratch, target[i])) return false;
+
+  return compiledNfaAccepting(compiled, scratch);
+}
+
+// Walks target once and remembers the last accepting position, stopping as
+// soon as no state is left alive. `outScanned`, when given, receives the
+// number of bytes consumed before that happened.
+static size_t runCompiledNfaLongest(const clexCompiledNfa* compiled,
+                                    clexNfaScratch* scratch,
+                                    const char* target, size_t length,
+                                    size_t* outScanned) {
+  if (outScanned) *outScanned = 0;
+  if (!target || !compiledNfaReady(compiled, scratch)) return 0;
+
+  size_t longest = 0;
+  size_t i = 0;
+  compiledNfaStart(compiled, scratch);
+  for (; i < length; i++) {
+    if (!compiledNfaStep(compiled, scratch, target[i])) break;
+    if (compiledNfaAccepting(compiled, scratch)) longest = i + 1;
   }
-  return NULL;
+  if (outScanned) *outScanned = i;
+  return longest;
 }
 
+// Depth-first, visiting transitions in order, with an explicit stack so long
+// alternations cannot exhaust the C stack.
 static clexNode* getFinishNode(clexNode* node) {
-  NodeVec seen = {0};
-  clexNode* result = getFinishNodeInternal(node, &seen);
-  nodeVecFree(&seen);
+  if (!node) return NULL;
+  if (node->isFinish) return node;
+  uint64_t* seen =
+      calloc((node->arena->nodeCount + 63) / 64, sizeof(uint64_t));
+  if (!seen) return NULL;
+  NodeVec stack = {0};
+  clexNode* result = NULL;
+  bool ok = nodeVecPush(&stack, node);
+  while (ok && stack.size > 0) {
+    clexNode* current = stack.items[--stack.size];
+    if (current->isFinish) {
+      result = current;
+      break;
+    }
+    if (stateSetContains(seen, current->id)) continue;
+    stateSetAdd(seen, current->id);
+    for (size_t i = current->transitionCount; ok && i-- > 0;) {
+      if (current->transitions[i] && current->transitions[i]->to)
+        ok = nodeVecPush(&stack, current->transitions[i]->to);
+    }
+  }
+  nodeVecFree(&stack);
+  free(seen);
   return result;
 }
 
@@ -542,18 +1322,27 @@ static bool validateRegexSyntax(const char* re) {
   return true;
 }
 
+static clexNode* nfaFail(clexReLexerState* state, bool ownsArena) {
+  if (ownsArena) {
+    arenaDestroy(state->arena);
+    state->arena = NULL;
+  }
+  return NULL;
+}
+
 clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
-  bool isOuter = false;
+  if (re && !validateRegexSyntax(re)) return NULL;
+  clexReLexerState outerState;
   if (!state) {
-    state = calloc(1, sizeof(clexReLexerState));
-    if (!state) return NULL;
-    isOuter = true;
+    memset(&outerState, 0, sizeof(outerState));
+    state = &outerState;
   }
+  // A call with a pattern starts from a fresh state and creates the arena it
+  // owns. Nested calls for alternatives pass no pattern and allocate from the
+  // same arena; only the owner frees it on failure.
+  bool ownsArena = false;
   if (re) {
-    if (!validateRegexSyntax(re)) {
-      if (isOuter) free(state);
-      return NULL;
-    }
+    state->arena = NULL;
     state->lexerContent = re;
     state->lexerPosition = 0;
     state->lastBeforeParanEntry = NULL;
@@ -563,109 +1352,86 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
     state->pipeSeen = false;
     state->inBackslash = false;
   }
+  if (!state->arena) {
+    state->arena = arenaCreate(re ? strlen(re) : 0);
+    if (!state->arena) return NULL;
+    ownsArena = true;
+  }
 
-  Token* token;
-  clexNode* entry = makeNode(true, true);
+  Token token;
+  clexNode* entry = makeNode(state->arena, true, true);
   if (!entry) {
-    if (isOuter) free(state);
-    return NULL;
+    return nfaFail(state, ownsArena);
   }
   clexNode* last = entry;
-  while ((token = lex(state)) && token->kind != EOF) {
+  while ((token = lex(state)).kind != EOF) {
     if (state->inBackslash) {
       state->inBackslash = false;
-      clexNode* node = makeNode(false, true);
+      clexNode* node = makeNode(state->arena, false, true);
       if (!node) {
-        free(token);
-        clexNfaDestroy(entry, NULL);
-        if (isOuter) free(state);
-        return NULL;
+        return nfaFail(state, ownsArena);
       }
-      nodeSetTransitionValues(last, 0, token->lexeme, token->lexeme, node);
+      nodeSetTransitionValues(last, 0, token.lexeme, token.lexeme, node);
       last->isFinish = false;
       last = node;
-      free(token);
       continue;
     }
-    Token* peeked = peek(state);
-    if (!peeked) {
-      free(token);
-      clexNfaDestroy(entry, NULL);
-      if (isOuter) free(state);
-      return NULL;
-    }
-    if (peeked->kind == OPARAN) {
+    Token peeked = peek(state);
+    if (peeked.kind == OPARAN) {
       state->lastBeforeParanEntry = state->beforeParanEntry;
       state->beforeParanEntry = last;
     }
-    free(peeked);
-    if (token->kind == BSLASH) {
+    if (token.kind == BSLASH) {
       state->inBackslash = true;
     }
-    if (token->kind == OPARAN) {
+    if (token.kind == OPARAN) {
       state->paranEntry = last;
     }
-    if (token->kind == CPARAN) {
+    if (token.kind == CPARAN) {
       if (state->inPipe) {
         state->inPipe = false;
         state->pipeSeen = true;
-        free(token);
         return entry;
       }
     }
-    if (token->kind == LITERAL) {
-      clexNode* node = makeNode(false, true);
+    if (token.kind == LITERAL) {
+      clexNode* node = makeNode(state->arena, false, true);
       if (!node) {
-        free(token);
-        clexNfaDestroy(entry, NULL);
-        if (isOuter) free(state);
-        return NULL;
+        return nfaFail(state, ownsArena);
       }
-      nodeSetTransitionValues(last, 0, token->lexeme, token->lexeme, node);
+      nodeSetTransitionValues(last, 0, token.lexeme, token.lexeme, node);
       last->isFinish = false;
       last = node;
     }
-    if (token->kind == PIPE) {
+    if (token.kind == PIPE) {
       state->inPipe = true;
       if (!state->paranEntry) {
         clexNode* pastEntry = entry;
         pastEntry->isStart = false;
 
-        entry = makeNode(true, false);
+        entry = makeNode(state->arena, true, false);
         if (!entry) {
-          free(token);
-          clexNfaDestroy(pastEntry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
 
         nodeSetTransitionValues(entry, 0, '\0', '\0', pastEntry);
         clexNode* firstFinish = getFinishNode(pastEntry);
         if (!firstFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         firstFinish->isFinish = false;
 
         clexNode* second = clexNfaFromRe(NULL, state);
         clexNode* secondFinish = getFinishNode(second);
         if (!second || !secondFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         secondFinish->isFinish = false;
         nodeSetTransitionValues(entry, 1, '\0', '\0', second);
 
-        clexNode* finish = makeNode(false, true);
+        clexNode* finish = makeNode(state->arena, false, true);
         if (!finish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         nodeSetTransitionValues(firstFinish, 0, '\0', '\0', finish);
         nodeSetTransitionValues(secondFinish, 0, '\0', '\0', finish);
@@ -673,7 +1439,7 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         last = finish;
       } else {
         clexNode* pipeEntry =
-            makeNode(state->beforeParanEntry ? false : true, false);
+            makeNode(state->arena, !state->beforeParanEntry, false);
         if (state->lastBeforeParanEntry) {
           nodeRepointTransition(state->lastBeforeParanEntry, 0, pipeEntry);
           state->lastBeforeParanEntry = NULL;
@@ -690,30 +1456,21 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
 
         clexNode* firstFinish = getFinishNode(state->paranEntry);
         if (!firstFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         firstFinish->isFinish = false;
 
         clexNode* second = clexNfaFromRe(NULL, state);
         clexNode* secondFinish = getFinishNode(second);
         if (!second || !secondFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         secondFinish->isFinish = false;
         nodeSetTransitionValues(pipeEntry, 1, '\0', '\0', second);
 
-        clexNode* finish = makeNode(false, true);
+        clexNode* finish = makeNode(state->arena, false, true);
         if (!finish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         nodeSetTransitionValues(firstFinish, 0, '\0', '\0', finish);
         nodeSetTransitionValues(secondFinish, 0, '\0', '\0', finish);
@@ -721,30 +1478,22 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         last = finish;
       }
     }
-    if (token->kind == STAR) {
+    if (token.kind == STAR) {
       if (!state->paranEntry) {
         clexNode* pastEntry = entry;
         pastEntry->isStart = false;
 
-        clexNode* finish = makeNode(false, true);
-        entry = makeNode(true, false);
+        clexNode* finish = makeNode(state->arena, false, true);
+        entry = makeNode(state->arena, true, false);
         if (!entry || !finish) {
-          free(token);
-          clexNfaDestroy(pastEntry, NULL);
-          if (entry) clexNfaDestroy(entry, NULL);
-          if (finish) clexNfaDestroy(finish, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
 
         nodeSetTransitionValues(entry, 0, '\0', '\0', pastEntry);
         nodeSetTransitionValues(entry, 1, '\0', '\0', finish);
         clexNode* firstFinish = getFinishNode(pastEntry);
         if (!firstFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         firstFinish->isFinish = false;
         nodeSetTransitionValues(firstFinish, 0, '\0', '\0', finish);
@@ -753,7 +1502,7 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         last = finish;
       } else {
         clexNode* starEntry =
-            makeNode(state->beforeParanEntry ? false : true, false);
+            makeNode(state->arena, !state->beforeParanEntry, false);
         if (state->lastBeforeParanEntry) {
           nodeRepointTransition(state->lastBeforeParanEntry, 0, starEntry);
           state->lastBeforeParanEntry = NULL;
@@ -762,22 +1511,16 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         else
           entry = starEntry;
 
-        clexNode* finish = makeNode(false, true);
+        clexNode* finish = makeNode(state->arena, false, true);
         if (!finish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
 
         nodeSetTransitionValues(starEntry, 0, '\0', '\0', state->paranEntry);
         nodeSetTransitionValues(starEntry, 1, '\0', '\0', finish);
         clexNode* firstFinish = getFinishNode(state->paranEntry);
         if (!firstFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         firstFinish->isFinish = false;
         nodeSetTransitionValues(firstFinish, 0, '\0', '\0', finish);
@@ -789,47 +1532,35 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         last = finish;
       }
     }
-    if (token->kind == PLUS) {
+    if (token.kind == PLUS) {
       clexNode* finish = getFinishNode(entry);
       if (!finish) {
-        free(token);
-        clexNfaDestroy(entry, NULL);
-        if (isOuter) free(state);
-        return NULL;
+        return nfaFail(state, ownsArena);
       }
       nodeSetTransitionValues(
           finish, 1, '\0', '\0',
           state->beforeParanEntry ? state->beforeParanEntry : entry);
     }
-    if (token->kind == QUESTION) {
+    if (token.kind == QUESTION) {
       if (!state->paranEntry) {
         clexNode* pastEntry = entry;
         pastEntry->isStart = false;
 
-        entry = makeNode(true, false);
+        entry = makeNode(state->arena, true, false);
         if (!entry) {
-          free(token);
-          clexNfaDestroy(pastEntry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
 
         nodeSetTransitionValues(entry, 0, '\0', '\0', pastEntry);
         clexNode* firstFinish = getFinishNode(pastEntry);
         if (!firstFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         firstFinish->isFinish = false;
 
-        clexNode* finish = makeNode(false, true);
+        clexNode* finish = makeNode(state->arena, false, true);
         if (!finish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         nodeSetTransitionValues(firstFinish, 0, '\0', '\0', finish);
         nodeSetTransitionValues(entry, 1, '\0', '\0', finish);
@@ -837,7 +1568,7 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         last = finish;
       } else {
         clexNode* questionEntry =
-            makeNode(state->beforeParanEntry ? false : true, false);
+            makeNode(state->arena, !state->beforeParanEntry, false);
         if (state->lastBeforeParanEntry) {
           nodeRepointTransition(state->lastBeforeParanEntry, 0, questionEntry);
           state->lastBeforeParanEntry = NULL;
@@ -850,19 +1581,13 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
                                 state->paranEntry);
         clexNode* firstFinish = getFinishNode(state->paranEntry);
         if (!firstFinish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         firstFinish->isFinish = false;
 
-        clexNode* finish = makeNode(false, true);
+        clexNode* finish = makeNode(state->arena, false, true);
         if (!finish) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         nodeSetTransitionValues(firstFinish, 0, '\0', '\0', finish);
         nodeSetTransitionValues(questionEntry, 1, '\0', '\0', firstFinish);
@@ -870,139 +1595,1499 @@ clexNode* clexNfaFromRe(const char* re, clexReLexerState* state) {
         last = finish;
       }
     }
-    if (token->kind == OSBRACKET) {
+    if (token.kind == OSBRACKET) {
       size_t index = 0;
-      clexNode* node = makeNode(false, true);
+      clexNode* node = makeNode(state->arena, false, true);
       if (!node) {
-        free(token);
-        clexNfaDestroy(entry, NULL);
-        if (isOuter) free(state);
-        return NULL;
+        return nfaFail(state, ownsArena);
       }
       int kind;
-      Token* lexed;
+      Token lexed;
       while (true) {
         lexed = peek(state);
-        if (!lexed) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
-        }
-        kind = lexed->kind;
+        kind = lexed.kind;
         if (kind == CSBRACKET) break;
-        free(lexed);
         if (kind == EOF) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
+          return nfaFail(state, ownsArena);
         }
         lexed = lex(state);
-        if (!lexed) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
-        }
-        char fromValue = lexed->lexeme;
-        free(lexed);
-        Token* peeked = peek(state);
-        if (!peeked) {
-          free(token);
-          clexNfaDestroy(entry, NULL);
-          if (isOuter) free(state);
-          return NULL;
-        }
-        if (peeked->kind == DASH) {
-          Token* dash = peek(state);
-          free(dash);
+        char fromValue = lexed.lexeme;
+        Token peeked = peek(state);
+        if (peeked.kind == DASH) {
           lexed = lex(state);
-          if (!lexed) {
-            free(peeked);
-            free(token);
-            clexNfaDestroy(entry, NULL);
-            if (isOuter) free(state);
-            return NULL;
-          }
-          free(lexed);
           lexed = lex(state);
-          if (!lexed) {
-            free(peeked);
-            free(token);
-            clexNfaDestroy(entry, NULL);
-            if (isOuter) free(state);
-            return NULL;
-          }
-          char toValue = lexed->lexeme;
-          free(lexed);
+          char toValue = lexed.lexeme;
           nodeSetTransitionValues(last, index++, fromValue, toValue, node);
         } else {
           nodeSetTransitionValues(last, index++, fromValue, fromValue, node);
         }
-        free(peeked);
       }
-      free(lexed);
       lexed = lex(state);
-      if (!lexed) {
-        free(token);
-        clexNfaDestroy(entry, NULL);
-        if (isOuter) free(state);
-        return NULL;
-      }
-      free(lexed);
       peeked = peek(state);
-      if (!peeked) {
-        free(token);
-        clexNfaDestroy(entry, NULL);
-        if (isOuter) free(state);
-        return NULL;
-      }
-      if (peeked->kind == OPARAN) {
+      if (peeked.kind == OPARAN) {
         state->lastBeforeParanEntry = state->beforeParanEntry;
         state->beforeParanEntry = last;
       }
-      free(peeked);
       last->isFinish = false;
       last = node;
     }
-    free(token);
   }
-  if (!token) {
-    clexNfaDestroy(entry, NULL);
-    if (isOuter) free(state);
-    return NULL;
+  // Allocations that were not checked inline leave the arena marked as failed.
+  if (ownsArena) {
+    if (state->arena->failed) return nfaFail(state, ownsArena);
+    state->arena = NULL;
   }
-  free(token);
-  if (isOuter) free(state);
   return entry;
 }
 
-bool clexNfaTest(clexNode* nfa, const char* target) {
-  if (!nfa || !target) return false;
-
-  if (!nfa->compiled) {
-    nfa->compiled = calloc(1, sizeof(clexCompiledNfa));
-    if (!nfa->compiled) return false;
-    if (!buildCompiledNfa(nfa, nfa->compiled)) {
-      free(nfa->compiled);
-      nfa->compiled = NULL;
-      return false;
-    }
+clexCompiledNfa* clexNfaCompile(clexNode* nfa) {
+  if (!nfa) return NULL;
+  clexCompiledNfa* compiled = calloc(1, sizeof(clexCompiledNfa));
+  if (!compiled) return NULL;
+  if (!buildCompiledNfa(nfa, compiled)) {
+    free(compiled);
+    return NULL;
   }
+  return compiled;
+}
 
-  return runCompiledNfa(nfa->compiled, target);
+size_t clexCompiledNfaNodeCount(const clexCompiledNfa* compiled) {
+  return compiled ? compiled->nodeCount : 0;
 }
 
-static char* drawKey(clexNode* node1, clexNode* node2, char fromValue,
-                     char toValue) {
-  char* result = malloc(1024);
-  sprintf(result, "%p%p%c%c", (void*)node1, (void*)node2, fromValue, toValue);
-  return result;
+size_t clexCompiledNfaSourceNodeCount(const clexCompiledNfa* compiled) {
+  return compiled ? compiled->sourceNodeCount : 0;
 }
 
-static unsigned long getDrawMapping(unsigned long* drawMapping,
-                                    unsigned long value) {
+void clexCompiledNfaDestroy(clexCompiledNfa* compiled) {
+  if (!compiled) return;
+  compiledNfaFree(compiled);
+  free(compiled);
+}
+
+clexNfaScratch* clexNfaScratchCreate(size_t nodeCount) {
+  clexNfaScratch* scratch = calloc(1, sizeof(clexNfaScratch));
+  if (!scratch) return NULL;
+  scratch->wordCount = (nodeCount + 63) / 64;
+  scratch->activeStates = calloc(scratch->wordCount + 1, sizeof(uint64_t));
+  scratch->nextStates = calloc(scratch->wordCount + 1, sizeof(uint64_t));
+  scratch->stack = malloc((scratch->wordCount * 64 + 1) * sizeof(size_t));
+  if (!scratch->activeStates || !scratch->nextStates || !scratch->stack) {
+    clexNfaScratchDestroy(scratch);
+    return NULL;
+  }
+  return scratch;
+}
+
+void clexNfaScratchDestroy(clexNfaScratch* scratch) {
+  if (!scratch) return;
+  free(scratch->activeStates);
+  free(scratch->nextStates);
+  free(scratch->stack);
+  free(scratch);
+}
+
+size_t clexCompiledNfaLongestMatch(const clexCompiledNfa* compiled,
+                                   clexNfaScratch* scratch, const char* target,
+                                   size_t length) {
+  return runCompiledNfaLongest(compiled, scratch, target, length, NULL);
+}
+
+size_t clexCompiledNfaLongestMatchCounted(const clexCompiledNfa* compiled,
+                                          clexNfaScratch* scratch,
+                                          const char* target, size_t length,
+                                          size_t* outScanned) {
+  return runCompiledNfaLongest(compiled, scratch, target, length, outScanned);
+}
+
+// The standalone NFA API caches a compiled copy and its scratch on the entry
+// node, so it is not safe to share one clexNode between threads.
+static bool prepareNodeCache(clexNode* nfa) {
+  if (!nfa) return false;
+  if (!nfa->compiled && !nfa->scratch && !arenaAddCleanup(nfa->arena, nfa))
+    return false;
+  if (!nfa->compiled) {
+    nfa->compiled = clexNfaCompile(nfa);
+    if (!nfa->compiled) return false;
+  }
+  if (!nfa->scratch) {
+    nfa->scratch = clexNfaScratchCreate(nfa->compiled->nodeCount);
+    if (!nfa->scratch) return false;
+  }
+  return true;
+}
+
+bool clexNfaTest(clexNode* nfa, const char* target) {
+  if (!nfa || !target) return false;
+  if (!prepareNodeCache(nfa)) return false;
+
+  return runCompiledNfa(nfa->compiled, nfa->scratch, target);
+}
+
+size_t clexNfaLongestMatch(clexNode* nfa, const char* target, size_t length) {
+  if (!nfa || !target) return 0;
+  if (!prepareNodeCache(nfa)) return 0;
+
+  return runCompiledNfaLongest(nfa->compiled, nfa->scratch, target, length,
+                               NULL);
+}
+
+#define CLEX_DFA_ALPHABET 256
+#define CLEX_DFA_DEAD 0
+#define CLEX_DFA_START 1
+#define CLEX_DFA_UNKNOWN UINT32_MAX
+
+// Bytes that no rule tells apart share an equivalence class, and the
+// transition table is indexed by [state][class] instead of [state][byte].
+struct clexDfa {
+  uint8_t classMap[CLEX_DFA_ALPHABET];
+  size_t classCount;
+  uint32_t* transitions;
+  int32_t* accept;
+  size_t stateCount;
+  size_t sourceStateCount;
+  bool borrowed;
+};
+
+typedef struct U32Vec {
+  uint32_t* items;
+  size_t size;
+  size_t capacity;
+} U32Vec;
+
+static bool u32VecPush(U32Vec* vec, uint32_t value) {
+  if (vec->size == vec->capacity) {
+    size_t newCapacity = vec->capacity ? vec->capacity * 2 : 16;
+    uint32_t* newItems = realloc(vec->items, newCapacity * sizeof(uint32_t));
+    if (!newItems) return false;
+    vec->items = newItems;
+    vec->capacity = newCapacity;
+  }
+  vec->items[vec->size++] = value;
+  return true;
+}
+
+// Compiled ranges compare as (possibly signed) char, so one range may cover
+// both ends of the unsigned byte space.
+static size_t rangeByteIntervals(char fromValue, char toValue,
+                                 unsigned char* lows, unsigned char* highs) {
+  if (fromValue > toValue) return 0;
+  if (fromValue >= 0 || toValue < 0) {
+    lows[0] = (unsigned char)fromValue;
+    highs[0] = (unsigned char)toValue;
+    return 1;
+  }
+  lows[0] = 0;
+  highs[0] = (unsigned char)toValue;
+  lows[1] = (unsigned char)fromValue;
+  highs[1] = CLEX_DFA_ALPHABET - 1;
+  return 2;
+}
+
+static void dfaComputeClasses(clexDfa* dfa,
+                              const clexCompiledNode* const* nodes,
+                              size_t nodeCount) {
+  bool split[CLEX_DFA_ALPHABET + 1] = {false};
+  for (size_t i = 0; i < nodeCount; i++) {
+    for (size_t j = 0; j < nodes[i]->transitionCount; j++) {
+      const clexCompiledTransition* transition = &nodes[i]->transitions[j];
+      if (transition->fromValue == '\0') continue;
+      unsigned char lows[2];
+      unsigned char highs[2];
+      size_t count = rangeByteIntervals(transition->fromValue,
+                                        transition->toValue, lows, highs);
+      for (size_t k = 0; k < count; k++) {
+        split[lows[k]] = true;
+        split[highs[k] + 1] = true;
+      }
+    }
+  }
+
+  size_t classIndex = 0;
+  for (size_t byte = 0; byte < CLEX_DFA_ALPHABET; byte++) {
+    if (byte > 0 && split[byte]) classIndex++;
+    dfa->classMap[byte] = (uint8_t)classIndex;
+  }
+  dfa->classCount = classIndex + 1;
+}
+
+typedef struct DfaBuilder {
+  const clexCompiledNode** nodes;
+  uint32_t* nodeBase;
+  int32_t* nodeAccept;
+  size_t nodeCount;
+  uint32_t* starts;
+  size_t startCount;
+
+  uint32_t* mark;
+  uint32_t markStamp;
+  uint32_t* stack;
+  uint32_t* closure;
+  U32Vec moves[CLEX_DFA_ALPHABET];
+
+  U32Vec pool;
+  size_t* setStart;
+  size_t* setLength;
+  size_t stateCapacity;
+  uint32_t* table;
+  size_t tableCapacity;
+
+  uint32_t missingTransition;
+  clexDfa* dfa;
+  // Heap blocks allocated while adding states; the lazy DFA reports these as
+  // cache growth.
+  size_t allocations;
+} DfaBuilder;
+
+static int compareU32(const void* a, const void* b) {
+  uint32_t left = *(const uint32_t*)a;
+  uint32_t right = *(const uint32_t*)b;
+  return left < right ? -1 : left > right;
+}
+
+static uint64_t hashStateSet(const uint32_t* items, size_t count) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (size_t i = 0; i < count; i++) {
+    hash ^= items[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void dfaBuilderFree(DfaBuilder* builder) {
+  free(builder->nodes);
+  free(builder->nodeBase);
+  free(builder->nodeAccept);
+  free(builder->starts);
+  free(builder->mark);
+  free(builder->stack);
+  free(builder->closure);
+  for (size_t i = 0; i < CLEX_DFA_ALPHABET; i++) free(builder->moves[i].items);
+  free(builder->pool.items);
+  free(builder->setStart);
+  free(builder->setLength);
+  free(builder->table);
+}
+
+static bool dfaBuilderInit(DfaBuilder* builder,
+                           const clexCompiledNfa* const* nfas,
+                           size_t nfaCount) {
+  memset(builder, 0, sizeof(*builder));
+  if (!nfas || nfaCount == 0) return false;
+
+  for (size_t i = 0; i < nfaCount; i++) {
+    if (!nfas[i]) return false;
+    builder->nodeCount += nfas[i]->nodeCount;
+  }
+  if (builder->nodeCount >= UINT32_MAX) return false;
+
+  builder->nodes = calloc(builder->nodeCount, sizeof(clexCompiledNode*));
+  builder->nodeBase = calloc(builder->nodeCount, sizeof(uint32_t));
+  builder->nodeAccept = calloc(builder->nodeCount, sizeof(int32_t));
+  builder->starts = calloc(nfaCount, sizeof(uint32_t));
+  builder->mark = calloc(builder->nodeCount, sizeof(uint32_t));
+  builder->stack = calloc(builder->nodeCount, sizeof(uint32_t));
+  builder->closure = calloc(builder->nodeCount, sizeof(uint32_t));
+  if (!builder->nodes || !builder->nodeBase || !builder->nodeAccept ||
+      !builder->starts || !builder->mark || !builder->stack ||
+      !builder->closure)
+    return false;
+
+  uint32_t base = 0;
+  for (size_t i = 0; i < nfaCount; i++) {
+    const clexCompiledNfa* compiled = nfas[i];
+    for (size_t j = 0; j < compiled->nodeCount; j++) {
+      builder->nodes[base + j] = &compiled->nodes[j];
+      builder->nodeBase[base + j] = base;
+      builder->nodeAccept[base + j] =
+          compiled->nodes[j].isFinish ? (int32_t)i : -1;
+    }
+    builder->starts[builder->startCount++] = base;
+    base += (uint32_t)compiled->nodeCount;
+  }
+
+  builder->dfa = calloc(1, sizeof(clexDfa));
+  if (!builder->dfa) return false;
+  dfaComputeClasses(builder->dfa, builder->nodes, builder->nodeCount);
+  return true;
+}
+
+// Expands seeds to their epsilon closure in builder->closure, sorted so that
+// equal sets compare equal byte for byte.
+static size_t dfaBuilderClosure(DfaBuilder* builder, const uint32_t* seeds,
+                                size_t seedCount) {
+  size_t stackSize = 0;
+  size_t closureSize = 0;
+
+  if (++builder->markStamp == 0) {
+    memset(builder->mark, 0, builder->nodeCount * sizeof(uint32_t));
+    builder->markStamp = 1;
+  }
+
+  for (size_t i = 0; i < seedCount; i++) {
+    if (builder->mark[seeds[i]] == builder->markStamp) continue;
+    builder->mark[seeds[i]] = builder->markStamp;
+    builder->stack[stackSize++] = seeds[i];
+  }
+
+  while (stackSize > 0) {
+    uint32_t index = builder->stack[--stackSize];
+    builder->closure[closureSize++] = index;
+    const clexCompiledNode* node = builder->nodes[index];
+    for (size_t i = 0; i < node->transitionCount; i++) {
+      const clexCompiledTransition* transition = &node->transitions[i];
+      if (transition->fromValue != '\0') continue;
+      uint32_t to = builder->nodeBase[index] + (uint32_t)transition->toIndex;
+      if (builder->mark[to] == builder->markStamp) continue;
+      builder->mark[to] = builder->markStamp;
+      builder->stack[stackSize++] = to;
+    }
+  }
+
+  qsort(builder->closure, closureSize, sizeof(uint32_t), compareU32);
+  return closureSize;
+}
+
+static bool dfaBuilderGrowTable(DfaBuilder* builder) {
+  size_t newCapacity = builder->tableCapacity ? builder->tableCapacity * 2 : 64;
+  uint32_t* newTable = calloc(newCapacity, sizeof(uint32_t));
+  if (!newTable) return false;
+  builder->allocations++;
+  for (size_t i = 0; i < builder->tableCapacity; i++) {
+    uint32_t state = builder->table[i];
+    if (!state) continue;
+    uint64_t hash =
+        hashStateSet(builder->pool.items + builder->setStart[state],
+                     builder->setLength[state]);
+    size_t slot = (size_t)hash & (newCapacity - 1);
+    while (newTable[slot]) slot = (slot + 1) & (newCapacity - 1);
+    newTable[slot] = state;
+  }
+  free(builder->table);
+  builder->table = newTable;
+  builder->tableCapacity = newCapacity;
+  return true;
+}
+
+static bool dfaBuilderGrowStates(DfaBuilder* builder) {
+  clexDfa* dfa = builder->dfa;
+  size_t newCapacity = builder->stateCapacity ? builder->stateCapacity * 2 : 64;
+  size_t* setStart = realloc(builder->setStart, newCapacity * sizeof(size_t));
+  if (!setStart) return false;
+  builder->setStart = setStart;
+  size_t* setLength = realloc(builder->setLength, newCapacity * sizeof(size_t));
+  if (!setLength) return false;
+  builder->setLength = setLength;
+  int32_t* accept = realloc(dfa->accept, newCapacity * sizeof(int32_t));
+  if (!accept) return false;
+  dfa->accept = accept;
+  uint32_t* transitions =
+      realloc(dfa->transitions,
+              newCapacity * dfa->classCount * sizeof(uint32_t));
+  if (!transitions) return false;
+  dfa->transitions = transitions;
+  builder->stateCapacity = newCapacity;
+  builder->allocations += 4;
+  return true;
+}
+
+// u32VecPush() that counts the allocation when the vector has to grow.
+static bool dfaBuilderPush(DfaBuilder* builder, U32Vec* vec, uint32_t value) {
+  if (vec->size == vec->capacity) builder->allocations++;
+  return u32VecPush(vec, value);
+}
+
+static uint32_t dfaBuilderLookupState(const DfaBuilder* builder,
+                                      const uint32_t* set, size_t setSize,
+                                      size_t* outSlot) {
+  uint64_t hash = hashStateSet(set, setSize);
+  size_t slot = (size_t)hash & (builder->tableCapacity - 1);
+  while (builder->table[slot]) {
+    uint32_t state = builder->table[slot];
+    if (builder->setLength[state] == setSize &&
+        memcmp(builder->pool.items + builder->setStart[state], set,
+               setSize * sizeof(uint32_t)) == 0)
+      return state;
+    slot = (slot + 1) & (builder->tableCapacity - 1);
+  }
+  if (outSlot) *outSlot = slot;
+  return CLEX_DFA_DEAD;
+}
+
+static bool dfaBuilderAddState(DfaBuilder* builder, const uint32_t* set,
+                               size_t setSize, uint32_t* outState) {
+  clexDfa* dfa = builder->dfa;
+  if ((dfa->stateCount + 1) * 2 > builder->tableCapacity &&
+      !dfaBuilderGrowTable(builder))
+    return false;
+
+  size_t slot = 0;
+  uint32_t existing = dfaBuilderLookupState(builder, set, setSize, &slot);
+  if (existing != CLEX_DFA_DEAD) {
+    *outState = existing;
+    return true;
+  }
+
+  if (dfa->stateCount >= CLEX_DFA_UNKNOWN) return false;
+  if (dfa->stateCount == builder->stateCapacity &&
+      !dfaBuilderGrowStates(builder))
+    return false;
+
+  uint32_t state = (uint32_t)dfa->stateCount++;
+  builder->setStart[state] = builder->pool.size;
+  builder->setLength[state] = setSize;
+  int32_t accept = -1;
+  for (size_t i = 0; i < setSize; i++) {
+    if (!dfaBuilderPush(builder, &builder->pool, set[i])) return false;
+    int32_t rule = builder->nodeAccept[set[i]];
+    if (rule >= 0 && (accept < 0 || rule < accept)) accept = rule;
+  }
+  dfa->accept[state] = accept;
+  uint32_t* row = dfa->transitions + (size_t)state * dfa->classCount;
+  for (size_t i = 0; i < dfa->classCount; i++)
+    row[i] = builder->missingTransition;
+  builder->table[slot] = state;
+  *outState = state;
+  return true;
+}
+
+// Resets the state space to the dead state (0) and the start state (1).
+static bool dfaBuilderStart(DfaBuilder* builder, const uint32_t* startSet,
+                            size_t startSize) {
+  clexDfa* dfa = builder->dfa;
+  if (!builder->table && !dfaBuilderGrowTable(builder)) return false;
+  if (!builder->stateCapacity && !dfaBuilderGrowStates(builder)) return false;
+
+  memset(builder->table, 0, builder->tableCapacity * sizeof(uint32_t));
+  builder->pool.size = 0;
+  builder->setStart[CLEX_DFA_DEAD] = 0;
+  builder->setLength[CLEX_DFA_DEAD] = 0;
+  dfa->accept[CLEX_DFA_DEAD] = -1;
+  memset(dfa->transitions, 0, dfa->classCount * sizeof(uint32_t));
+  dfa->stateCount = 1;
+
+  uint32_t start;
+  return dfaBuilderAddState(builder, startSet, startSize, &start) &&
+         start == CLEX_DFA_START;
+}
+
+static bool dfaBuilderExpand(DfaBuilder* builder, uint32_t state) {
+  const clexDfa* dfa = builder->dfa;
+  for (size_t i = 0; i < dfa->classCount; i++) builder->moves[i].size = 0;
+
+  for (size_t i = 0; i < builder->setLength[state]; i++) {
+    uint32_t index = builder->pool.items[builder->setStart[state] + i];
+    const clexCompiledNode* node = builder->nodes[index];
+    for (size_t j = 0; j < node->transitionCount; j++) {
+      const clexCompiledTransition* transition = &node->transitions[j];
+      if (transition->fromValue == '\0') continue;
+      uint32_t to = builder->nodeBase[index] + (uint32_t)transition->toIndex;
+      unsigned char lows[2];
+      unsigned char highs[2];
+      size_t count = rangeByteIntervals(transition->fromValue,
+                                        transition->toValue, lows, highs);
+      for (size_t k = 0; k < count; k++) {
+        for (size_t classIndex = dfa->classMap[lows[k]];
+             classIndex <= dfa->classMap[highs[k]]; classIndex++) {
+          if (!dfaBuilderPush(builder, &builder->moves[classIndex], to))
+            return false;
+        }
+      }
+    }
+  }
+
+  for (size_t classIndex = 0; classIndex < dfa->classCount; classIndex++) {
+    U32Vec* moves = &builder->moves[classIndex];
+    if (moves->size == 0) continue;
+    size_t closureSize = dfaBuilderClosure(builder, moves->items, moves->size);
+    uint32_t target;
+    if (!dfaBuilderAddState(builder, builder->closure, closureSize, &target))
+      return false;
+    builder->dfa->transitions[(size_t)state * dfa->classCount + classIndex] =
+        target;
+  }
+  return true;
+}
+
+// Hopcroft partition refinement. Blocks are contiguous ranges of `elements`;
+// while a splitter is processed, the states it reaches are moved to the front
+// of their block and counted in `marked`.
+typedef struct DfaPartition {
+  uint32_t* elements;
+  uint32_t* location;
+  uint32_t* blockOf;
+  uint32_t* blockStart;
+  uint32_t* blockEnd;
+  uint32_t* marked;
+  uint32_t* touched;
+  uint32_t* worklist;
+  bool* inWorklist;
+  uint32_t* splitter;
+  size_t blockCount;
+  size_t worklistSize;
+} DfaPartition;
+
+static void dfaPartitionFree(DfaPartition* partition) {
+  free(partition->elements);
+  free(partition->location);
+  free(partition->blockOf);
+  free(partition->blockStart);
+  free(partition->blockEnd);
+  free(partition->marked);
+  free(partition->touched);
+  free(partition->worklist);
+  free(partition->inWorklist);
+  free(partition->splitter);
+}
+
+static void dfaPartitionPush(DfaPartition* partition, uint32_t block) {
+  if (partition->inWorklist[block]) return;
+  partition->inWorklist[block] = true;
+  partition->worklist[partition->worklistSize++] = block;
+}
+
+// The initial blocks group states by the rule they accept, so states that
+// accept for different rules are never merged.
+static bool dfaPartitionInit(DfaPartition* partition, const clexDfa* dfa) {
+  size_t n = dfa->stateCount;
+  memset(partition, 0, sizeof(DfaPartition));
+  partition->elements = malloc(n * sizeof(uint32_t));
+  partition->location = malloc(n * sizeof(uint32_t));
+  partition->blockOf = malloc(n * sizeof(uint32_t));
+  partition->blockStart = malloc(n * sizeof(uint32_t));
+  partition->blockEnd = malloc(n * sizeof(uint32_t));
+  partition->marked = calloc(n, sizeof(uint32_t));
+  partition->touched = malloc(n * sizeof(uint32_t));
+  partition->worklist = malloc(n * sizeof(uint32_t));
+  partition->inWorklist = calloc(n, sizeof(bool));
+  partition->splitter = malloc(n * sizeof(uint32_t));
+  if (!partition->elements || !partition->location || !partition->blockOf ||
+      !partition->blockStart || !partition->blockEnd || !partition->marked ||
+      !partition->touched || !partition->worklist || !partition->inWorklist ||
+      !partition->splitter)
+    return false;
+
+  // Counting sort by accept rule; -1 (not accepting) goes first.
+  size_t ruleLimit = 0;
+  for (size_t i = 0; i < n; i++)
+    if ((size_t)(dfa->accept[i] + 1) > ruleLimit)
+      ruleLimit = (size_t)(dfa->accept[i] + 1);
+  uint32_t* bucketStart = calloc(ruleLimit + 2, sizeof(uint32_t));
+  if (!bucketStart) return false;
+  for (size_t i = 0; i < n; i++) bucketStart[dfa->accept[i] + 2]++;
+  for (size_t i = 1; i < ruleLimit + 2; i++)
+    bucketStart[i] += bucketStart[i - 1];
+  for (size_t i = 0; i < n; i++) {
+    uint32_t position = bucketStart[dfa->accept[i] + 1]++;
+    partition->elements[position] = (uint32_t)i;
+    partition->location[i] = position;
+  }
+  free(bucketStart);
+
+  size_t largest = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint32_t state = partition->elements[i];
+    if (i == 0 || dfa->accept[state] !=
+                      dfa->accept[partition->elements[i - 1]]) {
+      partition->blockStart[partition->blockCount] = (uint32_t)i;
+      partition->blockCount++;
+    }
+    uint32_t block = (uint32_t)partition->blockCount - 1;
+    partition->blockOf[state] = block;
+    partition->blockEnd[block] = (uint32_t)i + 1;
+    if (partition->blockEnd[block] - partition->blockStart[block] >
+        partition->blockEnd[largest] - partition->blockStart[largest])
+      largest = block;
+  }
+  // Splitting by every block but one is enough: the last one's effect
+  // follows from the others.
+  for (size_t block = 0; block < partition->blockCount; block++)
+    if (block != largest) dfaPartitionPush(partition, (uint32_t)block);
+  return true;
+}
+
+static void dfaPartitionMark(DfaPartition* partition, uint32_t state,
+                             size_t* touchedCount) {
+  uint32_t block = partition->blockOf[state];
+  uint32_t target = partition->blockStart[block] + partition->marked[block];
+  uint32_t other = partition->elements[target];
+  uint32_t position = partition->location[state];
+  partition->elements[target] = state;
+  partition->location[state] = target;
+  partition->elements[position] = other;
+  partition->location[other] = position;
+  if (partition->marked[block]++ == 0)
+    partition->touched[(*touchedCount)++] = block;
+}
+
+// Splits every touched block into its marked and unmarked parts. The marked
+// part becomes a new block; following Hopcroft, only the smaller half needs
+// to be queued unless the block was already waiting.
+static void dfaPartitionSplit(DfaPartition* partition, size_t touchedCount) {
+  for (size_t i = 0; i < touchedCount; i++) {
+    uint32_t block = partition->touched[i];
+    uint32_t start = partition->blockStart[block];
+    uint32_t middle = start + partition->marked[block];
+    uint32_t end = partition->blockEnd[block];
+    partition->marked[block] = 0;
+    if (middle == end) continue;
+
+    uint32_t created = (uint32_t)partition->blockCount++;
+    partition->blockStart[created] = start;
+    partition->blockEnd[created] = middle;
+    partition->blockStart[block] = middle;
+    for (uint32_t j = start; j < middle; j++)
+      partition->blockOf[partition->elements[j]] = created;
+
+    if (partition->inWorklist[block] || middle - start <= end - middle)
+      dfaPartitionPush(partition, created);
+    else
+      dfaPartitionPush(partition, block);
+  }
+}
+
+// Rebuilds the tables with one state per block. The dead and start states
+// keep their numbers; the other blocks are numbered by their lowest state.
+static bool dfaApplyPartition(clexDfa* dfa, const DfaPartition* partition) {
+  size_t classCount = dfa->classCount;
+  size_t blockCount = partition->blockCount;
+  uint32_t* newState = malloc(blockCount * sizeof(uint32_t));
+  int32_t* accept = malloc(blockCount * sizeof(int32_t));
+  uint32_t* transitions = malloc(blockCount * classCount * sizeof(uint32_t));
+  if (!newState || !accept || !transitions) {
+    free(newState);
+    free(accept);
+    free(transitions);
+    return false;
+  }
+
+  for (size_t i = 0; i < blockCount; i++) newState[i] = UINT32_MAX;
+  newState[partition->blockOf[CLEX_DFA_DEAD]] = CLEX_DFA_DEAD;
+  newState[partition->blockOf[CLEX_DFA_START]] = CLEX_DFA_START;
+  uint32_t next = CLEX_DFA_START + 1;
+  for (size_t state = 0; state < dfa->stateCount; state++) {
+    uint32_t block = partition->blockOf[state];
+    if (newState[block] == UINT32_MAX) newState[block] = next++;
+  }
+
+  bool* written = calloc(blockCount, sizeof(bool));
+  if (!written) {
+    free(newState);
+    free(accept);
+    free(transitions);
+    return false;
+  }
+  for (size_t state = 0; state < dfa->stateCount; state++) {
+    uint32_t target = newState[partition->blockOf[state]];
+    if (written[target]) continue;
+    written[target] = true;
+    accept[target] = dfa->accept[state];
+    for (size_t c = 0; c < classCount; c++)
+      transitions[(size_t)target * classCount + c] =
+          newState[partition->blockOf[dfa->transitions[state * classCount +
+                                                       c]]];
+  }
+  free(written);
+  free(newState);
+
+  free(dfa->accept);
+  free(dfa->transitions);
+  dfa->accept = accept;
+  dfa->transitions = transitions;
+  dfa->stateCount = blockCount;
+  return true;
+}
+
+// Minimizes a fully built DFA in place. The dead state stays 0 and the start
+// state stays 1.
+static bool dfaMinimize(clexDfa* dfa) {
+  size_t n = dfa->stateCount;
+  size_t classCount = dfa->classCount;
+  if (n * classCount >= UINT32_MAX) return true;
+
+  // Reverse transitions grouped by (class, target): the states that move to
+  // t on class c are reverse[reverseStart[c * n + t] ..
+  // reverseStart[c * n + t + 1]).
+  DfaPartition partition;
+  uint32_t* reverseStart = calloc(n * classCount + 1, sizeof(uint32_t));
+  uint32_t* reverse = malloc(n * classCount * sizeof(uint32_t));
+  bool ok = dfaPartitionInit(&partition, dfa) && reverseStart && reverse;
+  if (ok) {
+    for (size_t state = 0; state < n; state++)
+      for (size_t c = 0; c < classCount; c++)
+        reverseStart[c * n + dfa->transitions[state * classCount + c]]++;
+    for (size_t i = 1; i <= n * classCount; i++)
+      reverseStart[i] += reverseStart[i - 1];
+    for (size_t state = 0; state < n; state++)
+      for (size_t c = 0; c < classCount; c++)
+        reverse[--reverseStart[c * n +
+                               dfa->transitions[state * classCount + c]]] =
+            (uint32_t)state;
+  }
+
+  while (ok && partition.worklistSize > 0) {
+    uint32_t block = partition.worklist[--partition.worklistSize];
+    partition.inWorklist[block] = false;
+    // The block may split while its classes are processed; splitting by its
+    // original contents is still valid.
+    size_t splitterSize = 0;
+    for (uint32_t i = partition.blockStart[block];
+         i < partition.blockEnd[block]; i++)
+      partition.splitter[splitterSize++] = partition.elements[i];
+    for (size_t c = 0; c < classCount; c++) {
+      size_t touchedCount = 0;
+      for (size_t i = 0; i < splitterSize; i++) {
+        size_t key = c * n + partition.splitter[i];
+        for (uint32_t j = reverseStart[key]; j < reverseStart[key + 1]; j++)
+          dfaPartitionMark(&partition, reverse[j], &touchedCount);
+      }
+      dfaPartitionSplit(&partition, touchedCount);
+    }
+  }
+
+  if (ok && partition.blockCount < n &&
+      partition.blockOf[CLEX_DFA_DEAD] != partition.blockOf[CLEX_DFA_START])
+    ok = dfaApplyPartition(dfa, &partition);
+  dfaPartitionFree(&partition);
+  free(reverseStart);
+  free(reverse);
+  return ok;
+}
+
+clexDfa* clexDfaBuild(const clexCompiledNfa* const* nfas, size_t nfaCount) {
+  DfaBuilder builder;
+  bool ok = dfaBuilderInit(&builder, nfas, nfaCount);
+  if (ok) {
+    size_t startSize =
+        dfaBuilderClosure(&builder, builder.starts, builder.startCount);
+    ok = dfaBuilderStart(&builder, builder.closure, startSize);
+  }
+
+  for (uint32_t state = CLEX_DFA_START;
+       ok && state < builder.dfa->stateCount; state++)
+    ok = dfaBuilderExpand(&builder, state);
+
+  clexDfa* dfa = builder.dfa;
+  builder.dfa = NULL;
+  dfaBuilderFree(&builder);
+  if (ok) {
+    dfa->sourceStateCount = dfa->stateCount;
+    ok = dfaMinimize(dfa);
+  }
+  if (!ok) {
+    clexDfaDestroy(dfa);
+    return NULL;
+  }
+  return dfa;
+}
+
+int clexDfaMatchCounted(const clexDfa* dfa, const char* target,
+                        size_t length, size_t* outLength, size_t* outScanned) {
+  if (outLength) *outLength = 0;
+  if (outScanned) *outScanned = 0;
+  if (!dfa || !target) return -1;
+
+  int rule = -1;
+  uint32_t state = CLEX_DFA_START;
+  size_t i = 0;
+  for (; i < length; i++) {
+    state = dfa->transitions[(size_t)state * dfa->classCount +
+                             dfa->classMap[(unsigned char)target[i]]];
+    if (state == CLEX_DFA_DEAD) break;
+    if (dfa->accept[state] >= 0) {
+      rule = dfa->accept[state];
+      if (outLength) *outLength = i + 1;
+    }
+  }
+  if (outScanned) *outScanned = i;
+  return rule;
+}
+
+int clexDfaMatch(const clexDfa* dfa, const char* target, size_t length,
+                 size_t* outLength) {
+  return clexDfaMatchCounted(dfa, target, length, outLength, NULL);
+}
+
+size_t clexDfaStateCount(const clexDfa* dfa) {
+  return dfa ? dfa->stateCount : 0;
+}
+
+size_t clexDfaSourceStateCount(const clexDfa* dfa) {
+  return dfa ? dfa->sourceStateCount : 0;
+}
+
+size_t clexDfaClassCount(const clexDfa* dfa) {
+  return dfa ? dfa->classCount : 0;
+}
+
+size_t clexDfaByteClass(const clexDfa* dfa, unsigned char byte) {
+  return dfa ? dfa->classMap[byte] : 0;
+}
+
+size_t clexDfaNextState(const clexDfa* dfa, size_t state, size_t byteClass) {
+  if (!dfa || state >= dfa->stateCount || byteClass >= dfa->classCount)
+    return CLEX_DFA_DEAD;
+  return dfa->transitions[state * dfa->classCount + byteClass];
+}
+
+int clexDfaAcceptRule(const clexDfa* dfa, size_t state) {
+  if (!dfa || state >= dfa->stateCount) return -1;
+  return dfa->accept[state];
+}
+
+void clexDfaDestroy(clexDfa* dfa) {
+  if (!dfa) return;
+  if (!dfa->borrowed) {
+    free(dfa->transitions);
+    free(dfa->accept);
+  }
+  free(dfa);
+}
+
+// Serialized tables, in native byte order: the state and class counts as
+// uint64, the class map, the accept table and the transition table. Every
+// section starts on an 8-byte boundary relative to the start of the tables.
+#define CLEX_DFA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define CLEX_DFA_HEADER_SIZE (2 * sizeof(uint64_t) + CLEX_DFA_ALPHABET)
+
+static bool dfaTablesLayout(size_t stateCount, size_t classCount,
+                            size_t* transitionsOffset, size_t* total) {
+  if (stateCount > UINT32_MAX || classCount > CLEX_DFA_ALPHABET) return false;
+  size_t acceptSize = CLEX_DFA_ALIGN(stateCount * sizeof(int32_t));
+  if (stateCount > (SIZE_MAX - CLEX_DFA_HEADER_SIZE - acceptSize) /
+                       sizeof(uint32_t) / (classCount ? classCount : 1))
+    return false;
+  *transitionsOffset = CLEX_DFA_HEADER_SIZE + acceptSize;
+  *total = *transitionsOffset + stateCount * classCount * sizeof(uint32_t);
+  return true;
+}
+
+size_t clexDfaSerialize(const clexDfa* dfa, void* out, size_t capacity) {
+  if (!dfa) return 0;
+  size_t transitionsOffset = 0;
+  size_t total = 0;
+  if (!dfaTablesLayout(dfa->stateCount, dfa->classCount, &transitionsOffset,
+                       &total))
+    return 0;
+  if (!out || capacity < total) return total;
+
+  unsigned char* bytes = out;
+  memset(bytes, 0, total);
+  uint64_t counts[2] = {dfa->stateCount, dfa->classCount};
+  memcpy(bytes, counts, sizeof(counts));
+  memcpy(bytes + sizeof(counts), dfa->classMap, CLEX_DFA_ALPHABET);
+  memcpy(bytes + CLEX_DFA_HEADER_SIZE, dfa->accept,
+         dfa->stateCount * sizeof(int32_t));
+  memcpy(bytes + transitionsOffset, dfa->transitions,
+         dfa->stateCount * dfa->classCount * sizeof(uint32_t));
+  return total;
+}
+
+// Wraps serialized tables without copying them; `data` must stay mapped for
+// the lifetime of the returned DFA. The tables are validated so that a corrupt
+// blob cannot make clexDfaMatch read out of bounds.
+clexDfa* clexDfaFromTables(const void* data, size_t length, size_t ruleCount,
+                           size_t* outSize) {
+  if (!data || ((uintptr_t)data & 7) != 0 || length < CLEX_DFA_HEADER_SIZE)
+    return NULL;
+  const unsigned char* bytes = data;
+  uint64_t counts[2];
+  memcpy(counts, bytes, sizeof(counts));
+  if (counts[0] <= CLEX_DFA_START || counts[1] == 0 ||
+      counts[1] > CLEX_DFA_ALPHABET || counts[0] > UINT32_MAX)
+    return NULL;
+  size_t stateCount = (size_t)counts[0];
+  size_t classCount = (size_t)counts[1];
+  size_t transitionsOffset = 0;
+  size_t total = 0;
+  if (!dfaTablesLayout(stateCount, classCount, &transitionsOffset, &total) ||
+      total > length)
+    return NULL;
+
+  const uint8_t* classMap = bytes + 2 * sizeof(uint64_t);
+  const int32_t* accept = (const int32_t*)(bytes + CLEX_DFA_HEADER_SIZE);
+  const uint32_t* transitions = (const uint32_t*)(bytes + transitionsOffset);
+  for (size_t i = 0; i < CLEX_DFA_ALPHABET; i++)
+    if (classMap[i] >= classCount) return NULL;
+  for (size_t i = 0; i < stateCount; i++)
+    if (accept[i] < -1 || (accept[i] >= 0 && (size_t)accept[i] >= ruleCount))
+      return NULL;
+  for (size_t i = 0; i < stateCount * classCount; i++)
+    if (transitions[i] >= stateCount) return NULL;
+
+  clexDfa* dfa = calloc(1, sizeof(clexDfa));
+  if (!dfa) return NULL;
+  memcpy(dfa->classMap, classMap, CLEX_DFA_ALPHABET);
+  dfa->classCount = classCount;
+  dfa->stateCount = stateCount;
+  dfa->sourceStateCount = stateCount;
+  dfa->accept = (int32_t*)accept;
+  dfa->transitions = (uint32_t*)transitions;
+  dfa->borrowed = true;
+  if (outSize) *outSize = total;
+  return dfa;
+}
+
+// A lazy DFA shares the builder with clexDfaBuild but only creates a state
+// the first time a (state, class) pair is followed. When the cache outgrows
+// its byte budget every state except the start state is dropped.
+struct clexLazyDfa {
+  DfaBuilder builder;
+  unsigned char classRepresentative[CLEX_DFA_ALPHABET];
+  uint32_t* startSet;
+  size_t startSize;
+  size_t cacheBudget;
+  size_t cacheBytes;
+  size_t flushCount;
+};
+
+static size_t lazyDfaStateBytes(const clexLazyDfa* lazy, size_t setSize) {
+  return lazy->builder.dfa->classCount * sizeof(uint32_t) + sizeof(int32_t) +
+         2 * sizeof(size_t) + 2 * sizeof(uint32_t) +
+         setSize * sizeof(uint32_t);
+}
+
+static bool lazyDfaReset(clexLazyDfa* lazy) {
+  if (!dfaBuilderStart(&lazy->builder, lazy->startSet, lazy->startSize))
+    return false;
+  lazy->cacheBytes =
+      lazyDfaStateBytes(lazy, 0) + lazyDfaStateBytes(lazy, lazy->startSize);
+  return true;
+}
+
+static size_t lazyDfaMove(clexLazyDfa* lazy, uint32_t state,
+                          size_t classIndex) {
+  DfaBuilder* builder = &lazy->builder;
+  U32Vec* moves = &builder->moves[0];
+  char symbol = (char)lazy->classRepresentative[classIndex];
+  moves->size = 0;
+
+  for (size_t i = 0; i < builder->setLength[state]; i++) {
+    uint32_t index = builder->pool.items[builder->setStart[state] + i];
+    const clexCompiledNode* node = builder->nodes[index];
+    for (size_t j = 0; j < node->transitionCount; j++) {
+      const clexCompiledTransition* transition = &node->transitions[j];
+      if (transition->fromValue == '\0') continue;
+      if (transition->fromValue > symbol || transition->toValue < symbol)
+        continue;
+      uint32_t to = builder->nodeBase[index] + (uint32_t)transition->toIndex;
+      if (!dfaBuilderPush(builder, moves, to)) return (size_t)-1;
+    }
+  }
+  if (moves->size == 0) return 0;
+  return dfaBuilderClosure(builder, moves->items, moves->size);
+}
+
+static bool lazyDfaTransition(clexLazyDfa* lazy, uint32_t state,
+                              size_t classIndex, uint32_t* outState) {
+  DfaBuilder* builder = &lazy->builder;
+  clexDfa* dfa = builder->dfa;
+  size_t closureSize = lazyDfaMove(lazy, state, classIndex);
+  if (closureSize == (size_t)-1) return false;
+
+  uint32_t target = CLEX_DFA_DEAD;
+  if (closureSize > 0) {
+    target = dfaBuilderLookupState(builder, builder->closure, closureSize,
+                                   NULL);
+    if (target == CLEX_DFA_DEAD) {
+      size_t bytes = lazyDfaStateBytes(lazy, closureSize);
+      if (lazy->cacheBytes + bytes > lazy->cacheBudget &&
+          dfa->stateCount > CLEX_DFA_START + 1) {
+        // The source state does not survive the flush, so the transition is
+        // followed this time without being recorded.
+        if (!lazyDfaReset(lazy)) return false;
+        lazy->flushCount++;
+        state = CLEX_DFA_DEAD;
+      }
+      if (!dfaBuilderAddState(builder, builder->closure, closureSize,
+                              &target))
+        return false;
+      lazy->cacheBytes += bytes;
+    }
+  }
+
+  if (state != CLEX_DFA_DEAD)
+    dfa->transitions[(size_t)state * dfa->classCount + classIndex] = target;
+  *outState = target;
+  return true;
+}
+
+clexLazyDfa* clexLazyDfaCreate(const clexCompiledNfa* const* nfas,
+                               size_t nfaCount, size_t cacheBudget) {
+  clexLazyDfa* lazy = calloc(1, sizeof(clexLazyDfa));
+  if (!lazy) return NULL;
+
+  DfaBuilder* builder = &lazy->builder;
+  if (!dfaBuilderInit(builder, nfas, nfaCount)) {
+    clexDfaDestroy(builder->dfa);
+    dfaBuilderFree(builder);
+    free(lazy);
+    return NULL;
+  }
+  builder->missingTransition = CLEX_DFA_UNKNOWN;
+  lazy->cacheBudget = cacheBudget;
+
+  const clexDfa* dfa = builder->dfa;
+  for (size_t byte = CLEX_DFA_ALPHABET; byte-- > 0;)
+    lazy->classRepresentative[dfa->classMap[byte]] = (unsigned char)byte;
+
+  lazy->startSize =
+      dfaBuilderClosure(builder, builder->starts, builder->startCount);
+  lazy->startSet = calloc(lazy->startSize, sizeof(uint32_t));
+  if (!lazy->startSet) {
+    clexLazyDfaDestroy(lazy);
+    return NULL;
+  }
+  memcpy(lazy->startSet, builder->closure, lazy->startSize * sizeof(uint32_t));
+
+  if (!lazyDfaReset(lazy)) {
+    clexLazyDfaDestroy(lazy);
+    return NULL;
+  }
+  return lazy;
+}
+
+bool clexLazyDfaMatchCounted(clexLazyDfa* lazy, const char* target,
+                             size_t length, int* outRule, size_t* outLength,
+                             size_t* outScanned) {
+  if (outRule) *outRule = -1;
+  if (outLength) *outLength = 0;
+  if (outScanned) *outScanned = 0;
+  if (!lazy || !target) return false;
+
+  const clexDfa* dfa = lazy->builder.dfa;
+  uint32_t state = CLEX_DFA_START;
+  size_t i = 0;
+  for (; i < length; i++) {
+    size_t classIndex = dfa->classMap[(unsigned char)target[i]];
+    uint32_t next = dfa->transitions[(size_t)state * dfa->classCount +
+                                     classIndex];
+    if (next == CLEX_DFA_UNKNOWN &&
+        !lazyDfaTransition(lazy, state, classIndex, &next))
+      return false;
+    if (next == CLEX_DFA_DEAD) break;
+    state = next;
+    if (dfa->accept[state] >= 0) {
+      if (outRule) *outRule = dfa->accept[state];
+      if (outLength) *outLength = i + 1;
+    }
+  }
+  if (outScanned) *outScanned = i;
+  return true;
+}
+
+bool clexLazyDfaMatch(clexLazyDfa* lazy, const char* target, size_t length,
+                      int* outRule, size_t* outLength) {
+  return clexLazyDfaMatchCounted(lazy, target, length, outRule, outLength,
+                                 NULL);
+}
+
+size_t clexLazyDfaStateCount(const clexLazyDfa* lazy) {
+  return lazy ? lazy->builder.dfa->stateCount : 0;
+}
+
+size_t clexLazyDfaFlushCount(const clexLazyDfa* lazy) {
+  return lazy ? lazy->flushCount : 0;
+}
+
+size_t clexLazyDfaAllocationCount(const clexLazyDfa* lazy) {
+  return lazy ? lazy->builder.allocations : 0;
+}
+
+void clexLazyDfaDestroy(clexLazyDfa* lazy) {
+  if (!lazy) return;
+  clexDfaDestroy(lazy->builder.dfa);
+  dfaBuilderFree(&lazy->builder);
+  free(lazy->startSet);
+  free(lazy);
+}
+
+// Recognizes an NFA that accepts exactly one string: a chain of single-byte
+// transitions from the start state to a finish state with no way out.
+bool clexCompiledNfaLiteral(const clexCompiledNfa* compiled, char* out,
+                            size_t capacity, size_t* outLength) {
+  if (!compiled || compiled->nodeCount == 0 || compiled->closureMasks ||
+      compiled->closureStarts || compiled->walkEpsilons)
+    return false;
+  size_t state = 0;
+  size_t length = 0;
+  while (compiled->nodes[state].transitionCount == 1) {
+    const clexCompiledTransition* transition =
+        &compiled->nodes[state].transitions[0];
+    if (compiled->nodes[state].isFinish || length == capacity ||
+        length + 1 >= compiled->nodeCount ||
+        transition->fromValue != transition->toValue)
+      return false;
+    out[length++] = transition->fromValue;
+    state = transition->toIndex;
+  }
+  if (compiled->nodes[state].transitionCount != 0 ||
+      !compiled->nodes[state].isFinish || length == 0 ||
+      length + 1 != compiled->nodeCount)
+    return false;
+  *outLength = length;
+  return true;
+}
+
+// Marks out[byte] for every byte that a non-empty match can start with; a
+// rule can only beat the empty match on input whose first byte is marked.
+bool clexCompiledNfaFirstBytes(const clexCompiledNfa* compiled, bool* out) {
+  memset(out, 0, CLEX_BYTE_COUNT * sizeof(bool));
+  if (!compiled || compiled->nodeCount == 0) return true;
+  uint64_t* start = calloc(compiled->wordCount, sizeof(uint64_t));
+  size_t* stack = malloc(compiled->nodeCount * sizeof(size_t));
+  if (!start || !stack) {
+    free(start);
+    free(stack);
+    return false;
+  }
+  compiledNfaAddClosure(compiled, start, 0, stack);
+  free(stack);
+  for (size_t w = 0; w < compiled->wordCount; w++) {
+    for (uint64_t bits = start[w]; bits; bits &= bits - 1) {
+      const clexCompiledNode* node =
+          &compiled->nodes[w * 64 + lowestSetBit(bits)];
+      for (size_t i = 0; i < node->transitionCount; i++) {
+        const clexCompiledTransition* transition = &node->transitions[i];
+        if (transition->fromValue == '\0') continue;
+        unsigned char lows[2];
+        unsigned char highs[2];
+        size_t count = rangeByteIntervals(transition->fromValue,
+                                          transition->toValue, lows, highs);
+        for (size_t k = 0; k < count; k++)
+          for (size_t byte = lows[k]; byte <= highs[k]; byte++)
+            out[byte] = true;
+      }
+    }
+  }
+  free(start);
+  return true;
+}
+
+// Product states are (left, right) node pairs packed as left * rightCount +
+// right; searching more pairs than this is treated as an overlap.
+#define CLEX_OVERLAP_PAIR_LIMIT ((size_t)1 << 24)
+
+// Marks every pair in leftSet x rightSet and pushes the unseen ones onto
+// `pending`. Returns false on allocation failure; sets *found when a pair
+// reached by a non-empty string accepts in both automata.
+static bool overlapVisit(const clexCompiledNfa* left,
+                         const clexCompiledNfa* right, const uint64_t* leftSet,
+                         const uint64_t* rightSet, bool afterStep,
+                         uint64_t* seen, U32Vec* pending, bool* found) {
+  for (size_t lw = 0; lw < left->wordCount; lw++) {
+    for (uint64_t lbits = leftSet[lw]; lbits; lbits &= lbits - 1) {
+      size_t l = lw * 64 + lowestSetBit(lbits);
+      for (size_t rw = 0; rw < right->wordCount; rw++) {
+        for (uint64_t rbits = rightSet[rw]; rbits; rbits &= rbits - 1) {
+          size_t r = rw * 64 + lowestSetBit(rbits);
+          if (afterStep && left->nodes[l].isFinish &&
+              right->nodes[r].isFinish) {
+            *found = true;
+            return true;
+          }
+          size_t pair = l * right->nodeCount + r;
+          if (stateSetContains(seen, pair)) continue;
+          stateSetAdd(seen, pair);
+          if (!u32VecPush(pending, (uint32_t)pair)) return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Searches the product automaton for a non-empty string both NFAs accept.
+// Returns true when one exists, and whenever that cannot be ruled out because
+// the product is too large or memory runs out.
+bool clexCompiledNfaOverlaps(const clexCompiledNfa* left,
+                             const clexCompiledNfa* right) {
+  if (!left || !right || left->nodeCount == 0 || right->nodeCount == 0)
+    return false;
+  if (right->nodeCount > CLEX_OVERLAP_PAIR_LIMIT / left->nodeCount)
+    return true;
+
+  size_t pairCount = left->nodeCount * right->nodeCount;
+  uint64_t* seen = calloc((pairCount + 63) / 64, sizeof(uint64_t));
+  uint64_t* leftSet = calloc(left->wordCount, sizeof(uint64_t));
+  uint64_t* rightSet = calloc(right->wordCount, sizeof(uint64_t));
+  size_t* stack = malloc(
+      (left->nodeCount > right->nodeCount ? left->nodeCount
+                                          : right->nodeCount) *
+      sizeof(size_t));
+  U32Vec pending = {0};
+  bool found = false;
+  bool ok = seen && leftSet && rightSet && stack;
+  if (ok) {
+    compiledNfaAddClosure(left, leftSet, 0, stack);
+    compiledNfaAddClosure(right, rightSet, 0, stack);
+    ok = overlapVisit(left, right, leftSet, rightSet, false, seen, &pending,
+                      &found);
+  }
+  while (ok && !found && pending.size > 0) {
+    uint32_t pair = pending.items[--pending.size];
+    const clexCompiledNode* leftNode = &left->nodes[pair / right->nodeCount];
+    const clexCompiledNode* rightNode = &right->nodes[pair % right->nodeCount];
+    for (size_t i = 0; ok && !found && i < leftNode->transitionCount; i++) {
+      const clexCompiledTransition* lt = &leftNode->transitions[i];
+      if (lt->fromValue == '\0') continue;
+      for (size_t j = 0; ok && !found && j < rightNode->transitionCount; j++) {
+        const clexCompiledTransition* rt = &rightNode->transitions[j];
+        if (rt->fromValue == '\0') continue;
+        char low = lt->fromValue;
+        char high = lt->toValue;
+        if (rt->fromValue > low) low = rt->fromValue;
+        if (rt->toValue < high) high = rt->toValue;
+        if (low > high) continue;
+        memset(leftSet, 0, left->wordCount * sizeof(uint64_t));
+        memset(rightSet, 0, right->wordCount * sizeof(uint64_t));
+        compiledNfaAddClosure(left, leftSet, lt->toIndex, stack);
+        compiledNfaAddClosure(right, rightSet, rt->toIndex, stack);
+        ok = overlapVisit(left, right, leftSet, rightSet, true, seen, &pending,
+                          &found);
+      }
+    }
+  }
+  free(pending.items);
+  free(seen);
+  free(leftSet);
+  free(rightSet);
+  free(stack);
+  return found || !ok;
+}
+
+// Literal rules are looked up in a perfect hash table built with hash and
+// displace: literals are first grouped into small buckets, then each bucket,
+// largest first, gets a seed under which all its literals land in free slots.
+// A lookup is one hash of the input, one probe and one compare.
+// `lengthMask[byte]` has bit L - 1 set when some literal of length L starts
+// with `byte`, so only lengths that can match are probed.
+#define CLEX_LITERAL_SEED_LIMIT 4096
+
+typedef struct clexLiteral {
+  const char* text;
+  size_t length;
+  int rule;
+} clexLiteral;
+
+struct clexLiteralSet {
+  clexLiteral* literals;
+  size_t literalCount;
+  uint32_t* seeds;
+  size_t bucketMask;
+  int32_t* slots;
+  size_t slotMask;
+  uint64_t lengthMask[CLEX_DFA_ALPHABET];
+  char* text;
+};
+
+static uint64_t literalHash(const char* text, size_t length) {
+  uint64_t hash = 1469598103934665603ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)text[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static size_t literalSlot(uint64_t hash, uint32_t seed, size_t slotMask) {
+  uint64_t mixed = hash ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ULL);
+  mixed ^= mixed >> 31;
+  mixed *= 0xBF58476D1CE4E5B9ULL;
+  mixed ^= mixed >> 29;
+  return (size_t)mixed & slotMask;
+}
+
+static size_t literalBucket(uint64_t hash, size_t bucketMask) {
+  return (size_t)(hash >> 32) & bucketMask;
+}
+
+// Finds a seed for every bucket; `members` lists literal indices bucket by
+// bucket and `order` visits the buckets from largest to smallest.
+static bool literalSetPlace(clexLiteralSet* set, const uint64_t* hashes,
+                            const size_t* bucketStart, const size_t* members,
+                            const size_t* order, size_t* placed) {
+  for (size_t i = 0; i <= set->slotMask; i++) set->slots[i] = -1;
+  for (size_t i = 0; i <= set->bucketMask; i++) {
+    size_t bucket = order[i];
+    size_t first = bucketStart[bucket];
+    size_t size = bucketStart[bucket + 1] - first;
+    if (size == 0) break;
+    uint32_t seed = 0;
+    for (; seed < CLEX_LITERAL_SEED_LIMIT; seed++) {
+      size_t count = 0;
+      for (; count < size; count++) {
+        size_t slot =
+            literalSlot(hashes[members[first + count]], seed, set->slotMask);
+        if (set->slots[slot] >= 0) break;
+        set->slots[slot] = (int32_t)members[first + count];
+        placed[count] = slot;
+      }
+      if (count == size) break;
+      while (count > 0) set->slots[placed[--count]] = -1;
+    }
+    if (seed == CLEX_LITERAL_SEED_LIMIT) return false;
+    set->seeds[bucket] = seed;
+  }
+  return true;
+}
+
+void clexLiteralSetDestroy(clexLiteralSet* set) {
+  if (!set) return;
+  free(set->literals);
+  free(set->seeds);
+  free(set->slots);
+  free(set->text);
+  free(set);
+}
+
+static bool literalSetLayout(clexLiteralSet* set, const uint64_t* hashes,
+                             size_t* bucketStart, size_t* members,
+                             size_t* order, size_t* placed) {
+  size_t count = set->literalCount;
+  size_t bucketCount = set->bucketMask + 1;
+  memset(bucketStart, 0, (bucketCount + 1) * sizeof(size_t));
+  for (size_t i = 0; i < count; i++)
+    bucketStart[literalBucket(hashes[i], set->bucketMask) + 1]++;
+  for (size_t i = 0; i < bucketCount; i++) bucketStart[i + 1] += bucketStart[i];
+  for (size_t i = 0; i < count; i++)
+    members[bucketStart[literalBucket(hashes[i], set->bucketMask)]++] = i;
+  for (size_t i = bucketCount; i > 0; i--) bucketStart[i] = bucketStart[i - 1];
+  bucketStart[0] = 0;
+
+  for (size_t i = 0; i < bucketCount; i++) order[i] = i;
+  // Insertion sort by size, largest first; buckets hold a handful of
+  // literals, so this is a few passes at most.
+  for (size_t i = 1; i < bucketCount; i++) {
+    size_t bucket = order[i];
+    size_t size = bucketStart[bucket + 1] - bucketStart[bucket];
+    size_t j = i;
+    while (j > 0 && bucketStart[order[j - 1] + 1] - bucketStart[order[j - 1]] <
+                        size) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = bucket;
+  }
+
+  // Table sizes double until every bucket finds a seed; with at most half of
+  // the slots used this almost always succeeds on the first try.
+  while (!literalSetPlace(set, hashes, bucketStart, members, order, placed)) {
+    if (set->slotMask + 1 > 64 * (count + 1)) return false;
+    size_t slotCount = (set->slotMask + 1) * 2;
+    int32_t* slots = realloc(set->slots, slotCount * sizeof(int32_t));
+    if (!slots) return false;
+    set->slots = slots;
+    set->slotMask = slotCount - 1;
+  }
+  return true;
+}
+
+// Literals are given in rule order. A literal repeated by a later rule keeps
+// the first rule, which is the one that wins ties. Literals longer than
+// CLEX_LITERAL_MAX_LENGTH are left out; returns NULL if no table could be
+// built.
+clexLiteralSet* clexLiteralSetBuild(const char* const* literals,
+                                    const size_t* lengths, const int* rules,
+                                    size_t count) {
+  clexLiteralSet* set = calloc(1, sizeof(clexLiteralSet));
+  if (!set) return NULL;
+  size_t textLength = 0;
+  for (size_t i = 0; i < count; i++) textLength += lengths[i];
+  size_t bucketCount = 1;
+  while (bucketCount * 4 < count) bucketCount *= 2;
+  size_t slotCount = 8;
+  while (slotCount < count * 2) slotCount *= 2;
+  set->bucketMask = bucketCount - 1;
+  set->slotMask = slotCount - 1;
+  set->literals = malloc((count ? count : 1) * sizeof(clexLiteral));
+  set->text = malloc(textLength ? textLength : 1);
+  set->seeds = calloc(bucketCount, sizeof(uint32_t));
+  set->slots = malloc(slotCount * sizeof(int32_t));
+  uint64_t* hashes = malloc((count ? count : 1) * sizeof(uint64_t));
+  size_t* bucketStart = malloc((bucketCount + 1) * sizeof(size_t));
+  size_t* members = malloc((count ? count : 1) * sizeof(size_t));
+  size_t* order = malloc(bucketCount * sizeof(size_t));
+  size_t* placed = malloc((count ? count : 1) * sizeof(size_t));
+  bool ok = set->literals && set->text && set->seeds && set->slots && hashes &&
+            bucketStart && members && order && placed;
+
+  // Repeats share a bucket, so they are found with an ordinary probing pass
+  // over the slot table before the perfect layout is searched.
+  char* cursor = set->text;
+  for (size_t i = 0; ok && i <= set->slotMask; i++) set->slots[i] = -1;
+  for (size_t i = 0; ok && i < count; i++) {
+    if (lengths[i] == 0 || lengths[i] > CLEX_LITERAL_MAX_LENGTH) continue;
+    uint64_t hash = literalHash(literals[i], lengths[i]);
+    size_t slot = (size_t)hash & set->slotMask;
+    bool repeated = false;
+    while (!repeated && set->slots[slot] >= 0) {
+      const clexLiteral* other = &set->literals[set->slots[slot]];
+      repeated = other->length == lengths[i] &&
+                 memcmp(other->text, literals[i], lengths[i]) == 0;
+      slot = (slot + 1) & set->slotMask;
+    }
+    if (repeated) continue;
+    set->slots[slot] = (int32_t)set->literalCount;
+    memcpy(cursor, literals[i], lengths[i]);
+    clexLiteral* literal = &set->literals[set->literalCount];
+    literal->text = cursor;
+    literal->length = lengths[i];
+    literal->rule = rules[i];
+    hashes[set->literalCount++] = hash;
+    set->lengthMask[(unsigned char)literals[i][0]] |= (uint64_t)1
+                                                      << (lengths[i] - 1);
+    cursor += lengths[i];
+  }
+
+  ok = ok && literalSetLayout(set, hashes, bucketStart, members, order, placed);
+  free(hashes);
+  free(bucketStart);
+  free(members);
+  free(order);
+  free(placed);
+  if (!ok) {
+    clexLiteralSetDestroy(set);
+    return NULL;
+  }
+  return set;
+}
+
+// Returns the rule of the longest literal that is a prefix of `target`, or -1.
+int clexLiteralSetLongestMatch(const clexLiteralSet* set, const char* target,
+                               size_t length, size_t* outLength) {
+  if (!set || length == 0) return -1;
+  uint64_t lengths = set->lengthMask[(unsigned char)target[0]];
+  if (length < CLEX_LITERAL_MAX_LENGTH)
+    lengths &= ((uint64_t)1 << length) - 1;
+  while (lengths) {
+    size_t bit = highestSetBit(lengths);
+    lengths &= ~((uint64_t)1 << bit);
+    size_t candidate = bit + 1;
+    uint64_t hash = literalHash(target, candidate);
+    size_t bucket = literalBucket(hash, set->bucketMask);
+    int32_t index =
+        set->slots[literalSlot(hash, set->seeds[bucket], set->slotMask)];
+    if (index < 0) continue;
+    const clexLiteral* literal = &set->literals[index];
+    if (literal->length == candidate &&
+        memcmp(literal->text, target, candidate) == 0) {
+      *outLength = candidate;
+      return literal->rule;
+    }
+  }
+  return -1;
+}
+
+static char* drawKey(clexNode* node1, clexNode* node2, char fromValue,
+                     char toValue) {
+  char* result = malloc(1024);
+  sprintf(result, "%p%p%c%c", (void*)node1, (void*)node2, fromValue, toValue);
+  return result;
+}
+
+static unsigned long getDrawMapping(unsigned long* drawMapping,
+                                    unsigned long value) {
   for (int i = 0; i < 1024; i++)
     if (drawMapping[i] == value)
       return i;
@@ -1055,26 +3140,13 @@ void clexNfaDraw(clexNode* nfa) {
   free(drawMapping);
 }
 
-static void clexNfaDestroyInternal(clexNode* nfa, NodeVec* seen) {
-  if (!nfa || nodeVecContains(seen, nfa)) return;
-  if (!nodeVecPush(seen, nfa)) return;
-
-  for (size_t i = 0; i < nfa->transitionCount; i++) {
-    if (!nfa->transitions[i]) continue;
-    clexNfaDestroyInternal(nfa->transitions[i]->to, seen);
-    free(nfa->transitions[i]);
-  }
-  if (nfa->compiled) {
-    compiledNfaFree(nfa->compiled);
-    free(nfa->compiled);
-  }
-  free(nfa->transitions);
-  free(nfa);
-}
-
 void clexNfaDestroy(clexNode* nfa, clexNode** seen) {
   (void)seen;
-  NodeVec visited = {0};
-  clexNfaDestroyInternal(nfa, &visited);
-  nodeVecFree(&visited);
+  if (!nfa) return;
+  arenaDestroy(nfa->arena);
+}
+
+// Bytes reserved by the arena blocks holding the graph, headers included.
+size_t clexNfaArenaSize(const clexNode* nfa) {
+  return nfa ? nfa->arena->reservedBytes : 0;
 }
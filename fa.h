@@ -4,8 +4,19 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+// Longest literal rule that clexLiteralSetBuild() accepts.
+#define CLEX_LITERAL_MAX_LENGTH 64
+
+// Entries in the table clexCompiledNfaFirstBytes() fills, one per byte value.
+#define CLEX_BYTE_COUNT 256
+
 typedef struct clexNode clexNode;
+typedef struct clexArena clexArena;
 typedef struct clexCompiledNfa clexCompiledNfa;
+typedef struct clexNfaScratch clexNfaScratch;
+typedef struct clexDfa clexDfa;
+typedef struct clexLazyDfa clexLazyDfa;
+typedef struct clexLiteralSet clexLiteralSet;
 
 typedef struct clexTransition {
   char fromValue;
@@ -20,6 +31,9 @@ typedef struct clexNode {
   size_t transitionCount;
   size_t transitionCapacity;
   clexCompiledNfa* compiled;
+  clexNfaScratch* scratch;
+  clexArena* arena;
+  size_t id;
 } clexNode;
 
 typedef struct clexReLexerState {
@@ -31,11 +45,70 @@ typedef struct clexReLexerState {
   bool inPipe;
   bool pipeSeen;
   bool inBackslash;
+  clexArena* arena;
 } clexReLexerState;
 
 clexNode* clexNfaFromRe(const char* re, clexReLexerState* state);
 bool clexNfaTest(clexNode* nfa, const char* target);
+size_t clexNfaLongestMatch(clexNode* nfa, const char* target, size_t length);
 void clexNfaDraw(clexNode* nfa);
 void clexNfaDestroy(clexNode* nfa, clexNode** seen);
+size_t clexNfaArenaSize(const clexNode* nfa);
+
+clexCompiledNfa* clexNfaCompile(clexNode* nfa);
+size_t clexCompiledNfaNodeCount(const clexCompiledNfa* compiled);
+size_t clexCompiledNfaSourceNodeCount(const clexCompiledNfa* compiled);
+size_t clexCompiledNfaLongestMatch(const clexCompiledNfa* compiled,
+                                   clexNfaScratch* scratch, const char* target,
+                                   size_t length);
+// The *Counted variants also report how many bytes the automaton consumed
+// before it stopped, which is at least the match length.
+size_t clexCompiledNfaLongestMatchCounted(const clexCompiledNfa* compiled,
+                                          clexNfaScratch* scratch,
+                                          const char* target, size_t length,
+                                          size_t* outScanned);
+bool clexCompiledNfaLiteral(const clexCompiledNfa* compiled, char* out,
+                            size_t capacity, size_t* outLength);
+bool clexCompiledNfaFirstBytes(const clexCompiledNfa* compiled, bool* out);
+bool clexCompiledNfaOverlaps(const clexCompiledNfa* left,
+                             const clexCompiledNfa* right);
+void clexCompiledNfaDestroy(clexCompiledNfa* compiled);
+clexNfaScratch* clexNfaScratchCreate(size_t nodeCount);
+void clexNfaScratchDestroy(clexNfaScratch* scratch);
+
+clexDfa* clexDfaBuild(const clexCompiledNfa* const* nfas, size_t nfaCount);
+int clexDfaMatch(const clexDfa* dfa, const char* target, size_t length,
+                 size_t* outLength);
+int clexDfaMatchCounted(const clexDfa* dfa, const char* target,
+                        size_t length, size_t* outLength, size_t* outScanned);
+size_t clexDfaStateCount(const clexDfa* dfa);
+size_t clexDfaSourceStateCount(const clexDfa* dfa);
+size_t clexDfaClassCount(const clexDfa* dfa);
+size_t clexDfaByteClass(const clexDfa* dfa, unsigned char byte);
+size_t clexDfaNextState(const clexDfa* dfa, size_t state, size_t byteClass);
+int clexDfaAcceptRule(const clexDfa* dfa, size_t state);
+void clexDfaDestroy(clexDfa* dfa);
+size_t clexDfaSerialize(const clexDfa* dfa, void* out, size_t capacity);
+clexDfa* clexDfaFromTables(const void* data, size_t length, size_t ruleCount,
+                           size_t* outSize);
+
+clexLazyDfa* clexLazyDfaCreate(const clexCompiledNfa* const* nfas,
+                               size_t nfaCount, size_t cacheBudget);
+bool clexLazyDfaMatch(clexLazyDfa* lazy, const char* target, size_t length,
+                      int* outRule, size_t* outLength);
+bool clexLazyDfaMatchCounted(clexLazyDfa* lazy, const char* target,
+                             size_t length, int* outRule, size_t* outLength,
+                             size_t* outScanned);
+size_t clexLazyDfaStateCount(const clexLazyDfa* lazy);
+size_t clexLazyDfaFlushCount(const clexLazyDfa* lazy);
+size_t clexLazyDfaAllocationCount(const clexLazyDfa* lazy);
+void clexLazyDfaDestroy(clexLazyDfa* lazy);
+
+clexLiteralSet* clexLiteralSetBuild(const char* const* literals,
+                                    const size_t* lengths, const int* rules,
+                                    size_t count);
+int clexLiteralSetLongestMatch(const clexLiteralSet* set, const char* target,
+                               size_t length, size_t* outLength);
+void clexLiteralSetDestroy(clexLiteralSet* set);
 
 #endif
@@ -3,6 +3,10 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "clex.h"
 
@@ -96,6 +100,114 @@ typedef enum TokenKind {
   IDENTIFIER,
 } TokenKind;
 
+static void expectCProgram(clexLexer* lexer) {
+  clexToken token;
+  clexTokenInit(&token);
+
+  clexReset(lexer, "int main(int argc, char *argv[]) {\nreturn 23;\n}");
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == INT);
+  assert(strcmp(token.lexeme, "int") == 0);
+  assert(token.span.start.line == 1);
+  assert(token.span.start.column == 1);
+  assert(token.span.end.line == 1);
+  assert(token.span.end.column == 4);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(strcmp(token.lexeme, "main") == 0);
+  assert(token.span.start.line == 1);
+  assert(token.span.start.column == 5);
+  assert(token.span.end.column == 9);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == OPARAN);
+  assert(strcmp(token.lexeme, "(") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == INT);
+  assert(strcmp(token.lexeme, "int") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(strcmp(token.lexeme, "argc") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == COMMA);
+  assert(strcmp(token.lexeme, ",") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == CHAR);
+  assert(strcmp(token.lexeme, "char") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == STAR);
+  assert(strcmp(token.lexeme, "*") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(strcmp(token.lexeme, "argv") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == OSQUAREBRACE);
+  assert(strcmp(token.lexeme, "[") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == CSQUAREBRACE);
+  assert(strcmp(token.lexeme, "]") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == CPARAN);
+  assert(strcmp(token.lexeme, ")") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == OCURLYBRACE);
+  assert(strcmp(token.lexeme, "{") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == RETURN);
+  assert(strcmp(token.lexeme, "return") == 0);
+  assert(token.span.start.line == 2);
+  assert(token.span.start.column == 1);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == CONSTANT);
+  assert(strcmp(token.lexeme, "23") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == SEMICOL);
+  assert(strcmp(token.lexeme, ";") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == CCURLYBRACE);
+  assert(strcmp(token.lexeme, "}") == 0);
+
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+  clexTokenClear(&token);
+  assert(token.lexeme == NULL);
+}
+
+typedef struct StringSource {
+  const char* text;
+  size_t length;
+  size_t offset;
+  size_t piece;
+} StringSource;
+
+// Hands out at most `piece` bytes per call; a zero piece size fails.
+static long long readStringSource(void* user_data, char* buffer,
+                                  size_t capacity) {
+  StringSource* source = user_data;
+  if (source->piece == 0) return -1;
+  size_t count = source->length - source->offset;
+  if (count > capacity) count = capacity;
+  if (count > source->piece) count = source->piece;
+  memcpy(buffer, source->text + source->offset, count);
+  source->offset += count;
+  return (long long)count;
+}
+
 int main(void) {
   clexLexer* lexer = clexInit();
   clexToken token;
@@ -169,6 +281,191 @@ int main(void) {
   assert(lex_error->position.column == 5);
   assert(lex_error->expected_kind_count > 0);
 
+  assert(clexSetEngine(lexer, CLEX_ENGINE_DFA) == CLEX_STATUS_OK);
+  assert(clexSetEngine(lexer, (clexEngine)42) == CLEX_STATUS_INVALID_ARGUMENT);
+  clexReset(lexer, "breaking auto$");
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(strcmp(token.lexeme, "breaking") == 0);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == AUTO);
+  assert(token.span.end.column == 14);
+  assert(clex(lexer, &token) == CLEX_STATUS_LEXICAL_ERROR);
+  assert(clexGetLastError(lexer)->position.offset == 13);
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+  assert(clexSetEngine(lexer, CLEX_ENGINE_NFA) == CLEX_STATUS_OK);
+
+  const char* viewSource = "auto  ident1;";
+  clexTokenView view;
+  clexTokenViewInit(&view);
+  clexReset(lexer, viewSource);
+  assert(clexView(NULL, &view) == CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexView(lexer, &view) == CLEX_STATUS_OK);
+  assert(view.kind == AUTO);
+  assert(view.lexeme == viewSource);
+  assert(view.length == 4);
+  assert(clexView(lexer, &view) == CLEX_STATUS_OK);
+  assert(view.kind == IDENTIFIER);
+  assert(view.lexeme == viewSource + 6);
+  assert(view.length == 6);
+  assert(view.span.start.column == 7);
+  assert(view.span.end.offset == 12);
+  assert(clexView(lexer, &view) == CLEX_STATUS_OK);
+  assert(view.kind == SEMICOL);
+  assert(clexView(lexer, &view) == CLEX_STATUS_EOF);
+  assert(view.kind == CLEX_TOKEN_EOF);
+  assert(view.length == 0);
+
+  clexTokenView batch[4];
+  size_t produced = 42;
+  assert(clexTokenizeBatch(lexer, NULL, 4, &produced) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(produced == 0);
+  clexReset(lexer, "auto x; break; y;");
+  assert(clexTokenizeBatch(lexer, batch, 4, &produced) == CLEX_STATUS_OK);
+  assert(produced == 4);
+  assert(batch[0].kind == AUTO);
+  assert(batch[1].kind == IDENTIFIER);
+  assert(batch[2].kind == SEMICOL);
+  assert(batch[3].kind == BREAK);
+  assert(clexTokenizeBatch(lexer, batch, 4, &produced) == CLEX_STATUS_EOF);
+  assert(produced == 3);
+  assert(batch[1].kind == IDENTIFIER);
+  assert(batch[1].span.start.offset == 15);
+  clexReset(lexer, "x $ y");
+  assert(clexTokenizeBatch(lexer, batch, 4, &produced) ==
+         CLEX_STATUS_LEXICAL_ERROR);
+  assert(produced == 1);
+  assert(clexGetLastError(lexer)->position.offset == 2);
+
+  const char withNul[] = {'a', 'u', 't', 'o', ' ', '\0', ' ', 'x', ';', 'y'};
+  clexResetWithLength(lexer, withNul, 9);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == AUTO);
+  assert(clex(lexer, &token) == CLEX_STATUS_LEXICAL_ERROR);
+  assert(clexGetLastError(lexer)->position.offset == 5);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(strcmp(token.lexeme, "x") == 0);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == SEMICOL);
+  assert(token.span.end.offset == 9);
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+
+  size_t blobLength = 30000;
+  char* blob = malloc(blobLength + 1);
+  assert(blob != NULL);
+  for (size_t i = 0; i < blobLength; i++) blob[i] = i % 3 == 2 ? ';' : 'x';
+  blob[blobLength] = '\0';
+  clexReset(lexer, blob);
+  size_t blobTokens = 0;
+  while (clex(lexer, &token) == CLEX_STATUS_OK) {
+    assert(token.kind == (blobTokens % 2 ? SEMICOL : IDENTIFIER));
+    blobTokens++;
+  }
+  assert(blobTokens == 20000);
+  assert(clexGetLastError(lexer)->status == CLEX_STATUS_OK);
+  free(blob);
+
+  const char* streamed = "auto ident1;\n  break;\n\n  _Bool x1 ;$ x";
+  clexToken expected[16];
+  clexStatus expectedStatus[16];
+  clexReset(lexer, streamed);
+  for (int i = 0; i < 16; i++) {
+    clexTokenInit(&expected[i]);
+    expectedStatus[i] = clex(lexer, &expected[i]);
+  }
+  for (size_t piece = 1; piece <= 8; piece++) {
+    StringSource source = {streamed, strlen(streamed), 0, piece};
+    assert(clexResetWithReader(lexer, readStringSource, &source) ==
+           CLEX_STATUS_OK);
+    for (int i = 0; i < 16; i++) {
+      assert(clex(lexer, &token) == expectedStatus[i]);
+      assert(token.kind == expected[i].kind);
+      assert(memcmp(&token.span, &expected[i].span, sizeof(clexSourceSpan)) ==
+             0);
+      if (expectedStatus[i] == CLEX_STATUS_OK) {
+        assert(strcmp(token.lexeme, expected[i].lexeme) == 0);
+      }
+    }
+  }
+  for (int i = 0; i < 16; i++) clexTokenClear(&expected[i]);
+
+  size_t longLength = 70000;
+  char* longSource = malloc(longLength + 3);
+  assert(longSource != NULL);
+  memset(longSource, 'a', longLength);
+  memcpy(longSource + longLength, " ;", 3);
+  StringSource source = {longSource, longLength + 2, 0, 4096};
+  assert(clexResetWithReader(lexer, readStringSource, &source) ==
+         CLEX_STATUS_OK);
+  size_t streamProduced = 0;
+  assert(clexTokenizeBatch(lexer, batch, 4, &streamProduced) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(strlen(token.lexeme) == longLength);
+  assert(token.span.end.offset == longLength);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == SEMICOL);
+  assert(token.span.start.offset == longLength + 1);
+  assert(token.span.start.column == longLength + 2);
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+  assert(lexer->window_capacity == 2 * CLEX_STREAM_WINDOW);
+  free(longSource);
+
+  source.piece = 0;
+  source.offset = 0;
+  assert(clexResetWithReader(lexer, readStringSource, &source) ==
+         CLEX_STATUS_OK);
+  assert(clex(lexer, &token) == CLEX_STATUS_IO_ERROR);
+  assert(clexGetLastError(lexer)->status == CLEX_STATUS_IO_ERROR);
+
+  assert(clexResetWithFd(lexer, -1) == CLEX_STATUS_INVALID_ARGUMENT);
+#ifndef _WIN32
+  int fds[2];
+  assert(pipe(fds) == 0);
+  assert(write(fds[1], "break ident1 ;", 14) == 14);
+  close(fds[1]);
+  assert(clexResetWithFd(lexer, fds[0]) == CLEX_STATUS_OK);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == BREAK);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER);
+  assert(token.span.start.offset == 6);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == SEMICOL);
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+  close(fds[0]);
+
+  char path[] = "/tmp/clexXXXXXX";
+  int fileFd = mkstemp(path);
+  assert(fileFd >= 0);
+  assert(write(fileFd, "auto\n  x1;", 10) == 10);
+  close(fileFd);
+  assert(clexResetFromFile(lexer, path) == CLEX_STATUS_OK);
+  assert(lexer->mapping != NULL);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == AUTO);
+  assert(clexView(lexer, &view) == CLEX_STATUS_OK);
+  assert(view.kind == IDENTIFIER);
+  assert(view.lexeme == (const char*)lexer->mapping + 7);
+  assert(view.span.start.line == 2);
+  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == SEMICOL);
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+  clexReset(lexer, "auto");
+  assert(lexer->mapping == NULL);
+  fileFd = open(path, O_WRONLY | O_TRUNC);
+  assert(fileFd >= 0);
+  close(fileFd);
+  assert(clexResetFromFile(lexer, path) == CLEX_STATUS_OK);
+  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
+  unlink(path);
+  assert(clexResetFromFile(lexer, path) == CLEX_STATUS_IO_ERROR);
+  assert(clexResetFromFile(lexer, NULL) == CLEX_STATUS_INVALID_ARGUMENT);
+#endif
+
   clexDeleteKinds(lexer);
 
   clexRegisterKind(lexer, "auto", AUTO);
@@ -286,94 +583,553 @@ int main(void) {
   fclose(f);
   */
 
-  clexReset(lexer, "int main(int argc, char *argv[]) {\nreturn 23;\n}");
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == INT);
-  assert(strcmp(token.lexeme, "int") == 0);
-  assert(token.span.start.line == 1);
-  assert(token.span.start.column == 1);
-  assert(token.span.end.line == 1);
-  assert(token.span.end.column == 4);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == IDENTIFIER);
-  assert(strcmp(token.lexeme, "main") == 0);
-  assert(token.span.start.line == 1);
-  assert(token.span.start.column == 5);
-  assert(token.span.end.column == 9);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == OPARAN);
-  assert(strcmp(token.lexeme, "(") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == INT);
-  assert(strcmp(token.lexeme, "int") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == IDENTIFIER);
-  assert(strcmp(token.lexeme, "argc") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == COMMA);
-  assert(strcmp(token.lexeme, ",") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == CHAR);
-  assert(strcmp(token.lexeme, "char") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == STAR);
-  assert(strcmp(token.lexeme, "*") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == IDENTIFIER);
-  assert(strcmp(token.lexeme, "argv") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == OSQUAREBRACE);
-  assert(strcmp(token.lexeme, "[") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == CSQUAREBRACE);
-  assert(strcmp(token.lexeme, "]") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == CPARAN);
-  assert(strcmp(token.lexeme, ")") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == OCURLYBRACE);
-  assert(strcmp(token.lexeme, "{") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
+  expectCProgram(lexer);
+
+  assert(clexSetEngine(lexer, CLEX_ENGINE_DFA) == CLEX_STATUS_OK);
+  expectCProgram(lexer);
+
+  assert(clexSetEngine(lexer, CLEX_ENGINE_LAZY_DFA) == CLEX_STATUS_OK);
+  expectCProgram(lexer);
+  assert(clexLazyDfaFlushCount(lexer->lazy_dfa) == 0);
+  assert(clexSetDfaCacheBudget(lexer, 1) == CLEX_STATUS_OK);
+  expectCProgram(lexer);
+  expectCProgram(lexer);
+  assert(clexLazyDfaFlushCount(lexer->lazy_dfa) > 0);
+  assert(clexLazyDfaStateCount(lexer->lazy_dfa) <= 3);
+
+  const char* unit = "int main(int argc, char *argv[]) {\nreturn 23;\n}\n";
+  size_t unitLength = strlen(unit);
+  size_t largeLength = unitLength * 6000;
+  char* large = malloc(largeLength + 1);
+  assert(large != NULL);
+  for (size_t i = 0; i < 6000; i++) {
+    memcpy(large + i * unitLength, unit, unitLength);
+  }
+  large[largeLength] = '\0';
+  for (int round = 0; round < 2; round++) {
+    if (round == 1) large[largeLength - 100] = '$';
+    clexEngine engine = round ? CLEX_ENGINE_LAZY_DFA : CLEX_ENGINE_DFA;
+    assert(clexSetEngine(lexer, engine) == CLEX_STATUS_OK);
+    clexResetWithLength(lexer, large, largeLength);
+    clexTokenView* serial = malloc(120000 * sizeof(clexTokenView));
+    size_t serialCount = 0;
+    clexStatus serialStatus =
+        clexTokenizeBatch(lexer, serial, 120000, &serialCount);
+    clexSourcePosition serialError = clexGetLastError(lexer)->position;
+    size_t serialExpected = clexGetLastError(lexer)->expected_kind_count;
+    size_t serialPosition = lexer->position;
+    clexResetWithLength(lexer, large, largeLength);
+    clexTokenView* parallel = NULL;
+    size_t parallelCount = 0;
+    clexStatus parallelStatus =
+        clexTokenizeParallel(lexer, 4, &parallel, &parallelCount);
+    assert(serialStatus ==
+           (round ? CLEX_STATUS_LEXICAL_ERROR : CLEX_STATUS_EOF));
+    assert(parallelStatus ==
+           (round ? CLEX_STATUS_LEXICAL_ERROR : CLEX_STATUS_OK));
+    assert(parallelCount == serialCount);
+    assert(serialCount == 6000 * 17 - (round ? 36 : 0));
+    assert(lexer->position == serialPosition);
+    for (size_t i = 0; i < serialCount; i++) {
+      assert(parallel[i].kind == serial[i].kind);
+      assert(parallel[i].lexeme == serial[i].lexeme);
+      assert(parallel[i].length == serial[i].length);
+      assert(memcmp(&parallel[i].span, &serial[i].span,
+                    sizeof(clexSourceSpan)) == 0);
+    }
+    if (round == 1) {
+      const clexError* error = clexGetLastError(lexer);
+      assert(memcmp(&error->position, &serialError,
+                    sizeof(clexSourcePosition)) == 0);
+      assert(strcmp(error->offending_lexeme, "$") == 0);
+      assert(error->expected_kind_count == serialExpected);
+    }
+    free(serial);
+    free(parallel);
+  }
+
+  // A lexer without rules reports that on the parallel path too, and stays
+  // that way for later calls.
+  clexLexer* noRules = clexInit();
+  clexResetWithLength(noRules, large, largeLength);
+  clexTokenView* noRuleViews = NULL;
+  size_t noRuleCount = 0;
+  assert(clexTokenizeParallel(noRules, 4, &noRuleViews, &noRuleCount) ==
+         CLEX_STATUS_NO_RULES);
+  assert(noRuleCount == 0);
+  free(noRuleViews);
+  clexTokenView noRuleView;
+  assert(clexView(noRules, &noRuleView) == CLEX_STATUS_NO_RULES);
+  clexLexerDestroy(noRules);
+  free(large);
+
+  assert(clexSetEngine(lexer, CLEX_ENGINE_NFA) == CLEX_STATUS_OK);
+  clexRuleSet* ruleSet = NULL;
+  assert(clexRuleSetCompile(lexer, &ruleSet) == CLEX_STATUS_OK);
+  assert(clexRuleSetRuleCount(ruleSet) == 95);
+  clexLexer* first = clexInitWithRuleSet(ruleSet);
+  clexLexer* second = clexInitWithRuleSet(ruleSet);
+  assert(first != NULL && second != NULL);
+  assert(first->engine == CLEX_ENGINE_NFA);
+  assert(clexRegisterKind(first, "x", IDENTIFIER) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexSetEngine(first, CLEX_ENGINE_DFA) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  clexReset(second, "return");
+  assert(clex(second, &token) == CLEX_STATUS_OK);
   assert(token.kind == RETURN);
-  assert(strcmp(token.lexeme, "return") == 0);
-  assert(token.span.start.line == 2);
-  assert(token.span.start.column == 1);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == CONSTANT);
-  assert(strcmp(token.lexeme, "23") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == SEMICOL);
-  assert(strcmp(token.lexeme, ";") == 0);
-
-  assert(clex(lexer, &token) == CLEX_STATUS_OK);
-  assert(token.kind == CCURLYBRACE);
-  assert(strcmp(token.lexeme, "}") == 0);
+  expectCProgram(first);
+  assert(clex(second, &token) == CLEX_STATUS_EOF);
+  assert(clexSetEngine(second, CLEX_ENGINE_LAZY_DFA) == CLEX_STATUS_OK);
+  expectCProgram(second);
+  clexLexerDestroy(first);
+  clexLexerDestroy(second);
+  clexRuleSetDestroy(ruleSet);
+
+  size_t builtStates = 0;
+  size_t minimizedStates = 0;
+  assert(clexRuleSetCompile(lexer, &ruleSet) == CLEX_STATUS_OK);
+  assert(clexRuleSetDfaStateCount(ruleSet, &builtStates, &minimizedStates) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  clexRuleSetDestroy(ruleSet);
+
+  assert(clexSetEngine(lexer, CLEX_ENGINE_DFA) == CLEX_STATUS_OK);
+  assert(clexRuleSetCompile(lexer, &ruleSet) == CLEX_STATUS_OK);
+  assert(clexRuleSetDfaStateCount(ruleSet, &builtStates, &minimizedStates) ==
+         CLEX_STATUS_OK);
+  assert(minimizedStates > 2 && minimizedStates <= builtStates);
+  clexLexerDestroy(lexer);
+  lexer = clexInitWithRuleSet(ruleSet);
+  assert(lexer->engine == CLEX_ENGINE_DFA);
+  expectCProgram(lexer);
+#ifndef _WIN32
+  char blobPath[] = "/tmp/clexXXXXXX";
+  int blobFd = mkstemp(blobPath);
+  assert(blobFd >= 0);
+  close(blobFd);
+  assert(clexRuleSetSave(ruleSet, blobPath) == CLEX_STATUS_OK);
+  clexRuleSet* loaded = NULL;
+  assert(clexRuleSetLoad(blobPath, &loaded) == CLEX_STATUS_OK);
+  assert(clexRuleSetRuleCount(loaded) == clexRuleSetRuleCount(ruleSet));
+  size_t loadedStates = 0;
+  assert(clexRuleSetDfaStateCount(loaded, NULL, &loadedStates) ==
+         CLEX_STATUS_OK);
+  assert(loadedStates == minimizedStates);
+  clexLexer* fromBlob = clexInitWithRuleSet(loaded);
+  assert(fromBlob->engine == CLEX_ENGINE_DFA);
+  assert(clexSetEngine(fromBlob, CLEX_ENGINE_NFA) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  expectCProgram(fromBlob);
+  clexRuleProfile loadedProfile;
+  size_t loadedOrder[1];
+  assert(clexSetProfiling(fromBlob, true) == CLEX_STATUS_UNSUPPORTED);
+  assert(clexGetRuleProfile(fromBlob, 0, &loadedProfile) ==
+         CLEX_STATUS_UNSUPPORTED);
+  assert(clexProfileSchedule(fromBlob, loadedOrder, 1) ==
+         CLEX_STATUS_UNSUPPORTED);
+  assert(clexSetProfiling(fromBlob, false) == CLEX_STATUS_OK);
+  clexLexerDestroy(fromBlob);
+  clexRuleSetDestroy(loaded);
+
+  blobFd = open(blobPath, O_WRONLY);
+  assert(blobFd >= 0);
+  assert(write(blobFd, "CLEXRSEX", 8) == 8);
+  close(blobFd);
+  assert(clexRuleSetLoad(blobPath, &loaded) == CLEX_STATUS_INVALID_FORMAT);
+  assert(loaded == NULL);
+  unlink(blobPath);
+  assert(clexRuleSetLoad(blobPath, &loaded) == CLEX_STATUS_IO_ERROR);
+#endif
+  clexDeleteKinds(lexer);
+  clexReset(lexer, "int");
+  assert(clex(lexer, &token) == CLEX_STATUS_NO_RULES);
+  clexRuleSetDestroy(ruleSet);
+
+  // The rule array grows as needed, well past the old 1024-rule limit.
+  // Rule i matches "k" followed by i written in three base-26 letters.
+  size_t manyCount = 1500;
+  char (*manyRules)[5] = malloc(manyCount * sizeof(*manyRules));
+  assert(manyRules);
+  clexLexer* manyLexer = clexInit();
+  for (size_t i = 0; i < manyCount; i++) {
+    manyRules[i][0] = 'k';
+    manyRules[i][1] = (char)('a' + i / 676 % 26);
+    manyRules[i][2] = (char)('a' + i / 26 % 26);
+    manyRules[i][3] = (char)('a' + i % 26);
+    manyRules[i][4] = '\0';
+    assert(clexRegisterKind(manyLexer, manyRules[i], (int)i) ==
+           CLEX_STATUS_OK);
+  }
+  assert(manyLexer->rule_count == manyCount);
+  clexReset(manyLexer, "kaah kcfr");
+  assert(clex(manyLexer, &token) == CLEX_STATUS_OK && token.kind == 7);
+  assert(clex(manyLexer, &token) == CLEX_STATUS_OK && token.kind == 1499);
+  assert(clex(manyLexer, &token) == CLEX_STATUS_EOF);
+  clexDeleteKinds(manyLexer);
+  assert(manyLexer->rule_count == 0);
+  // With its rules deleted the lexer keeps the array but has nothing to
+  // compile or run, whichever engine it uses.
+  clexRuleSet* emptySet = NULL;
+  assert(clexRuleSetCompile(manyLexer, &emptySet) == CLEX_STATUS_NO_RULES);
+  assert(emptySet == NULL);
+  const clexEngine emptyEngines[] = {CLEX_ENGINE_NFA, CLEX_ENGINE_DFA,
+                                     CLEX_ENGINE_LAZY_DFA};
+  for (int i = 0; i < 3; i++) {
+    assert(clexSetEngine(manyLexer, emptyEngines[i]) == CLEX_STATUS_OK);
+    clexReset(manyLexer, "kaah");
+    assert(clex(manyLexer, &token) == CLEX_STATUS_NO_RULES);
+  }
+  clexLexerDestroy(manyLexer);
+  free(manyRules);
+
+  // One rule with thousands of alternatives builds long epsilon chains; its
+  // closures are walked while matching instead of being tabulated.
+  // Alternative i is "k" followed by i in decimal.
+  size_t unionCount = 8000;
+  char* unionRule = malloc(unionCount * 7 + 1);
+  assert(unionRule);
+  size_t unionLength = 0;
+  for (size_t i = 0; i < unionCount; i++) {
+    if (i) unionRule[unionLength++] = '|';
+    unionRule[unionLength++] = 'k';
+    size_t digits = 1;
+    for (size_t rest = i / 10; rest; rest /= 10) digits++;
+    for (size_t d = digits, rest = i; d-- > 0; rest /= 10)
+      unionRule[unionLength + d] = (char)('0' + rest % 10);
+    unionLength += digits;
+  }
+  unionRule[unionLength] = '\0';
+  clexLexer* unionLexer = clexInit();
+  assert(clexRegisterKind(unionLexer, unionRule, IDENTIFIER) ==
+         CLEX_STATUS_OK);
+  clexReset(unionLexer, "k7999 k0 k42");
+  assert(clex(unionLexer, &token) == CLEX_STATUS_OK);
+  assert(token.kind == IDENTIFIER && strcmp(token.lexeme, "k7999") == 0);
+  assert(clex(unionLexer, &token) == CLEX_STATUS_OK);
+  assert(strcmp(token.lexeme, "k0") == 0);
+  assert(clex(unionLexer, &token) == CLEX_STATUS_OK);
+  assert(strcmp(token.lexeme, "k42") == 0);
+  assert(clex(unionLexer, &token) == CLEX_STATUS_EOF);
+  clexReset(unionLexer, "x");
+  assert(clex(unionLexer, &token) == CLEX_STATUS_LEXICAL_ERROR);
+  clexLexerDestroy(unionLexer);
+  free(unionRule);
+
+  // Literal rules are matched through a hash table but keep rule order for
+  // ties: "while" is registered before the identifier rule, "if" after it.
+  clexLexer* literalLexer = clexInit();
+  clexRegisterKind(literalLexer, "while", WHILE);
+  clexRegisterKind(literalLexer, "[a-z]+", IDENTIFIER);
+  clexRegisterKind(literalLexer, "if", IF);
+  clexRegisterKind(literalLexer, ">>", RIGHT_OP);
+  clexRegisterKind(literalLexer, ">>=", RIGHT_ASSIGN);
+  clexRegisterKind(literalLexer, "\\+\\+", INC_OP);
+  clexRegisterKind(literalLexer, "\\+\\+", ADD_ASSIGN);
+  const int literalKinds[] = {WHILE, IDENTIFIER, IDENTIFIER, RIGHT_ASSIGN,
+                              RIGHT_OP, INC_OP, IDENTIFIER};
+  for (int engine = 0; engine < 2; engine++) {
+    assert(clexSetEngine(literalLexer, engine ? CLEX_ENGINE_DFA
+                                              : CLEX_ENGINE_NFA) ==
+           CLEX_STATUS_OK);
+    clexReset(literalLexer, "while whilex if >>= >> ++ iff");
+    for (size_t i = 0; i < sizeof(literalKinds) / sizeof(int); i++) {
+      assert(clex(literalLexer, &token) == CLEX_STATUS_OK);
+      assert(token.kind == literalKinds[i]);
+    }
+    assert(clex(literalLexer, &token) == CLEX_STATUS_EOF);
+  }
+  clexLexerDestroy(literalLexer);
+
+  // Indentation runs longer than a vector block, mixed with every whitespace
+  // byte; positions are checked against a byte-by-byte walk.
+  clexLexer* spaceLexer = clexInit();
+  clexRegisterKind(spaceLexer, "[a-z]+", IDENTIFIER);
+  const char spaceBytes[] = " \t\n\v\f\r";
+  size_t spaceLength = 0;
+  char* spaceInput = malloc(64 * 1024);
+  assert(spaceInput != NULL);
+  for (size_t i = 0; i < 400; i++) {
+    size_t indent = 1 + (i * 37) % 90;
+    for (size_t j = 0; j < indent; j++)
+      spaceInput[spaceLength++] =
+          j % 9 == 4 ? spaceBytes[(i + j) % 6] : (j % 3 ? ' ' : '\t');
+    size_t word = 1 + (i * 13) % 45;
+    for (size_t j = 0; j < word; j++) spaceInput[spaceLength++] = 'a' + j % 26;
+  }
+  clexResetWithLength(spaceLexer, spaceInput, spaceLength);
+  clexSourcePosition spacePosition = {0, 1, 1};
+  for (size_t i = 0; i < 400; i++) {
+    while (strchr(" \t\n\v\f\r", spaceInput[spacePosition.offset])) {
+      if (spaceInput[spacePosition.offset] == '\n') {
+        spacePosition.line++;
+        spacePosition.column = 1;
+      } else {
+        spacePosition.column++;
+      }
+      spacePosition.offset++;
+    }
+    clexTokenView view;
+    assert(clexView(spaceLexer, &view) == CLEX_STATUS_OK);
+    assert(view.kind == IDENTIFIER);
+    assert(view.length == 1 + (i * 13) % 45);
+    assert(view.span.start.offset == spacePosition.offset);
+    assert(view.span.start.line == spacePosition.line);
+    assert(view.span.start.column == spacePosition.column);
+    spacePosition.offset += view.length;
+    spacePosition.column += view.length;
+  }
+  clexTokenView spaceEnd;
+  assert(clexView(spaceLexer, &spaceEnd) == CLEX_STATUS_EOF);
+  free(spaceInput);
+  clexLexerDestroy(spaceLexer);
+
+  clexLexer* statsLexer = clexInit();
+  clexRegisterKind(statsLexer, "while", WHILE);
+  clexRegisterKind(statsLexer, "[a-z]+", IDENTIFIER);
+  clexRegisterKind(statsLexer, "[0-9]+", CONSTANT);
+  clexStats stats;
+  clexTokenView statsView;
+  clexReset(statsLexer, "while abc $ ab");
+  while (clexView(statsLexer, &statsView) != CLEX_STATUS_EOF) {
+  }
+#if defined(CLEX_ENABLE_STATS)
+  assert(clexGetStats(statsLexer, &stats) == CLEX_STATUS_OK);
+  assert(stats.tokens == 3);
+  assert(stats.lexical_errors == 1);
+  assert(stats.bytes == 14);
+  assert(stats.whitespace_bytes == 3);
+  // One literal lookup per attempt, then only the rules that can start with
+  // the first byte: none for "$", the identifier rule for the rest.
+  assert(stats.rule_tests == 4 + 1 + 1 + 0 + 1);
+  assert(stats.automaton_steps == 5 + 3 + 2);
+  assert(stats.prefix_retries == 0);
+  // The rule set built on first use (itself, three compiled rules and the
+  // literal table), the NFA scratch, then the error's offending lexeme and
+  // its three expected kinds.
+  assert(stats.allocations == 5 + 1 + 4);
+  assert(stats.rule_count == 3);
+  assert(stats.rule_hits[0] == 1);
+  assert(stats.rule_hits[1] == 2);
+  assert(stats.rule_hits[2] == 0);
+
+  // "abc" is a live prefix of "abcd", so the DFA reads it before falling back
+  // to the one-byte match.
+  clexDeleteKinds(statsLexer);
+  clexRegisterKind(statsLexer, "abcd", IDENTIFIER);
+  clexRegisterKind(statsLexer, "[a-z]", CONSTANT);
+  assert(clexSetEngine(statsLexer, CLEX_ENGINE_DFA) == CLEX_STATUS_OK);
+  clexResetStats(statsLexer);
+  clexReset(statsLexer, "abcx");
+  while (clexView(statsLexer, &statsView) != CLEX_STATUS_EOF) {
+  }
+  assert(clexGetStats(statsLexer, &stats) == CLEX_STATUS_OK);
+  assert(stats.tokens == 4);
+  assert(stats.rule_tests == 4);
+  assert(stats.automaton_steps == 6);
+  assert(stats.prefix_retries == 1);
+  assert(stats.rule_count == 2);
+  assert(stats.rule_hits[0] == 0);
+  assert(stats.rule_hits[1] == 4);
+  clexResetStats(statsLexer);
+  assert(clexGetStats(statsLexer, &stats) == CLEX_STATUS_OK);
+  assert(stats.tokens == 0 && stats.rule_hits[1] == 0);
+
+  // The lazy DFA counts itself and then every time its cache grows.
+  assert(clexSetEngine(statsLexer, CLEX_ENGINE_LAZY_DFA) == CLEX_STATUS_OK);
+  clexReset(statsLexer, "abcd abcx abcd");
+  while (clexView(statsLexer, &statsView) != CLEX_STATUS_EOF) {
+  }
+  assert(clexGetStats(statsLexer, &stats) == CLEX_STATUS_OK);
+  assert(stats.allocations > 1);
+
+  // Parallel lexing counts its chunk table, worker lexers, thread handles,
+  // result array and the workers' own token buffers and scratch.
+  size_t parallelLength = 5 * CLEX_PARALLEL_MIN_CHUNK;
+  char* parallelInput = malloc(parallelLength + 1);
+  assert(parallelInput != NULL);
+  for (size_t i = 0; i < parallelLength; i++)
+    parallelInput[i] = i % 5 == 4 ? ' ' : 'a';
+  parallelInput[parallelLength] = '\0';
+  assert(clexSetEngine(statsLexer, CLEX_ENGINE_NFA) == CLEX_STATUS_OK);
+  clexResetStats(statsLexer);
+  clexResetWithLength(statsLexer, parallelInput, parallelLength);
+  clexTokenView* parallelViews = NULL;
+  size_t parallelCount = 0;
+  assert(clexTokenizeParallel(statsLexer, 2, &parallelViews,
+                              &parallelCount) == CLEX_STATUS_OK);
+  assert(parallelCount == parallelLength / 5 * 4);
+  assert(clexGetStats(statsLexer, &stats) == CLEX_STATUS_OK);
+  assert(stats.tokens == parallelCount);
+  assert(stats.allocations >= 1 + 2 + 2 + 1 + 2 + 2);
+  free(parallelViews);
+  free(parallelInput);
+#else
+  assert(clexGetStats(statsLexer, &stats) == CLEX_STATUS_UNSUPPORTED);
+  assert(stats.tokens == 0 && stats.rule_hits == NULL);
+#endif
+  assert(clexGetStats(NULL, &stats) == CLEX_STATUS_INVALID_ARGUMENT);
+  clexLexerDestroy(statsLexer);
+
+  // Identifiers are the most common full-chunk match, so profiling moves
+  // their rule ahead of "[a-z]+[0-9]", which starts with the same bytes;
+  // "[a-z_]+" overlaps it and has to stay behind.
+  clexLexer* profileLexer = clexInit();
+  clexRegisterKind(profileLexer, "[a-z]+[0-9]", CONSTANT);
+  clexRegisterKind(profileLexer, "\\+", PLUS);
+  clexRegisterKind(profileLexer, "[a-z]+", IDENTIFIER);
+  clexRegisterKind(profileLexer, "[a-z_]+", STRINGLITERAL);
+  const char* profileInput = "abc def x1 a_b ghi + y7 jkl mno";
+  const int profileKinds[] = {IDENTIFIER, IDENTIFIER, CONSTANT, STRINGLITERAL,
+                              IDENTIFIER, PLUS,       CONSTANT, IDENTIFIER,
+                              IDENTIFIER};
+  clexRuleProfile profile;
+  assert(clexGetRuleProfile(profileLexer, 2, &profile) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexSetEngine(profileLexer, CLEX_ENGINE_DFA) == CLEX_STATUS_OK);
+  assert(clexSetProfiling(profileLexer, true) == CLEX_STATUS_UNSUPPORTED);
+  assert(clexSetEngine(profileLexer, CLEX_ENGINE_NFA) == CLEX_STATUS_OK);
+  assert(clexSetProfiling(profileLexer, true) == CLEX_STATUS_OK);
+  clexReset(profileLexer, profileInput);
+  for (size_t i = 0; i < sizeof(profileKinds) / sizeof(int); i++) {
+    assert(clex(profileLexer, &token) == CLEX_STATUS_OK);
+    assert(token.kind == profileKinds[i]);
+  }
+  assert(clex(profileLexer, &token) == CLEX_STATUS_EOF);
+  assert(clexGetRuleProfile(profileLexer, 2, &profile) == CLEX_STATUS_OK);
+  assert(profile.tests == 6);
+  assert(profile.matches == 6);
+  assert(profile.full_matches == 5);
+  assert(clexGetRuleProfile(profileLexer, 0, &profile) == CLEX_STATUS_OK);
+  assert(profile.tests == 8);
+  assert(profile.full_matches == 2);
+  assert(profile.failure_depth == 16);
+  assert(clexGetRuleProfile(profileLexer, 1, &profile) == CLEX_STATUS_OK);
+  assert(profile.tests == 0);
+  assert(clexGetRuleProfile(profileLexer, 4, &profile) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexSetEngine(profileLexer, CLEX_ENGINE_LAZY_DFA) == CLEX_STATUS_OK);
+  assert(clexGetRuleProfile(profileLexer, 2, &profile) ==
+         CLEX_STATUS_UNSUPPORTED);
+  assert(clexSetEngine(profileLexer, CLEX_ENGINE_NFA) == CLEX_STATUS_OK);
+
+  size_t schedule[4];
+  assert(clexProfileSchedule(profileLexer, schedule, 3) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexProfileSchedule(profileLexer, schedule, 4) == CLEX_STATUS_OK);
+  assert(schedule[0] == 2 && schedule[1] == 3 && schedule[2] == 0 &&
+         schedule[3] == 1);
+  const size_t swapped[4] = {3, 2, 0, 1};
+  const size_t repeated[4] = {2, 2, 0, 1};
+  assert(clexSetRuleSchedule(profileLexer, swapped, 4) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexSetRuleSchedule(profileLexer, repeated, 4) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexSetRuleSchedule(profileLexer, schedule, 3) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  assert(clexSetRuleSchedule(profileLexer, schedule, 4) == CLEX_STATUS_OK);
+  assert(clexSetProfiling(profileLexer, false) == CLEX_STATUS_OK);
+  // Input that never reaches a rule leaves an all-zero profile, and the
+  // schedule built from it is registration order.
+  clexLexer* idleLexer = clexInit();
+  clexRegisterKind(idleLexer, "[a-z]+", IDENTIFIER);
+  clexRegisterKind(idleLexer, "\\+", PLUS);
+  assert(clexSetProfiling(idleLexer, true) == CLEX_STATUS_OK);
+  const char* idleInputs[] = {"", " \n\t "};
+  for (int i = 0; i < 2; i++) {
+    clexReset(idleLexer, idleInputs[i]);
+    assert(clex(idleLexer, &token) == CLEX_STATUS_EOF);
+    assert(clexGetRuleProfile(idleLexer, 1, &profile) == CLEX_STATUS_OK);
+    assert(profile.tests == 0 && profile.matches == 0);
+    assert(clexGetRuleProfile(idleLexer, 2, &profile) ==
+           CLEX_STATUS_INVALID_ARGUMENT);
+    size_t idleOrder[2] = {7, 7};
+    assert(clexProfileSchedule(idleLexer, idleOrder, 2) == CLEX_STATUS_OK);
+    assert(idleOrder[0] == 0 && idleOrder[1] == 1);
+    assert(clexSetRuleSchedule(idleLexer, idleOrder, 2) == CLEX_STATUS_OK);
+  }
+  clexLexerDestroy(idleLexer);
+
+  // A lexer without rules has nothing to schedule and keeps saying so.
+  clexLexer* unscheduled = clexInit();
+  assert(clexSetRuleSchedule(unscheduled, schedule, 0) ==
+         CLEX_STATUS_NO_RULES);
+  clexReset(unscheduled, profileInput);
+  assert(clex(unscheduled, &token) == CLEX_STATUS_NO_RULES);
+  clexLexerDestroy(unscheduled);
+
+  clexRuleSet* scheduledSet = NULL;
+  assert(clexRuleSetCompile(profileLexer, &scheduledSet) == CLEX_STATUS_OK);
+  clexLexer* scheduledCursor = clexInitWithRuleSet(scheduledSet);
+  assert(clexSetRuleSchedule(scheduledCursor, schedule, 4) ==
+         CLEX_STATUS_INVALID_ARGUMENT);
+  clexLexer* scheduledLexers[2] = {profileLexer, scheduledCursor};
+  for (int l = 0; l < 2; l++) {
+    clexReset(scheduledLexers[l], profileInput);
+    for (size_t i = 0; i < sizeof(profileKinds) / sizeof(int); i++) {
+      assert(clex(scheduledLexers[l], &token) == CLEX_STATUS_OK);
+      assert(token.kind == profileKinds[i]);
+    }
+    assert(clex(scheduledLexers[l], &token) == CLEX_STATUS_EOF);
+  }
+  clexLexerDestroy(scheduledCursor);
+  clexRuleSetDestroy(scheduledSet);
+
+  // Workers of a parallel run profile their chunks and the calling lexer
+  // adds them up, so the result matches a serial run.
+  size_t profileUnit = strlen(profileInput) + 1;
+  size_t profileRepeat = 3 * CLEX_PARALLEL_MIN_CHUNK / profileUnit;
+  char* profileLarge = malloc(profileRepeat * profileUnit + 1);
+  assert(profileLarge != NULL);
+  for (size_t i = 0; i < profileRepeat; i++) {
+    memcpy(profileLarge + i * profileUnit, profileInput, profileUnit - 1);
+    profileLarge[(i + 1) * profileUnit - 1] = '\n';
+  }
+  profileLarge[profileRepeat * profileUnit] = '\0';
+  clexLexer* profiledRuns[2];
+  for (int run = 0; run < 2; run++) {
+    profiledRuns[run] = clexInit();
+    clexRegisterKind(profiledRuns[run], "[a-z]+[0-9]", CONSTANT);
+    clexRegisterKind(profiledRuns[run], "\\+", PLUS);
+    clexRegisterKind(profiledRuns[run], "[a-z]+", IDENTIFIER);
+    clexRegisterKind(profiledRuns[run], "[a-z_]+", STRINGLITERAL);
+    assert(clexSetProfiling(profiledRuns[run], true) == CLEX_STATUS_OK);
+    clexResetWithLength(profiledRuns[run], profileLarge,
+                        profileRepeat * profileUnit);
+    clexTokenView* runViews = NULL;
+    size_t runCount = 0;
+    assert(clexTokenizeParallel(profiledRuns[run], run ? 4 : 1, &runViews,
+                                &runCount) == CLEX_STATUS_OK);
+    assert(runCount == profileRepeat * 9);
+    free(runViews);
+  }
+  for (size_t rule = 0; rule < 4; rule++) {
+    clexRuleProfile serialProfile;
+    clexRuleProfile parallelProfile;
+    assert(clexGetRuleProfile(profiledRuns[0], rule, &serialProfile) ==
+           CLEX_STATUS_OK);
+    assert(clexGetRuleProfile(profiledRuns[1], rule, &parallelProfile) ==
+           CLEX_STATUS_OK);
+    assert(memcmp(&serialProfile, &parallelProfile,
+                  sizeof(clexRuleProfile)) == 0);
+  }
+  clexRuleProfile largeProfile;
+  assert(clexGetRuleProfile(profiledRuns[1], 2, &largeProfile) ==
+         CLEX_STATUS_OK);
+  assert(largeProfile.tests == profileRepeat * 6);
+  clexLexerDestroy(profiledRuns[0]);
+  clexLexerDestroy(profiledRuns[1]);
+  free(profileLarge);
+  clexLexerDestroy(profileLexer);
 
-  assert(clex(lexer, &token) == CLEX_STATUS_EOF);
   clexTokenClear(&token);
-  assert(token.lexeme == NULL);
+  clexLexerDestroy(lexer);
 }
 #endif
 
 #ifdef TEST_REGEX
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -574,6 +1330,207 @@ int main(void) {
   clexNfaDestroy(nfa, NULL);
   free(longInput);
 
+  nfa = clexNfaFromRe("a(bc)*", NULL);
+  assert(clexNfaLongestMatch(nfa, "abcbcbd", 7) == 5);
+  assert(clexNfaLongestMatch(nfa, "abcbcbd", 4) == 3);
+  assert(clexNfaLongestMatch(nfa, "xa", 2) == 0);
+  clexNfaDestroy(nfa, NULL);
+
+  nfa = clexNfaFromRe("a(b|c)*d", NULL);
+  clexCompiledNfa* optimized = clexNfaCompile(nfa);
+  assert(clexCompiledNfaSourceNodeCount(optimized) == 10);
+  assert(clexCompiledNfaNodeCount(optimized) == 3);
+  clexNfaScratch* scratch =
+      clexNfaScratchCreate(clexCompiledNfaNodeCount(optimized));
+  assert(clexCompiledNfaLongestMatch(optimized, scratch, "abcbd!", 6) == 5);
+  assert(clexCompiledNfaLongestMatch(optimized, scratch, "ad", 2) == 2);
+  assert(clexCompiledNfaLongestMatch(optimized, scratch, "abb", 3) == 0);
+  clexNfaScratchDestroy(scratch);
+  clexCompiledNfaDestroy(optimized);
+  clexNfaDestroy(nfa, NULL);
+
+  clexNode* dfaNfas[2] = {clexNfaFromRe("if", NULL),
+                          clexNfaFromRe("[a-z]+", NULL)};
+  const clexCompiledNfa* dfaRules[2] = {clexNfaCompile(dfaNfas[0]),
+                                        clexNfaCompile(dfaNfas[1])};
+  assert(clexCompiledNfaNodeCount(dfaRules[0]) == 3);
+  scratch = clexNfaScratchCreate(clexCompiledNfaNodeCount(dfaRules[1]));
+  assert(clexCompiledNfaLongestMatch(dfaRules[1], scratch, "abc1", 4) == 3);
+  clexNfaScratchDestroy(scratch);
+  clexDfa* dfa = clexDfaBuild(dfaRules, 2);
+  assert(dfa != NULL);
+  assert(clexDfaClassCount(dfa) == 7);
+  size_t matchLength = 0;
+  assert(clexDfaMatch(dfa, "if(", 3, &matchLength) == 0);
+  assert(matchLength == 2);
+  assert(clexDfaMatch(dfa, "iffy", 4, &matchLength) == 1);
+  assert(matchLength == 4);
+  assert(clexDfaMatch(dfa, "iffy", 1, &matchLength) == 1);
+  assert(matchLength == 1);
+  assert(clexDfaMatch(dfa, "9if", 3, &matchLength) == -1);
+  assert(matchLength == 0);
+  clexDfaDestroy(dfa);
+
+  clexLazyDfa* lazy = clexLazyDfaCreate(dfaRules, 2, 1 << 16);
+  assert(lazy != NULL);
+  int lazyRule = 0;
+  assert(clexLazyDfaStateCount(lazy) == 2);
+  assert(clexLazyDfaMatch(lazy, "iffy", 4, &lazyRule, &matchLength));
+  assert(lazyRule == 1);
+  assert(matchLength == 4);
+  assert(clexLazyDfaMatch(lazy, "if(", 3, &lazyRule, &matchLength));
+  assert(lazyRule == 0);
+  assert(matchLength == 2);
+  assert(clexLazyDfaStateCount(lazy) > 2);
+  clexLazyDfaDestroy(lazy);
+  for (int i = 0; i < 2; i++) {
+    clexCompiledNfaDestroy((clexCompiledNfa*)dfaRules[i]);
+    clexNfaDestroy(dfaNfas[i], NULL);
+  }
+
+  dfaNfas[0] = clexNfaFromRe("[\x80-\xff]+", NULL);
+  dfaRules[0] = clexNfaCompile(dfaNfas[0]);
+  dfa = clexDfaBuild(dfaRules, 1);
+  assert(dfa != NULL);
+  assert(clexDfaMatch(dfa, "\xc3\xa9x", 3, &matchLength) == 0);
+  assert(matchLength == 2);
+  assert(clexNfaLongestMatch(dfaNfas[0], "\xc3\xa9x", 3) == 2);
+  clexDfaDestroy(dfa);
+  clexCompiledNfaDestroy((clexCompiledNfa*)dfaRules[0]);
+  clexNfaDestroy(dfaNfas[0], NULL);
+
+  // After "a" and after "x" the same rule wins on every continuation.
+  const char* minimizeRes[3] = {"[a-z]+", "[0-9]+", "x[a-z]*"};
+  clexNode* minimizeNfas[3];
+  const clexCompiledNfa* minimizeRules[3];
+  for (int i = 0; i < 3; i++) {
+    minimizeNfas[i] = clexNfaFromRe(minimizeRes[i], NULL);
+    minimizeRules[i] = clexNfaCompile(minimizeNfas[i]);
+  }
+  dfa = clexDfaBuild(minimizeRules, 3);
+  assert(dfa != NULL);
+  assert(clexDfaSourceStateCount(dfa) == 6);
+  assert(clexDfaStateCount(dfa) == 4);
+  assert(clexDfaMatch(dfa, "xab1", 4, &matchLength) == 0);
+  assert(matchLength == 3);
+  assert(clexDfaMatch(dfa, "42x", 3, &matchLength) == 1);
+  assert(matchLength == 2);
+  clexDfaDestroy(dfa);
+  for (int i = 0; i < 3; i++) {
+    clexCompiledNfaDestroy((clexCompiledNfa*)minimizeRules[i]);
+    clexNfaDestroy(minimizeNfas[i], NULL);
+  }
+
+  const char* literalRes[4] = {"(if)", "\\+\\+", "i[f]", "if*"};
+  const char* literalTexts[4] = {"if", "++", "if", NULL};
+  for (int i = 0; i < 4; i++) {
+    nfa = clexNfaFromRe(literalRes[i], NULL);
+    clexCompiledNfa* compiled = clexNfaCompile(nfa);
+    char literal[CLEX_LITERAL_MAX_LENGTH];
+    size_t literalLength = 0;
+    bool isLiteral = clexCompiledNfaLiteral(compiled, literal,
+                                            sizeof(literal), &literalLength);
+    assert(isLiteral == (literalTexts[i] != NULL));
+    if (isLiteral) {
+      assert(literalLength == strlen(literalTexts[i]));
+      assert(memcmp(literal, literalTexts[i], literalLength) == 0);
+    }
+    clexCompiledNfaDestroy(compiled);
+    clexNfaDestroy(nfa, NULL);
+  }
+
+  // Pairs of rules and whether some non-empty string matches both.
+  const char* overlapRes[][2] = {{"[a-z]+", "[0-9]+"}, {"[a-z]+", "while"},
+                                 {"a*", "b*"},         {"a*", "a*"},
+                                 {"ab|cd", "c[a-z]"},  {"[a-c]", "[d-f]"}};
+  const bool overlapExpected[] = {false, true, false, true, true, false};
+  for (int i = 0; i < 6; i++) {
+    clexNode* left = clexNfaFromRe(overlapRes[i][0], NULL);
+    clexNode* right = clexNfaFromRe(overlapRes[i][1], NULL);
+    clexCompiledNfa* leftCompiled = clexNfaCompile(left);
+    clexCompiledNfa* rightCompiled = clexNfaCompile(right);
+    assert(clexCompiledNfaOverlaps(leftCompiled, rightCompiled) ==
+           overlapExpected[i]);
+    assert(clexCompiledNfaOverlaps(rightCompiled, leftCompiled) ==
+           overlapExpected[i]);
+    clexCompiledNfaDestroy(leftCompiled);
+    clexCompiledNfaDestroy(rightCompiled);
+    clexNfaDestroy(left, NULL);
+    clexNfaDestroy(right, NULL);
+  }
+
+  // Arenas start small and grow with the pattern, so a thousand keyword
+  // rules stay far below one 4 KiB block each.
+  size_t arenaTotal = 0;
+  for (int i = 0; i < 1000; i++) {
+    char keyword[16];
+    sprintf(keyword, "kw%03d", i);
+    clexNode* nfa = clexNfaFromRe(keyword, NULL);
+    assert(nfa && clexNfaTest(nfa, keyword));
+    arenaTotal += clexNfaArenaSize(nfa);
+    clexNfaDestroy(nfa, NULL);
+  }
+  assert(arenaTotal < 1000 * 1024);
+  clexNode* longRule = clexNfaFromRe("[a-zA-Z_]([a-zA-Z_]|[0-9])*", NULL);
+  assert(clexNfaTest(longRule, "abc_12"));
+  clexNfaDestroy(longRule, NULL);
+
+  // A caller-supplied state needs no initialization when a pattern is given.
+  clexReLexerState dirtyState;
+  memset(&dirtyState, 0xA5, sizeof(dirtyState));
+  clexNode* dirtyNfa = clexNfaFromRe("ab|cd", &dirtyState);
+  assert(dirtyNfa && clexNfaTest(dirtyNfa, "cd"));
+  clexNfaDestroy(dirtyNfa, NULL);
+
+  // Rules and every byte a non-empty match can start with.
+  const char* firstRes[] = {"[a-z_]+", ";", "ab|cd", "a*b", "(x|y)z"};
+  const char* firstBytes[] = {"abcdefghijklmnopqrstuvwxyz_", ";", "ac", "ab",
+                              "xy"};
+  for (int i = 0; i < 5; i++) {
+    clexNode* nfa = clexNfaFromRe(firstRes[i], NULL);
+    clexCompiledNfa* compiled = clexNfaCompile(nfa);
+    bool first[CLEX_BYTE_COUNT];
+    assert(clexCompiledNfaFirstBytes(compiled, first));
+    for (int byte = 1; byte < CLEX_BYTE_COUNT; byte++)
+      assert(first[byte] == (strchr(firstBytes[i], byte) != NULL));
+    assert(!first[0]);
+    clexCompiledNfaDestroy(compiled);
+    clexNfaDestroy(nfa, NULL);
+  }
+
+  size_t keywordTotal = 500;
+  char (*keywords)[8] = malloc(keywordTotal * sizeof(*keywords));
+  const char** keywordTexts = malloc((keywordTotal + 1) * sizeof(char*));
+  size_t* keywordLengths = malloc((keywordTotal + 1) * sizeof(size_t));
+  int* keywordRules = malloc((keywordTotal + 1) * sizeof(int));
+  assert(keywords && keywordTexts && keywordLengths && keywordRules);
+  for (size_t i = 0; i < keywordTotal; i++) {
+    keywordLengths[i] = (size_t)sprintf(keywords[i], "kw%zu", i);
+    keywordTexts[i] = keywords[i];
+    keywordRules[i] = (int)i;
+  }
+  // A repeated literal keeps its first rule.
+  keywordTexts[keywordTotal] = "kw7";
+  keywordLengths[keywordTotal] = 3;
+  keywordRules[keywordTotal] = (int)keywordTotal;
+  clexLiteralSet* literalSet = clexLiteralSetBuild(
+      keywordTexts, keywordLengths, keywordRules, keywordTotal + 1);
+  assert(literalSet != NULL);
+  size_t literalMatch = 0;
+  assert(clexLiteralSetLongestMatch(literalSet, "kw499+", 6, &literalMatch) ==
+         499);
+  assert(literalMatch == 5);
+  assert(clexLiteralSetLongestMatch(literalSet, "kw49x", 5, &literalMatch) ==
+         49);
+  assert(literalMatch == 4);
+  assert(clexLiteralSetLongestMatch(literalSet, "kw7", 3, &literalMatch) == 7);
+  assert(clexLiteralSetLongestMatch(literalSet, "kx1", 3, &literalMatch) == -1);
+  clexLiteralSetDestroy(literalSet);
+  free(keywords);
+  free(keywordTexts);
+  free(keywordLengths);
+  free(keywordRules);
+
   nfa = clexNfaFromRe("[", NULL);
   assert(nfa == 0);
   nfa = clexNfaFromRe("\\", NULL);
@@ -608,8 +1565,30 @@ int main(void) {
   memcpy(longRegex + longLen, suffix, strlen(suffix) + 1);
   nfa = clexNfaFromRe(longRegex, NULL);
   assert(nfa != NULL);
+  longRegex[longLen] = '\0';
+  assert(clexNfaTest(nfa, longRegex) == true);
+  longRegex[longLen - 1] = 'b';
+  assert(clexNfaTest(nfa, longRegex) == false);
   clexNfaDestroy(nfa, NULL);
   free(longRegex);
+
+  // Large enough that closure tables quadratic in the union would need
+  // gigabytes.
+  size_t keywordCount = 16000;
+  char* unionRe = malloc(keywordCount * 8);
+  assert(unionRe != NULL);
+  size_t unionLength = 0;
+  for (size_t i = 0; i < keywordCount; i++)
+    unionLength += sprintf(unionRe + unionLength, "%sk%zu", i ? "|" : "", i);
+  nfa = clexNfaFromRe(unionRe, NULL);
+  assert(nfa != NULL);
+  assert(clexNfaTest(nfa, "k0") == true);
+  assert(clexNfaTest(nfa, "k1234") == true);
+  assert(clexNfaTest(nfa, "k15999") == true);
+  assert(clexNfaTest(nfa, "k16000") == false);
+  assert(clexNfaTest(nfa, "k") == false);
+  clexNfaDestroy(nfa, NULL);
+  free(unionRe);
 }
 #endif
 
@@ -625,3 +1604,89 @@ int main(void) {
   clexNfaDraw(nfa);
 }
 #endif
+
+#ifdef TEST_CLEXGEN
+
+#include <assert.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clex.h"
+
+// Defined by the scanner clexgen generates from tests.rules.
+clexStatus clexgenNext(const char* content, size_t length,
+                       clexSourcePosition* position, clexTokenView* out);
+
+static char* readRules(const char* path) {
+  FILE* file = fopen(path, "rb");
+  assert(file != NULL);
+  char* text = calloc(1 << 16, 1);
+  assert(text != NULL);
+  fread(text, 1, (1 << 16) - 1, file);
+  fclose(file);
+  return text;
+}
+
+static void expectSameTokens(clexLexer* lexer, const char* input,
+                             size_t length) {
+  clexResetWithLength(lexer, input, length);
+  clexSourcePosition position = {0, 1, 1};
+  for (;;) {
+    clexTokenView expected;
+    clexTokenView actual;
+    clexStatus status = clexView(lexer, &expected);
+    assert(clexgenNext(input, length, &position, &actual) == status);
+    assert(actual.kind == expected.kind);
+    assert(actual.lexeme == expected.lexeme);
+    assert(actual.length == expected.length);
+    assert(memcmp(&actual.span, &expected.span, sizeof(clexSourceSpan)) == 0);
+    if (status == CLEX_STATUS_EOF) break;
+  }
+}
+
+int main(void) {
+  clexLexer* lexer = clexInit();
+  char* rules = readRules("tests.rules");
+  for (char* line = strtok(rules, "\n"); line; line = strtok(NULL, "\n")) {
+    if (line[0] == '#') continue;
+    char* re = strchr(line, ' ');
+    assert(re != NULL);
+    *re++ = '\0';
+    assert(clexRegisterKind(lexer, re, atoi(line)) == CLEX_STATUS_OK);
+  }
+
+  const char* program =
+      "int main() {\n  int i = 0;\n  while (i <= 10) i++;\n"
+      "  if (i == 11) return 0; else return -1;\n}\n";
+  expectSameTokens(lexer, program, strlen(program));
+  expectSameTokens(lexer, "", 0);
+  const char* mixed = "a$b 0012 +++ <== \t\r\n x";
+  expectSameTokens(lexer, mixed, strlen(mixed));
+  // Both skip the same fixed whitespace set, even under a locale whose
+  // isspace() also accepts bytes such as 0xA0 or 0x85.
+  setlocale(LC_CTYPE, "en_US.ISO-8859-1");
+  const char* latin1 = "a\xA0 b\x85\v\fc";
+  expectSameTokens(lexer, latin1, strlen(latin1));
+  setlocale(LC_CTYPE, "C");
+
+  const char alphabet[] = "ifelsewhrtnu_019 ()+=-*<;{}\n\t$";
+  char input[200];
+  unsigned seed = 12345;
+  for (int round = 0; round < 2000; round++) {
+    size_t length = (size_t)round % sizeof(input);
+    for (size_t i = 0; i < length; i++) {
+      seed = seed * 1103515245u + 12345u;
+      input[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+    }
+    assert(clexSetEngine(lexer, round % 2 ? CLEX_ENGINE_DFA
+                                          : CLEX_ENGINE_NFA) ==
+           CLEX_STATUS_OK);
+    expectSameTokens(lexer, input, length);
+  }
+
+  clexLexerDestroy(lexer);
+  free(rules);
+}
+#endif